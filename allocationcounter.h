@@ -0,0 +1,39 @@
+#pragma once
+
+#include <atomic>
+
+using namespace std;
+
+
+// Counts heap allocations made through operator new (the counting operators are defined in main_file.cpp).
+// Read it before and after a piece of work to see how many allocations the work made.
+class AllocationCounter
+{
+
+private:
+
+    atomic<unsigned long long> count;
+
+    AllocationCounter() : count(0)
+    {
+    }
+
+
+public:
+
+    static AllocationCounter& instance()
+    {
+        static AllocationCounter counter;
+        return counter;
+    }
+
+    void add()
+    {
+        this->count.fetch_add(1, memory_order_relaxed);
+    }
+
+    unsigned long long getCount()
+    {
+        return this->count.load(memory_order_relaxed);
+    }
+};
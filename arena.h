@@ -0,0 +1,74 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <algorithm>
+
+using namespace std;
+
+
+// Hands out runs of items from a few large blocks, all freed together with the arena.
+// Items never move (a new block is started when the current one can't hold a run), so pointers into it stay valid.
+template <typename T>
+class Arena
+{
+
+private:
+
+    vector<unique_ptr<T[]>> blocks;
+    size_t blockSize;       // items in a block started by allocate() (unless the run is longer)
+    size_t used, capacity;  // items of the current block
+    size_t total;           // items in all the blocks
+
+
+public:
+
+    Arena(size_t blockSize)
+    {
+        this->blockSize = blockSize;
+        this->used = this->capacity = this->total = 0;
+        this->blocks.reserve(16);
+    }
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    // make sure the next <count> items fit in the current block (start one of at least <count> items if they don't)
+    void reserve(size_t count)
+    {
+        if (this->capacity - this->used >= count)
+        {
+            return;
+        }
+        this->capacity = max(count, this->blockSize);
+        this->blocks.push_back(unique_ptr<T[]>(new T[this->capacity]));
+        this->used = 0;
+        this->total += this->capacity;
+    }
+
+    // <count> consecutive default-constructed items
+    T* allocate(size_t count)
+    {
+        this->reserve(count);
+        T* items = this->blocks.back().get() + this->used;
+        this->used += count;
+        return items;
+    }
+
+    // free every block at once (pointers into them become invalid)
+    void clear()
+    {
+        this->blocks.clear();
+        this->used = this->capacity = this->total = 0;
+    }
+
+    size_t getBlockCount()
+    {
+        return this->blocks.size();
+    }
+
+    size_t getBytes()
+    {
+        return this->total * sizeof(T);
+    }
+};
@@ -0,0 +1,9 @@
+#version 330
+
+// occlusion query box: only the depth test matters (color writes are off)
+
+out vec4 pixelColor;
+
+void main(void) {
+	pixelColor = vec4(1);
+}
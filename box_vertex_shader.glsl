@@ -0,0 +1,23 @@
+#version 330
+
+//Prostopadłościan testu zasłaniania (patrz occlusionculling.h)
+
+//Dane klatki (wspólne dla wszystkich programów, patrz uniformbuffers.h)
+layout (std140) uniform FrameData
+{
+    mat4 P;
+    mat4 V;
+    mat4 PV;
+    vec4 cameraPosition;
+};
+
+//Narożniki prostopadłościanu w przestrzeni świata
+uniform vec4 boxMin;
+uniform vec4 boxMax;
+
+//Atrybuty
+layout ( location = 0 ) in vec3 corner;     //narożnik sześcianu jednostkowego (0 lub 1 na każdej osi)
+
+void main(void) {
+    gl_Position = PV * vec4(mix(boxMin.xyz, boxMax.xyz, corner), 1);
+}
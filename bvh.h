@@ -0,0 +1,245 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cfloat>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+using namespace std;
+
+
+struct AABB
+{
+    glm::vec3 min;
+    glm::vec3 max;
+};
+
+struct Ray
+{
+    glm::vec3 origin;
+    glm::vec3 direction;
+};
+
+struct BVHNode
+{
+    AABB bounds;
+    GLint first;    // leaf: first entry of <items>; inner node: left child (the right one follows it)
+    GLint count;    // items of a leaf (0: inner node)
+    GLint parent;   // -1: root
+};
+
+
+// Bounding volume hierarchy over a set of boxes (items are referred to by their index in the build list).
+// Built top-down by splitting at the median of the box centers along the longest axis. Moving items are
+// handled by refit(): the item's leaf and its ancestors are grown/shrunk to the new box, the tree shape stays.
+class BVH
+{
+
+private:
+
+    vector<BVHNode> nodes;
+    vector<GLuint> items;       // item indices, grouped by leaf
+    vector<AABB> boxes;         // by item
+    vector<GLint> itemLeaf;     // item -> its leaf node
+    vector<GLint> stack;        // traversal scratch
+
+
+    static AABB emptyBox()
+    {
+        AABB box;
+        box.min = glm::vec3(FLT_MAX);
+        box.max = glm::vec3(-FLT_MAX);
+        return box;
+    }
+
+    static void grow(AABB& box, const AABB& other)
+    {
+        box.min = glm::min(box.min, other.min);
+        box.max = glm::max(box.max, other.max);
+    }
+
+    AABB itemBounds(GLint first, GLint count)
+    {
+        AABB box = emptyBox();
+        for (GLint i = first; i < first + count; i++)
+        {
+            grow(box, this->boxes[this->items[i]]);
+        }
+        return box;
+    }
+
+    // node covering items[first..first+count)
+    void buildNode(GLint node, GLint first, GLint count, int leafSize)
+    {
+        this->nodes[node].bounds = this->itemBounds(first, count);
+        if (count <= leafSize)
+        {
+            this->nodes[node].first = first;
+            this->nodes[node].count = count;
+            for (GLint i = first; i < first + count; i++)
+            {
+                this->itemLeaf[this->items[i]] = node;
+            }
+            return;
+        }
+
+        AABB centers = emptyBox();
+        for (GLint i = first; i < first + count; i++)
+        {
+            const AABB& box = this->boxes[this->items[i]];
+            glm::vec3 center = 0.5f * (box.min + box.max);
+            centers.min = glm::min(centers.min, center);
+            centers.max = glm::max(centers.max, center);
+        }
+        glm::vec3 extent = centers.max - centers.min;
+        int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+
+        GLint half = count / 2;
+        const vector<AABB>& boxes = this->boxes;
+        nth_element(this->items.begin() + first, this->items.begin() + first + half, this->items.begin() + first + count, [&](GLuint a, GLuint b)
+        {
+            return boxes[a].min[axis] + boxes[a].max[axis] < boxes[b].min[axis] + boxes[b].max[axis];
+        });
+
+        GLint left = GLint(this->nodes.size());
+        this->nodes.resize(this->nodes.size() + 2);
+        this->nodes[node].first = left;
+        this->nodes[node].count = 0;
+        this->nodes[left].parent = node;
+        this->nodes[left + 1].parent = node;
+        this->buildNode(left, first, half, leafSize);
+        this->buildNode(left + 1, first + half, count - half, leafSize);
+    }
+
+
+public:
+
+    // slab test; true if the ray enters the box before tMax (tEnter: where)
+    static bool intersect(const AABB& box, const Ray& ray, const glm::vec3& inverseDirection, GLfloat tMax, GLfloat& tEnter)
+    {
+        glm::vec3 t0 = (box.min - ray.origin) * inverseDirection;
+        glm::vec3 t1 = (box.max - ray.origin) * inverseDirection;
+        glm::vec3 tNear = glm::min(t0, t1), tFar = glm::max(t0, t1);
+        tEnter = max(max(tNear.x, tNear.y), max(tNear.z, 0.0f));
+        GLfloat tExit = min(min(tFar.x, tFar.y), min(tFar.z, tMax));
+        return tEnter <= tExit;
+    }
+
+    static AABB transform(const AABB& box, const glm::mat4& M)
+    {
+        AABB result = emptyBox();
+        for (int corner = 0; corner < 8; corner++)
+        {
+            glm::vec3 point((corner & 1) ? box.max.x : box.min.x, (corner & 2) ? box.max.y : box.min.y, (corner & 4) ? box.max.z : box.min.z);
+            glm::vec3 world = glm::vec3(M * glm::vec4(point, 1.0f));
+            result.min = glm::min(result.min, world);
+            result.max = glm::max(result.max, world);
+        }
+        return result;
+    }
+
+    void build(const vector<AABB>& boxes, int leafSize = 2)
+    {
+        this->boxes = boxes;
+        this->items.resize(boxes.size());
+        this->itemLeaf.assign(boxes.size(), -1);
+        for (GLuint i = 0; i < boxes.size(); i++)
+        {
+            this->items[i] = i;
+        }
+        this->nodes.clear();
+        this->nodes.reserve(2 * boxes.size());
+        if (boxes.empty())
+        {
+            return;
+        }
+        this->nodes.resize(1);
+        this->nodes[0].parent = -1;
+        this->buildNode(0, 0, GLint(boxes.size()), leafSize);
+    }
+
+    // an item moved: update its box and the boxes above it
+    void refit(GLuint item, const AABB& box)
+    {
+        this->boxes[item] = box;
+        GLint node = this->itemLeaf[item];
+        this->nodes[node].bounds = this->itemBounds(this->nodes[node].first, this->nodes[node].count);
+        for (node = this->nodes[node].parent; node >= 0; node = this->nodes[node].parent)
+        {
+            AABB bounds = this->nodes[this->nodes[node].first].bounds;
+            grow(bounds, this->nodes[this->nodes[node].first + 1].bounds);
+            this->nodes[node].bounds = bounds;
+        }
+    }
+
+    // visit the items whose boxes the ray enters before tMax, nearer subtrees first;
+    // test(item, tMax) checks the item itself and lowers tMax on a hit (later boxes beyond it are skipped)
+    template <typename Test>
+    void traverse(const Ray& ray, GLfloat& tMax, Test test)
+    {
+        if (this->nodes.empty())
+        {
+            return;
+        }
+        glm::vec3 inverseDirection = 1.0f / ray.direction;
+        GLfloat tEnter;
+        this->stack.clear();
+        this->stack.push_back(0);
+        while (!this->stack.empty())
+        {
+            const BVHNode& node = this->nodes[this->stack.back()];
+            this->stack.pop_back();
+            if (!intersect(node.bounds, ray, inverseDirection, tMax, tEnter))
+            {
+                continue;
+            }
+            if (node.count > 0)
+            {
+                for (GLint i = node.first; i < node.first + node.count; i++)
+                {
+                    test(this->items[i], tMax);
+                }
+                continue;
+            }
+
+            // push the farther child first
+            GLfloat tLeft = FLT_MAX, tRight = FLT_MAX;
+            bool hitLeft = intersect(this->nodes[node.first].bounds, ray, inverseDirection, tMax, tLeft);
+            bool hitRight = intersect(this->nodes[node.first + 1].bounds, ray, inverseDirection, tMax, tRight);
+            GLint left = node.first;
+            if (hitLeft && hitRight)
+            {
+                this->stack.push_back(tLeft <= tRight ? left + 1 : left);
+                this->stack.push_back(tLeft <= tRight ? left : left + 1);
+            }
+            else if (hitLeft || hitRight)
+            {
+                this->stack.push_back(hitLeft ? left : left + 1);
+            }
+        }
+    }
+
+    const AABB& getBounds()
+    {
+        return this->nodes[0].bounds;
+    }
+
+    bool isEmpty()
+    {
+        return this->nodes.empty();
+    }
+
+    int getNodeCount()
+    {
+        return int(this->nodes.size());
+    }
+
+    // CPU memory held by the tree (nodes and per-item tables)
+    size_t getBytes()
+    {
+        return this->nodes.size() * sizeof(BVHNode) + this->items.size() * sizeof(GLuint)
+            + this->boxes.size() * sizeof(AABB) + this->itemLeaf.size() * sizeof(GLint);
+    }
+};
@@ -0,0 +1,253 @@
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include "shaderprogram.h"
+#include "glstate.h"
+#include "uniformbuffers.h"
+#include "streambuffer.h"
+
+using namespace std;
+
+
+// buffer textures with the light data (sampled by the fragment shader)
+const GLuint TEXTURE_UNIT_LIGHTS = 2;
+const GLuint TEXTURE_UNIT_CLUSTERS = 3;
+const GLuint TEXTURE_UNIT_LIGHT_INDICES = 4;
+
+// cluster grid: screen tiles x depth slices (exponential in view depth)
+const int CLUSTERS_X = 16;
+const int CLUSTERS_Y = 9;
+const int CLUSTERS_Z = 24;
+
+const int LIGHT_TEXELS = 3;     // RGBA32F texels per light, see uploadLights()
+
+
+// Clustered forward lighting: every frame the lights are binned on the CPU into view-space clusters
+// (screen tile x depth slice), and each cluster gets a list of the lights whose range reaches it.
+// The fragment shader looks up its cluster and loops over that list only, so shading cost grows
+// with the local light density instead of the total number of lights.
+class ClusteredLighting
+{
+
+private:
+
+    StreamBuffer lightStream;       // RGBA32F: per light (position, radius) (color, shininess) (direction, spot cos)
+    StreamBuffer clusterStream;     // RG32UI: per cluster (first index, light count)
+    StreamBuffer indexStream;       // R32UI: light indices, grouped by cluster
+
+    // built on the CPU (binning reads them back), then copied into the streams
+    vector<GLuint> clusterTexels;
+    vector<GLuint> lightIndices;
+
+    // cluster range of each light, computed once per frame and used by both binning passes
+    struct ClusterRange
+    {
+        int x0, x1, y0, y1, z0, z1;
+    };
+    vector<ClusterRange> ranges;
+
+    int lastLightCount;
+
+
+    static void upload(StreamBuffer& stream, const void* data, size_t size)
+    {
+        memcpy(stream.begin(GLsizeiptr(size)), data, size);
+        stream.end();
+    }
+
+    static int depthSlice(GLfloat depth, GLfloat scale, GLfloat bias)
+    {
+        return glm::clamp(int(floor(log(depth) * scale + bias)), 0, CLUSTERS_Z - 1);
+    }
+
+    // conservative cluster range covered by the light's bounding sphere; false if it is outside the view
+    bool clusterRange(const Light& light, const glm::mat4& V, const glm::mat4& P, GLfloat nearPlane, GLfloat farPlane, GLfloat scale, GLfloat bias, ClusterRange& range)
+    {
+        range.x0 = 0; range.x1 = CLUSTERS_X - 1;
+        range.y0 = 0; range.y1 = CLUSTERS_Y - 1;
+        range.z0 = 0; range.z1 = CLUSTERS_Z - 1;
+
+        // unbounded light: reaches every cluster
+        if (light.radius <= 0.0f)
+        {
+            return true;
+        }
+
+        glm::vec3 center = glm::vec3(V * glm::vec4(light.position, 1.0f));
+        GLfloat nearDepth = -center.z - light.radius, farDepth = -center.z + light.radius;
+        if (farDepth < nearPlane || nearDepth > farPlane)
+        {
+            return false;
+        }
+
+        range.z0 = depthSlice(max(nearDepth, nearPlane), scale, bias);
+        range.z1 = depthSlice(min(farDepth, farPlane), scale, bias);
+
+        // a sphere crossing the near plane can cover any tile
+        if (nearDepth <= nearPlane)
+        {
+            return true;
+        }
+
+        // project the corners of the sphere's view-space box (all in front of the camera)
+        glm::vec2 ndcMin(1.0f), ndcMax(-1.0f);
+        for (int corner = 0; corner < 8; corner++)
+        {
+            glm::vec4 point(center.x + ((corner & 1) ? light.radius : -light.radius),
+                center.y + ((corner & 2) ? light.radius : -light.radius),
+                (corner & 4) ? -nearDepth : -farDepth, 1.0f);
+            glm::vec4 clip = P * point;
+            glm::vec2 ndc = glm::vec2(clip) / clip.w;
+            ndcMin = glm::min(ndcMin, ndc);
+            ndcMax = glm::max(ndcMax, ndc);
+        }
+        if (ndcMax.x < -1.0f || ndcMin.x > 1.0f || ndcMax.y < -1.0f || ndcMin.y > 1.0f)
+        {
+            return false;
+        }
+
+        range.x0 = glm::clamp(int((ndcMin.x * 0.5f + 0.5f) * CLUSTERS_X), 0, CLUSTERS_X - 1);
+        range.x1 = glm::clamp(int((ndcMax.x * 0.5f + 0.5f) * CLUSTERS_X), 0, CLUSTERS_X - 1);
+        range.y0 = glm::clamp(int((ndcMin.y * 0.5f + 0.5f) * CLUSTERS_Y), 0, CLUSTERS_Y - 1);
+        range.y1 = glm::clamp(int((ndcMax.y * 0.5f + 0.5f) * CLUSTERS_Y), 0, CLUSTERS_Y - 1);
+        return true;
+    }
+
+    // written straight into the stream (the GPU's copy of the lights is write-only for the CPU)
+    void uploadLights(const vector<Light>& lights)
+    {
+        glm::vec4* lightTexels = (glm::vec4*)this->lightStream.begin(GLsizeiptr(lights.size() * LIGHT_TEXELS * sizeof(glm::vec4)));
+        for (GLuint i = 0; i < lights.size(); i++)
+        {
+            GLfloat spotCos = lights[i].spotAngle > 0.0f ? cos(glm::radians(lights[i].spotAngle)) : -2.0f;    // -2: no cone
+            lightTexels[i * LIGHT_TEXELS + 0] = glm::vec4(lights[i].position, lights[i].radius);
+            lightTexels[i * LIGHT_TEXELS + 1] = glm::vec4(lights[i].color, lights[i].shininess);
+            glm::vec3 direction = glm::length(lights[i].direction) > 0.0f ? glm::normalize(lights[i].direction) : glm::vec3(0.0f, -1.0f, 0.0f);
+            lightTexels[i * LIGHT_TEXELS + 2] = glm::vec4(direction, spotCos);
+        }
+        this->lightStream.end();
+    }
+
+
+public:
+
+    ClusteredLighting() : lightStream("clustered lighting: lights", GL_RGBA32F), clusterStream("clustered lighting: clusters", GL_RG32UI),
+        indexStream("clustered lighting: light indices", GL_R32UI)
+    {
+        this->clusterTexels.resize(CLUSTERS_X * CLUSTERS_Y * CLUSTERS_Z * 2);
+        this->lastLightCount = 0;
+    }
+
+    ClusteredLighting(const ClusteredLighting&) = delete;
+    ClusteredLighting& operator=(const ClusteredLighting&) = delete;
+
+    // point the program's light samplers at the fixed units (once per program)
+    void attach(ShaderProgram* shader)
+    {
+        shader->use();
+        GLStateCache::instance().uniform1i(shader->u("lightTexels"), TEXTURE_UNIT_LIGHTS);
+        GLStateCache::instance().uniform1i(shader->u("clusterTexels"), TEXTURE_UNIT_CLUSTERS);
+        GLStateCache::instance().uniform1i(shader->u("lightIndices"), TEXTURE_UNIT_LIGHT_INDICES);
+    }
+
+    // once per frame: bin the lights into the clusters of the current view and upload the lists
+    // (width/height: size of the framebuffer being rendered)
+    void update(const vector<Light>& lights, const glm::vec3& ambient, const glm::mat4& V, const glm::mat4& P,
+        GLfloat nearPlane, GLfloat farPlane, int width, int height, UniformBuffers& uniformBuffers)
+    {
+        // slice = log(depth) * scale + bias  maps [near, far] onto [0, CLUSTERS_Z]
+        GLfloat scale = CLUSTERS_Z / log(farPlane / nearPlane);
+        GLfloat bias = -CLUSTERS_Z * log(nearPlane) / log(farPlane / nearPlane);
+
+        this->uploadLights(lights);
+
+        // pass 1: count the lights of each cluster
+        this->ranges.resize(lights.size());
+        fill(this->clusterTexels.begin(), this->clusterTexels.end(), 0u);
+        for (GLuint i = 0; i < lights.size(); i++)
+        {
+            ClusterRange& range = this->ranges[i];
+            if (!this->clusterRange(lights[i], V, P, nearPlane, farPlane, scale, bias, range))
+            {
+                range.z0 = 1;   // empty range
+                range.z1 = 0;
+            }
+            for (int z = range.z0; z <= range.z1; z++)
+            {
+                for (int y = range.y0; y <= range.y1; y++)
+                {
+                    for (int x = range.x0; x <= range.x1; x++)
+                    {
+                        this->clusterTexels[((z * CLUSTERS_Y + y) * CLUSTERS_X + x) * 2 + 1]++;
+                    }
+                }
+            }
+        }
+
+        // prefix sum: first index of each cluster
+        GLuint total = 0;
+        for (GLuint cluster = 0; cluster < this->clusterTexels.size(); cluster += 2)
+        {
+            this->clusterTexels[cluster] = total;
+            total += this->clusterTexels[cluster + 1];
+            this->clusterTexels[cluster + 1] = 0;   // refilled by pass 2
+        }
+
+        // pass 2: write the light indices
+        this->lightIndices.resize(total);
+        for (GLuint i = 0; i < lights.size(); i++)
+        {
+            const ClusterRange& range = this->ranges[i];
+            for (int z = range.z0; z <= range.z1; z++)
+            {
+                for (int y = range.y0; y <= range.y1; y++)
+                {
+                    for (int x = range.x0; x <= range.x1; x++)
+                    {
+                        GLuint* cluster = &this->clusterTexels[((z * CLUSTERS_Y + y) * CLUSTERS_X + x) * 2];
+                        this->lightIndices[cluster[0] + cluster[1]++] = i;
+                    }
+                }
+            }
+        }
+
+        upload(this->clusterStream, this->clusterTexels.data(), this->clusterTexels.size() * sizeof(GLuint));
+        upload(this->indexStream, this->lightIndices.data(), this->lightIndices.size() * sizeof(GLuint));
+
+        LightUniforms lightData;
+        lightData.ambient = glm::vec4(ambient, 1.0f);
+        lightData.lightCount = glm::ivec4(int(lights.size()), 0, 0, 0);
+        lightData.clusterGrid = glm::ivec4(CLUSTERS_X, CLUSTERS_Y, CLUSTERS_Z, 0);
+        lightData.clusterParameters = glm::vec4(GLfloat(width), GLfloat(height), scale, bias);
+        uniformBuffers.setLightData(lightData);
+
+        if (int(lights.size()) != this->lastLightCount)
+        {
+            this->lastLightCount = int(lights.size());
+            cout << "ClusteredLighting: " << lights.size() << " lights, " << total << " cluster entries\n";
+        }
+    }
+
+    // bind the light buffers to their units (before drawing)
+    void bind()
+    {
+        GLStateCache::instance().bindTexture(TEXTURE_UNIT_LIGHTS, GL_TEXTURE_BUFFER, this->lightStream.texture());
+        GLStateCache::instance().bindTexture(TEXTURE_UNIT_CLUSTERS, GL_TEXTURE_BUFFER, this->clusterStream.texture());
+        GLStateCache::instance().bindTexture(TEXTURE_UNIT_LIGHT_INDICES, GL_TEXTURE_BUFFER, this->indexStream.texture());
+    }
+
+    // after the frame's draws (the streams' segments are reused once the GPU has passed this point)
+    void fence()
+    {
+        this->lightStream.fence();
+        this->clusterStream.fence();
+        this->indexStream.fence();
+    }
+};
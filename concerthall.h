@@ -0,0 +1,302 @@
+#pragma once
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <cmath>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "shaderprogram.h"
+#include "glstate.h"
+#include "renderqueue.h"
+#include "memoryaccounting.h"
+
+using namespace std;
+
+
+// buffer texture with the placement of every piano (sampled by the PIANO_INSTANCES shader variants)
+const GLuint TEXTURE_UNIT_PIANO_PLACEMENTS = 8;
+
+const GLfloat PIANO_SPACING_X = 3.0f;   // distance between neighbouring pianos in the hall grid
+const GLfloat PIANO_SPACING_Z = 3.5f;
+
+
+// Many pianos sharing one Model: every mesh is drawn once for all of them as an instanced draw, and the
+// PIANO_INSTANCES vertex shader places instance i with its placement matrix and poses its keys from
+// piano i's block of the key state buffer (keys of piano i start at i * key count).
+// Piano 0 stands at the origin and plays the model's own key states (the keyboard input);
+// the others play random keys on their own.
+class ConcertHall
+{
+
+private:
+
+    int keyCount;
+    int pianoCount;
+
+    vector<glm::mat4> placements;
+    vector<GLfloat> pressAmounts;   // key states of all the pianos
+    vector<signed char> keyMotion;  // the other pianos' keys: 1 - going down, -1 - coming up, 0 - at rest
+    unsigned int randomState;
+
+    GLuint placementBuffer, placementTexture;
+
+
+    unsigned int nextRandom()
+    {
+        this->randomState = this->randomState * 1664525u + 1013904223u;
+        return this->randomState >> 8;
+    }
+
+    // pianos in a square-ish grid behind the first one
+    void layOut()
+    {
+        int columns = int(ceil(sqrt(GLfloat(this->pianoCount))));
+        this->placements.resize(this->pianoCount);
+        for (int i = 0; i < this->pianoCount; i++)
+        {
+            int column = i % columns, row = i / columns;
+            GLfloat x = (column % 2 == 0 ? 1.0f : -1.0f) * GLfloat((column + 1) / 2) * PIANO_SPACING_X;   // alternating around the first column
+            this->placements[i] = glm::translate(glm::mat4(1.0f), glm::vec3(x, 0.0f, -GLfloat(row) * PIANO_SPACING_Z));
+        }
+
+        glBindBuffer(GL_TEXTURE_BUFFER, this->placementBuffer);
+        glBufferData(GL_TEXTURE_BUFFER, this->placements.size() * sizeof(glm::mat4), this->placements.data(), GL_STATIC_DRAW);
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+        MemoryAccounting::instance().set("concert hall placements", MEMORY_GL_BUFFERS, this->placements.size() * sizeof(glm::mat4));
+        GLStateCache::instance().editTexture(GL_TEXTURE_BUFFER, this->placementTexture);
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, this->placementBuffer);
+    }
+
+
+public:
+
+    ConcertHall(int keyCount)
+    {
+        this->keyCount = keyCount;
+        this->pianoCount = 0;
+        this->randomState = 12345u;
+
+        glGenBuffers(1, &this->placementBuffer);
+        glGenTextures(1, &this->placementTexture);
+        this->setPianoCount(1);
+    }
+
+    ~ConcertHall()
+    {
+        GLStateCache::instance().forgetTexture(this->placementTexture);
+        glDeleteTextures(1, &this->placementTexture);
+        glDeleteBuffers(1, &this->placementBuffer);
+        MemoryAccounting::instance().set("concert hall placements", MEMORY_GL_BUFFERS, 0);
+    }
+
+    ConcertHall(const ConcertHall&) = delete;
+    ConcertHall& operator=(const ConcertHall&) = delete;
+
+    // connect the program's placement sampler and key stride (once per program)
+    void attach(ShaderProgram* shader)
+    {
+        GLStateCache& state = GLStateCache::instance();
+        shader->use();
+        state.uniform1i(shader->u("pianoPlacements"), TEXTURE_UNIT_PIANO_PLACEMENTS);
+        state.uniform1i(shader->u("pianoKeyCount"), this->keyCount);
+    }
+
+    void setPianoCount(int pianoCount)
+    {
+        pianoCount = max(pianoCount, 1);
+        if (pianoCount == this->pianoCount)
+        {
+            return;
+        }
+        this->pianoCount = pianoCount;
+        this->pressAmounts.assign(this->pianoCount * this->keyCount, 0.0f);
+        this->keyMotion.assign(this->pianoCount * this->keyCount, 0);
+        this->layOut();
+    }
+
+    int getPianoCount()
+    {
+        return this->pianoCount;
+    }
+
+    const vector<glm::mat4>& getPlacements()
+    {
+        return this->placements;
+    }
+
+    // once per frame: take piano 0's keys from the model and move the other pianos' keys
+    // (same rates as the mesh animation: 0.2 of the way down and 0.175 up per frame)
+    const vector<GLfloat>& update(const vector<GLfloat>& modelPressAmounts)
+    {
+        for (int key = 0; key < this->keyCount && key < int(modelPressAmounts.size()); key++)
+        {
+            this->pressAmounts[key] = modelPressAmounts[key];
+        }
+
+        for (int i = this->keyCount; i < int(this->pressAmounts.size()); i++)
+        {
+            if (this->keyMotion[i] > 0)
+            {
+                this->pressAmounts[i] = min(this->pressAmounts[i] + 0.2f, 1.0f);
+                this->keyMotion[i] = this->pressAmounts[i] >= 1.0f ? -1 : 1;
+            }
+            else if (this->keyMotion[i] < 0)
+            {
+                this->pressAmounts[i] = max(this->pressAmounts[i] - 0.175f, 0.0f);
+                this->keyMotion[i] = this->pressAmounts[i] <= 0.0f ? 0 : -1;
+            }
+        }
+
+        // a few new notes per piano and second
+        for (int piano = 1; piano < this->pianoCount; piano++)
+        {
+            if (this->nextRandom() % 16 == 0)
+            {
+                int key = piano * this->keyCount + int(this->nextRandom() % this->keyCount);
+                if (this->keyMotion[key] == 0)
+                {
+                    this->keyMotion[key] = 1;
+                }
+            }
+        }
+        return this->pressAmounts;
+    }
+
+    // start a key of one of the other pianos going down (it comes back up by itself)
+    void pressKey(int piano, int key)
+    {
+        if (piano > 0 && piano < this->pianoCount && key >= 0 && key < this->keyCount)
+        {
+            this->keyMotion[piano * this->keyCount + key] = 1;
+        }
+    }
+
+    void bind()
+    {
+        GLStateCache::instance().bindTexture(TEXTURE_UNIT_PIANO_PLACEMENTS, GL_TEXTURE_BUFFER, this->placementTexture);
+    }
+
+    // GPU data held for the pianos beyond the shared model (placements and one frame of key states)
+    GLsizeiptr getInstanceBytes()
+    {
+        return GLsizeiptr(this->placements.size() * sizeof(glm::mat4) + this->pressAmounts.size() * sizeof(GLfloat));
+    }
+
+    void printStats()
+    {
+        cout << "ConcertHall: " << this->pianoCount << " pianos, " << this->getInstanceBytes() << " bytes of per-piano data\n";
+    }
+};
+
+
+// Stress test of the concert hall: renders a fixed number of frames at 1, 10, 100 and 1000 pianos
+// and reports the frame time, the per-piano memory and the draw calls of each step.
+// (main drives it: frameDone() after every frame while isRunning(), with vsync off)
+class HallBenchmark
+{
+
+private:
+
+    static const int STEP_COUNT = 4;
+    static const int WARMUP_FRAMES = 30;
+    static const int MEASURED_FRAMES = 120;
+
+    int step;       // -1: not running
+    int frame;
+    double stepTime;
+
+    struct Result
+    {
+        int pianos;
+        double milliseconds;
+        int draws, instances, calls;
+        GLsizeiptr bytes;
+    };
+    vector<Result> results;
+
+
+public:
+
+    HallBenchmark()
+    {
+        this->step = -1;
+        this->frame = 0;
+        this->stepTime = 0.0;
+    }
+
+    void start()
+    {
+        cout << "HallBenchmark: started\n";
+        this->step = 0;
+        this->frame = 0;
+        this->stepTime = 0.0;
+        this->results.clear();
+    }
+
+    bool isRunning()
+    {
+        return this->step >= 0;
+    }
+
+    // pianos the current step renders
+    int getPianoCount()
+    {
+        const int counts[STEP_COUNT] = { 1, 10, 100, 1000 };
+        return counts[max(this->step, 0)];
+    }
+
+    // after each frame: its duration (seconds), the queue's work and the memory the pianos take
+    void frameDone(double seconds, const RenderQueueStats& queue, GLsizeiptr bytes)
+    {
+        if (!this->isRunning())
+        {
+            return;
+        }
+        this->frame++;
+        if (this->frame <= WARMUP_FRAMES)
+        {
+            return;
+        }
+        this->stepTime += seconds;
+        if (this->frame < WARMUP_FRAMES + MEASURED_FRAMES)
+        {
+            return;
+        }
+
+        Result result;
+        result.pianos = this->getPianoCount();
+        result.milliseconds = 1000.0 * this->stepTime / MEASURED_FRAMES;
+        result.draws = queue.draws;
+        result.instances = queue.instances;
+        result.calls = queue.calls;
+        result.bytes = bytes;
+        this->results.push_back(result);
+        cout << "HallBenchmark: " << result.pianos << " pianos: " << result.milliseconds << " ms per frame\n";
+
+        this->step++;
+        this->frame = 0;
+        this->stepTime = 0.0;
+        if (this->step == STEP_COUNT)
+        {
+            this->step = -1;
+            this->printResults();
+        }
+    }
+
+    void printResults()
+    {
+        cout << "\nHallBenchmark results:\n";
+        cout << setw(8) << "pianos" << setw(12) << "ms/frame" << setw(10) << "draws" << setw(12) << "instances" << setw(10) << "calls" << setw(14) << "bytes" << "\n";
+        for (GLuint i = 0; i < this->results.size(); i++)
+        {
+            const Result& result = this->results[i];
+            cout << setw(8) << result.pianos << setw(12) << fixed << setprecision(2) << result.milliseconds << defaultfloat
+                << setw(10) << result.draws << setw(12) << result.instances << setw(10) << result.calls << setw(14) << result.bytes << "\n";
+        }
+        cout << endl;
+    }
+};
@@ -0,0 +1,295 @@
+#pragma once
+
+#include <iostream>
+#include <cmath>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include "glstate.h"
+#include "memoryaccounting.h"
+
+using namespace std;
+
+
+const int FRAME_TIMER_QUERIES = 4;  // timer queries in flight (results are read a few frames late, never waited for)
+
+struct DynamicResolutionSettings
+{
+    GLfloat targetMilliseconds;     // GPU time budget of a frame
+    GLfloat minScale, maxScale;     // limits of the render scale (per axis)
+    GLfloat scaleStep;              // the scale moves in steps of this size
+    GLfloat downThreshold;          // scale down above target * downThreshold...
+    GLfloat upThreshold;            // ...and up below target * upThreshold (the gap between them is the hysteresis)
+    int settleFrames;               // frames to wait after a change before judging the new scale
+};
+
+struct DynamicResolutionStats
+{
+    GLfloat scale;
+    int width, height;              // resolution rendered at
+    GLfloat gpuMilliseconds;        // smoothed GPU time of a frame
+    int changes;                    // scale changes so far
+};
+
+
+// Renders the frame into an offscreen framebuffer at a fraction of the window resolution and stretches it
+// to the window with a linear blit. The fraction follows the measured GPU time of the frames (timer queries):
+// fragment cost goes with the pixel count, so the scale is corrected by sqrt(target / time), but only
+// when the time leaves the band between the two thresholds and only after the previous change has settled.
+// The framebuffer is allocated at the window size and the scaled frame uses its lower left corner,
+// so changing the scale never reallocates anything.
+class DynamicResolution
+{
+
+private:
+
+    DynamicResolutionSettings settings;
+    bool enabled;
+
+    GLuint framebuffer, colorTexture, depthBuffer;
+    int framebufferWidth, framebufferHeight;
+    int windowWidth, windowHeight;
+
+    GLuint timerQueries[FRAME_TIMER_QUERIES];
+    bool timerPending[FRAME_TIMER_QUERIES];
+    int timerIndex;
+    bool timing;    // the current frame is being timed
+    int framesSinceChange;
+
+    DynamicResolutionStats stats;
+
+
+    // (re)create the framebuffer for a window size
+    void createFramebuffer(int width, int height)
+    {
+        if (this->framebuffer == 0)
+        {
+            glGenFramebuffers(1, &this->framebuffer);
+            glGenTextures(1, &this->colorTexture);
+            glGenRenderbuffers(1, &this->depthBuffer);
+        }
+
+        GLStateCache::instance().editTexture(GL_TEXTURE_2D, this->colorTexture);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+        glBindRenderbuffer(GL_RENDERBUFFER, this->depthBuffer);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+        glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, this->framebuffer);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, this->colorTexture, 0);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, this->depthBuffer);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        {
+            cout << "DynamicResolution: framebuffer incomplete, rendering at full resolution\n";
+            this->enabled = false;
+        }
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        MemoryAccounting::instance().set("dynamic resolution target", MEMORY_TEXTURES, size_t(width) * height * (4 + 3));    // RGBA8 + DEPTH24
+
+        this->framebufferWidth = width;
+        this->framebufferHeight = height;
+    }
+
+    // pick up finished timer queries and adjust the scale
+    void readTimers()
+    {
+        for (int i = 0; i < FRAME_TIMER_QUERIES; i++)
+        {
+            int query = (this->timerIndex + i) % FRAME_TIMER_QUERIES;     // oldest first
+            if (!this->timerPending[query])
+            {
+                continue;
+            }
+            GLuint available = GL_FALSE;
+            glGetQueryObjectuiv(this->timerQueries[query], GL_QUERY_RESULT_AVAILABLE, &available);
+            if (!available)
+            {
+                break;
+            }
+            GLuint64 nanoseconds = 0;
+            glGetQueryObjectui64v(this->timerQueries[query], GL_QUERY_RESULT, &nanoseconds);
+            this->timerPending[query] = false;
+
+            GLfloat milliseconds = GLfloat(nanoseconds) / 1.0e6f;
+            this->stats.gpuMilliseconds = this->stats.gpuMilliseconds > 0.0f ? glm::mix(this->stats.gpuMilliseconds, milliseconds, 0.2f) : milliseconds;
+            this->framesSinceChange++;
+        }
+    }
+
+    void adjustScale()
+    {
+        if (this->framesSinceChange < this->settings.settleFrames || this->stats.gpuMilliseconds <= 0.0f)
+        {
+            return;
+        }
+        GLfloat time = this->stats.gpuMilliseconds, target = this->settings.targetMilliseconds;
+        if (time < target * this->settings.downThreshold && time > target * this->settings.upThreshold)
+        {
+            return;
+        }
+
+        // the pixel count (and so the fragment time) goes with the square of the scale
+        GLfloat scale = this->stats.scale * sqrt(target / time);
+        scale = floor(scale / this->settings.scaleStep + 0.5f) * this->settings.scaleStep;
+        scale = glm::clamp(scale, this->settings.minScale, this->settings.maxScale);
+        if (scale != this->stats.scale)
+        {
+            this->stats.scale = scale;
+            this->stats.changes++;
+            this->framesSinceChange = 0;
+        }
+    }
+
+
+public:
+
+    DynamicResolution()
+    {
+        this->settings.targetMilliseconds = 16.6f;
+        this->settings.minScale = 0.5f;
+        this->settings.maxScale = 1.0f;
+        this->settings.scaleStep = 0.05f;
+        this->settings.downThreshold = 1.05f;
+        this->settings.upThreshold = 0.7f;
+        this->settings.settleFrames = 10;
+        this->enabled = true;
+
+        this->framebuffer = this->colorTexture = this->depthBuffer = 0;
+        this->framebufferWidth = this->framebufferHeight = 0;
+        this->windowWidth = this->windowHeight = 0;
+
+        glGenQueries(FRAME_TIMER_QUERIES, this->timerQueries);
+        for (int i = 0; i < FRAME_TIMER_QUERIES; i++)
+        {
+            this->timerPending[i] = false;
+        }
+        this->timerIndex = 0;
+        this->timing = false;
+        this->framesSinceChange = 0;
+
+        this->stats = DynamicResolutionStats();
+        this->stats.scale = this->settings.maxScale;
+    }
+
+    ~DynamicResolution()
+    {
+        glDeleteQueries(FRAME_TIMER_QUERIES, this->timerQueries);
+        if (this->framebuffer != 0)
+        {
+            glDeleteFramebuffers(1, &this->framebuffer);
+            GLStateCache::instance().forgetTexture(this->colorTexture);
+            glDeleteTextures(1, &this->colorTexture);
+            glDeleteRenderbuffers(1, &this->depthBuffer);
+            MemoryAccounting::instance().set("dynamic resolution target", MEMORY_TEXTURES, 0);
+        }
+    }
+
+    DynamicResolution(const DynamicResolution&) = delete;
+    DynamicResolution& operator=(const DynamicResolution&) = delete;
+
+    void setSettings(const DynamicResolutionSettings& settings)
+    {
+        this->settings = settings;
+        this->stats.scale = glm::clamp(this->stats.scale, settings.minScale, settings.maxScale);
+    }
+
+    const DynamicResolutionSettings& getSettings()
+    {
+        return this->settings;
+    }
+
+    void setEnabled(bool enabled)
+    {
+        this->enabled = enabled;
+        this->framesSinceChange = 0;
+    }
+
+    bool isEnabled()
+    {
+        return this->enabled;
+    }
+
+    // start a frame for a window of the given size: binds the framebuffer to draw into (and starts timing the frame)
+    // the frame has to be drawn at getWidth() x getHeight()
+    void begin(int windowWidth, int windowHeight)
+    {
+        this->windowWidth = windowWidth;
+        this->windowHeight = windowHeight;
+
+        this->readTimers();
+        if (this->enabled)
+        {
+            this->adjustScale();
+        }
+
+        // (if this query is still in flight the frame goes untimed)
+        this->timing = !this->timerPending[this->timerIndex];
+        if (this->timing)
+        {
+            glBeginQuery(GL_TIME_ELAPSED, this->timerQueries[this->timerIndex]);
+        }
+
+        if (this->enabled && (windowWidth != this->framebufferWidth || windowHeight != this->framebufferHeight))
+        {
+            this->createFramebuffer(windowWidth, windowHeight);
+        }
+        GLfloat scale = this->enabled ? this->stats.scale : 1.0f;
+        this->stats.width = max(1, int(windowWidth * scale + 0.5f));
+        this->stats.height = max(1, int(windowHeight * scale + 0.5f));
+
+        if (this->enabled)
+        {
+            // clears and draws stay inside the scaled corner
+            glBindFramebuffer(GL_FRAMEBUFFER, this->framebuffer);
+            glScissor(0, 0, this->stats.width, this->stats.height);
+            glEnable(GL_SCISSOR_TEST);
+        }
+        glViewport(0, 0, this->stats.width, this->stats.height);
+    }
+
+    // finish the frame: stretch it over the window (the default framebuffer is bound afterwards)
+    void end()
+    {
+        if (this->enabled)
+        {
+            glDisable(GL_SCISSOR_TEST);
+            glBindFramebuffer(GL_READ_FRAMEBUFFER, this->framebuffer);
+            glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+            glBlitFramebuffer(0, 0, this->stats.width, this->stats.height, 0, 0, this->windowWidth, this->windowHeight, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+            glBindFramebuffer(GL_FRAMEBUFFER, 0);
+            glViewport(0, 0, this->windowWidth, this->windowHeight);
+        }
+
+        if (this->timing)
+        {
+            glEndQuery(GL_TIME_ELAPSED);
+            this->timerPending[this->timerIndex] = true;
+        }
+        this->timerIndex = (this->timerIndex + 1) % FRAME_TIMER_QUERIES;
+    }
+
+    int getWidth()
+    {
+        return this->stats.width;
+    }
+
+    int getHeight()
+    {
+        return this->stats.height;
+    }
+
+    const DynamicResolutionStats& getStats()
+    {
+        return this->stats;
+    }
+
+    void printStats()
+    {
+        cout << "DynamicResolution: " << (this->enabled ? "on" : "off") << ", scale " << this->stats.scale << " (" << this->stats.width << "x" << this->stats.height
+            << "), GPU frame time " << this->stats.gpuMilliseconds << " ms (target " << this->settings.targetMilliseconds << " ms), " << this->stats.changes << " changes\n";
+    }
+};
@@ -1,90 +1,129 @@
 #version 330
 
-
-
-uniform sampler2D texture_diffuse;
-uniform sampler2D texture_specular;
-uniform vec3 lightPosition;
+// variants (see shaderpermutations.h): LIT, SPECULAR_MAP, INSTANCED, SKINNED_KEY, DEPTH_ONLY
+
+// camera (shared by all programs, see uniformbuffers.h)
+layout (std140) uniform FrameData
+{
+	mat4 P;
+	mat4 V;
+	mat4 PV;
+	vec4 cameraPosition;
+};
+
+// light parameters (see clusteredlighting.h)
+layout (std140) uniform LightData
+{
+	vec4 ambient;
+	ivec4 lightCount;
+	ivec4 clusterGrid;			// xyz: clusters along x, y and depth
+	vec4 clusterParameters;		// xy: framebuffer size, z/w: depth slice scale/bias
+};
+
+#ifdef LIT
+// 3 texels per light: (position, radius) (color, specular exponent) (spot direction, spot cos; -2 = point light)
+uniform samplerBuffer lightTexels;
+// per cluster: (first index, light count) into lightIndices
+uniform usamplerBuffer clusterTexels;
+uniform usamplerBuffer lightIndices;
+#endif
+
+// every material map lives in a layer of a texture array
+uniform sampler2DArray texture_diffuse;
+#ifdef SPECULAR_MAP
+uniform sampler2DArray texture_specular;
+#endif
+
+#ifdef INSTANCED
+// the layers come with the draw's data (see renderqueue.h)
+flat in ivec2 materialLayers;
+#define diffuseLayer materialLayers.x
+#define specularLayer materialLayers.y
+#else
+uniform int diffuseLayer;
+uniform int specularLayer;
+#endif
 
 out vec4 pixelColor;			
 
+in vec4 worldPosition;
+#ifdef LIT
 in vec4 n;
-in vec4 l;
-in vec4 v;
-
-in vec4 n2;
-in vec4 l2;
-in vec4 v2;
-
-in vec4 n3;
-in vec4 l3;
-in vec4 v3;
+#endif
 
 in vec2 iTexCoord0;
 
+#ifdef DEPTH_ONLY
+// depth prepass (color writes off) and overdraw view (added up per shaded fragment)
+void main(void) {
+	pixelColor = vec4(0.12, 0.05, 0.02, 1);
+}
+#else
 void main(void) {
-
-	// interpolized vectors
-	vec4 ml = normalize(l);
-	vec4 mn = normalize(n);
-	vec4 mv = normalize(v);
-		
-	vec4 ml2 = normalize(l2);
-	vec4 mn2 = normalize(n2);
-	vec4 mv2 = normalize(v2);
-
-	// ambient lighting
-	vec3 ambientLight = vec3(0.4f, 0.4f, 0.4f);		
 
 	// assign textures
-	vec4 kd = texture(texture_diffuse, iTexCoord0);
-	vec4 ks = texture(texture_specular, iTexCoord0);
-
-
-
-	//===============
-	// LIGHT SOURCE 1
-	//===============
-
-	// reflection vector
-	vec4 mr = reflect(-ml, mn);
+	vec4 kd = texture(texture_diffuse, vec3(iTexCoord0, diffuseLayer));
 
-	// calculate diffuse lighting
-	vec3 diffuseColor = vec3(1.f, 1.f, 1.f);
-	float nl = clamp(dot(mn, ml), 0, 1);
-	float rv = pow(clamp(dot(mr, mv), 0, 1), 50);
-	
-	// finalize
-	vec4 ls1 = vec4(kd.rgb * nl, kd.a) + vec4(ks.rgb * rv, 0);
+#ifndef LIT
+	// unlit: the surface shows its own color
+	pixelColor = kd;
+#else
+#ifdef SPECULAR_MAP
+	vec4 ks = texture(texture_specular, vec3(iTexCoord0, specularLayer));
+#endif
 
+	// interpolized vectors (world space)
+	vec4 mn = normalize(n);
+	vec4 mv = normalize(cameraPosition - worldPosition);
 
-
-	//===============
-	// LIGHT SOURCE 2
-	//===============
-
-	// reflection vector
-	vec4 mr2 = reflect(-ml2, mn2);
-
-	// calculate diffuse lighting
-	vec3 diffuseColor2 = vec3(1.f, 1.f, 1.f);
-	float nl2 = clamp(dot(mn2, ml2), 0, 1);
-	float rv2 = pow(clamp(dot(mr2, mv2), 0, 1), 10);
-	
-	// finalize
-	vec4 ls2 = vec4(kd.rgb * nl2, kd.a) + vec4(ks.rgb * rv2, 0);
-
-
-
-	
-
-
-
-	// ==============
-	//  JOIN LIGHTS
-	// ==============
-
-	pixelColor = ls1 + ls2 + kd * vec4(ambientLight, 1.f) ;
-
-	
+	// ambient lighting
+	pixelColor = kd * vec4(ambient.rgb, 1.f);
+
+	// cluster of this fragment (screen tile, exponential depth slice)
+	float depth = -(V * worldPosition).z;
+	int slice = clamp(int(floor(log(max(depth, 1e-4)) * clusterParameters.z + clusterParameters.w)), 0, clusterGrid.z - 1);
+	ivec2 tile = clamp(ivec2(gl_FragCoord.xy / clusterParameters.xy * vec2(clusterGrid.xy)), ivec2(0), clusterGrid.xy - 1);
+	uvec2 range = texelFetch(clusterTexels, (slice * clusterGrid.y + tile.y) * clusterGrid.x + tile.x).xy;
+
+	// LIGHT SOURCES (only the ones reaching this cluster)
+	for (uint i = 0u; i < range.y; i++)
+	{
+		int light = int(texelFetch(lightIndices, int(range.x + i)).r) * 3;
+		vec4 position = texelFetch(lightTexels, light);
+		vec4 color = texelFetch(lightTexels, light + 1);
+		vec4 spot = texelFetch(lightTexels, light + 2);
+
+		vec4 ml = vec4(position.xyz, 1) - worldPosition;
+		float distance = length(ml);
+		ml /= distance;
+
+		// smooth falloff to zero at the radius (radius 0: no falloff)
+		float attenuation = 1;
+		if (position.w > 0)
+		{
+			float ratio = distance / position.w;
+			attenuation = clamp(1 - ratio * ratio, 0, 1);
+			attenuation *= attenuation;
+		}
+
+		// spot cone, softened over the outer 10% of the angle
+		if (spot.w > -1.5)
+		{
+			float cosAngle = dot(-ml.xyz, spot.xyz);
+			attenuation *= smoothstep(spot.w, mix(spot.w, 1, 0.1), cosAngle);
+		}
+
+		// calculate diffuse lighting
+		float nl = clamp(dot(mn, ml), 0, 1);
+		pixelColor += attenuation * vec4(color.rgb * kd.rgb * nl, 0);
+
+#ifdef SPECULAR_MAP
+		// reflection vector and specular lighting
+		vec4 mr = reflect(-ml, mn);
+		float rv = pow(clamp(dot(mr, mv), 0, 1), color.a);
+		pixelColor += attenuation * vec4(color.rgb * ks.rgb * rv, 0);
+#endif
+	}
+#endif
 }
+#endif
@@ -0,0 +1,348 @@
+#pragma once
+
+#include <iostream>
+#include <vector>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/packing.hpp>
+
+#include "glstate.h"
+#include "memoryaccounting.h"
+
+using namespace std;
+
+
+// vertex attribute locations of the shared VAO
+const GLuint ATTRIBUTE_DRAW_INDEX = 3;  // per draw: index of the draw's data (see RenderQueue), advanced by baseInstance
+const GLuint DRAW_INDEX_DIVISOR = 1u << 30;    // larger than any instance count: every instance of a draw reads the same index
+
+struct Vertex
+{
+    glm::vec3 Position;
+    glm::vec3 Normal;
+    glm::vec2 TexCoords;
+};
+
+// the pool's compact vertex format: normal as normalized 2_10_10_10 ints, texture coordinates as half floats (20 bytes instead of 32)
+struct PackedVertex
+{
+    glm::vec3 Position;
+    GLuint Normal;
+    GLushort TexCoords[2];
+};
+
+// writes vertices into a run of the vertex buffer in the pool's format
+class VertexWriter
+{
+
+private:
+
+    char* data;
+    bool packed;
+
+
+public:
+
+    VertexWriter(void* data, bool packed)
+    {
+        this->data = (char*)data;
+        this->packed = packed;
+    }
+
+    void write(GLuint i, const glm::vec3& position, const glm::vec3& normal, const glm::vec2& texCoords)
+    {
+        if (this->packed)
+        {
+            PackedVertex& vertex = ((PackedVertex*)this->data)[i];
+            vertex.Position = position;
+            vertex.Normal = glm::packSnorm3x10_1x2(glm::vec4(normal, 0.0f));
+            vertex.TexCoords[0] = glm::packHalf1x16(texCoords.x);
+            vertex.TexCoords[1] = glm::packHalf1x16(texCoords.y);
+        }
+        else
+        {
+            Vertex& vertex = ((Vertex*)this->data)[i];
+            vertex.Position = position;
+            vertex.Normal = normal;
+            vertex.TexCoords = texCoords;
+        }
+    }
+};
+
+// where a mesh lives in the shared buffers (the arguments of a glDrawElementsBaseVertex call)
+struct GeometryRange
+{
+    GLuint firstIndex;
+    GLsizei indexCount;
+    GLint baseVertex;
+};
+
+
+// All static geometry in one vertex buffer and one index buffer behind a single VAO, so any set of meshes
+// can be drawn without rebinding and batched into one multi-draw call. Meshes are appended (never freed);
+// when a buffer runs out it is reallocated at twice the size and the old contents are copied on the GPU.
+// The VAO also carries the draw index: a buffer holding 0, 1, 2... with a divisor no instance count reaches,
+// so all instances of a draw started with baseInstance = i read i (they tell themselves apart by gl_InstanceID).
+class GeometryPool
+{
+
+private:
+
+    GLuint VAO;
+    GLuint VBO, EBO, drawIndexBuffer;
+    GLuint vertexCapacity, vertexCount;
+    GLuint indexCapacity, indexCount;
+    GLuint drawIndexCapacity;
+    int meshCount;
+    bool packed;            // vertices stored as PackedVertex
+    GLsizei vertexStride;
+
+
+    GeometryPool()
+    {
+        this->vertexCapacity = 64 * 1024;
+        this->indexCapacity = 256 * 1024;
+        this->drawIndexCapacity = 4096;
+        this->vertexCount = 0;
+        this->indexCount = 0;
+        this->meshCount = 0;
+        this->packed = false;
+        this->vertexStride = sizeof(Vertex);
+
+        glGenVertexArrays(1, &this->VAO);
+        this->VBO = createBuffer(this->vertexCapacity * this->vertexStride);
+        this->EBO = createBuffer(this->indexCapacity * sizeof(GLuint));
+        this->drawIndexBuffer = createDrawIndexBuffer(this->drawIndexCapacity);
+        this->setupVertexArray();
+        this->account();
+    }
+
+    GeometryPool(const GeometryPool&) = delete;
+    GeometryPool& operator=(const GeometryPool&) = delete;
+
+
+    static GLuint createBuffer(GLsizeiptr size)
+    {
+        GLuint buffer;
+        glGenBuffers(1, &buffer);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+        glBufferData(GL_COPY_WRITE_BUFFER, size, NULL, GL_STATIC_DRAW);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+        return buffer;
+    }
+
+    static GLuint createDrawIndexBuffer(GLuint count)
+    {
+        vector<GLuint> drawIndices(count);
+        for (GLuint i = 0; i < count; i++)
+        {
+            drawIndices[i] = i;
+        }
+        GLuint buffer = createBuffer(count * sizeof(GLuint));
+        glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+        glBufferSubData(GL_COPY_WRITE_BUFFER, 0, count * sizeof(GLuint), drawIndices.data());
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+        return buffer;
+    }
+
+    // replace a buffer by a bigger one holding the same first <used> bytes
+    static void grow(GLuint& buffer, GLsizeiptr used, GLsizeiptr size)
+    {
+        GLuint bigger = createBuffer(size);
+        glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, bigger);
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, used);
+        glBindBuffer(GL_COPY_READ_BUFFER, 0);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+        glDeleteBuffers(1, &buffer);
+        buffer = bigger;
+    }
+
+    // report the buffers to the MemoryAccounting (the used part of the vertex and index buffers is reported
+    // by whoever allocated it, under its asset; the rest is the pool's own)
+    void account()
+    {
+        GLsizeiptr capacity = GLsizeiptr(this->vertexCapacity) * this->vertexStride + GLsizeiptr(this->indexCapacity) * sizeof(GLuint);
+        GLsizeiptr used = GLsizeiptr(this->vertexCount) * this->vertexStride + GLsizeiptr(this->indexCount) * sizeof(GLuint);
+        MemoryAccounting::instance().set("geometry pool (unused)", MEMORY_GL_BUFFERS, size_t(capacity - used));
+        MemoryAccounting::instance().set("geometry pool draw indices", MEMORY_GL_BUFFERS, this->drawIndexCapacity * sizeof(GLuint));
+    }
+
+    // point the VAO at the current buffers (after creating or growing them)
+    void setupVertexArray()
+    {
+        GLStateCache::instance().bindVertexArray(this->VAO);
+
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, this->EBO);
+
+        glBindBuffer(GL_ARRAY_BUFFER, this->VBO);
+        // Vertex Positions
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, this->vertexStride, (GLvoid*)0);
+        glEnableVertexAttribArray(0);
+        if (this->packed)
+        {
+            // Vertex Normals (w is dropped by the shader's vec3)
+            glVertexAttribPointer(1, 4, GL_INT_2_10_10_10_REV, GL_TRUE, this->vertexStride, (GLvoid*)offsetof(PackedVertex, Normal));
+            glEnableVertexAttribArray(1);
+            // Vertex Texture Coords
+            glVertexAttribPointer(2, 2, GL_HALF_FLOAT, GL_FALSE, this->vertexStride, (GLvoid*)offsetof(PackedVertex, TexCoords));
+            glEnableVertexAttribArray(2);
+        }
+        else
+        {
+            // Vertex Normals
+            glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, this->vertexStride, (GLvoid*)offsetof(Vertex, Normal));
+            glEnableVertexAttribArray(1);
+            // Vertex Texture Coords
+            glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, this->vertexStride, (GLvoid*)offsetof(Vertex, TexCoords));
+            glEnableVertexAttribArray(2);
+        }
+
+        // Draw index (one per draw: read at baseInstance by all its instances, the piano index comes from gl_InstanceID)
+        glBindBuffer(GL_ARRAY_BUFFER, this->drawIndexBuffer);
+        glVertexAttribIPointer(ATTRIBUTE_DRAW_INDEX, 1, GL_UNSIGNED_INT, sizeof(GLuint), (GLvoid*)0);
+        glVertexAttribDivisor(ATTRIBUTE_DRAW_INDEX, DRAW_INDEX_DIVISOR);
+        glEnableVertexAttribArray(ATTRIBUTE_DRAW_INDEX);
+
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+
+
+public:
+
+    static GeometryPool& instance()
+    {
+        static GeometryPool pool;
+        return pool;
+    }
+
+    // store vertices as PackedVertex (only before the first mesh is allocated)
+    void setPacked(bool packed)
+    {
+        if (this->meshCount > 0 || packed == this->packed)
+        {
+            return;
+        }
+        this->packed = packed;
+        this->vertexStride = packed ? sizeof(PackedVertex) : sizeof(Vertex);
+        glDeleteBuffers(1, &this->VBO);
+        this->VBO = createBuffer(this->vertexCapacity * this->vertexStride);
+        this->setupVertexArray();
+        this->account();
+    }
+
+    bool isPacked()
+    {
+        return this->packed;
+    }
+
+    GLsizei getVertexStride()
+    {
+        return this->vertexStride;
+    }
+
+    // Room for a mesh in the shared buffers, written in place: fill(VertexWriter&, GLuint* indices) gets the vertex and index ranges
+    // mapped for writing, so the vertices go from their source straight into the buffer in the pool's format
+    // (if the driver refuses the mapping, fill writes into a staging copy that's uploaded instead; the caller reports the range to the MemoryAccounting)
+    template <typename Fill>
+    GeometryRange allocate(GLuint vertexCount, GLuint indexCount, Fill fill)
+    {
+        GLuint vertexCapacity = this->vertexCapacity, indexCapacity = this->indexCapacity;
+        while (this->vertexCount + vertexCount > vertexCapacity)
+        {
+            vertexCapacity *= 2;
+        }
+        while (this->indexCount + indexCount > indexCapacity)
+        {
+            indexCapacity *= 2;
+        }
+        if (vertexCapacity != this->vertexCapacity || indexCapacity != this->indexCapacity)
+        {
+            grow(this->VBO, this->vertexCount * this->vertexStride, vertexCapacity * this->vertexStride);
+            grow(this->EBO, this->indexCount * sizeof(GLuint), indexCapacity * sizeof(GLuint));
+            this->vertexCapacity = vertexCapacity;
+            this->indexCapacity = indexCapacity;
+            this->setupVertexArray();
+        }
+
+        GeometryRange range;
+        range.firstIndex = this->indexCount;
+        range.indexCount = GLsizei(indexCount);
+        range.baseVertex = GLint(this->vertexCount);
+
+        GLintptr vertexOffset = GLintptr(this->vertexCount) * this->vertexStride, indexOffset = GLintptr(this->indexCount) * sizeof(GLuint);
+        GLsizeiptr vertexBytes = GLsizeiptr(vertexCount) * this->vertexStride, indexBytes = GLsizeiptr(indexCount) * sizeof(GLuint);
+        GLbitfield access = GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT;
+
+        // (the index buffer is mapped through the copy read target, so both can be mapped at once)
+        glBindBuffer(GL_COPY_WRITE_BUFFER, this->VBO);
+        glBindBuffer(GL_COPY_READ_BUFFER, this->EBO);
+        void* vertices = vertexBytes > 0 ? glMapBufferRange(GL_COPY_WRITE_BUFFER, vertexOffset, vertexBytes, access) : NULL;
+        void* indices = indexBytes > 0 ? glMapBufferRange(GL_COPY_READ_BUFFER, indexOffset, indexBytes, access) : NULL;
+        if (vertices != NULL && indices != NULL)
+        {
+            VertexWriter writer(vertices, this->packed);
+            fill(writer, (GLuint*)indices);
+            bool intact = glUnmapBuffer(GL_COPY_WRITE_BUFFER) == GL_TRUE;
+            intact = glUnmapBuffer(GL_COPY_READ_BUFFER) == GL_TRUE && intact;
+            if (!intact)
+            {
+                cout << "GeometryPool: mapped buffer contents lost, mesh " << this->meshCount << " may be corrupted\n";
+            }
+        }
+        else
+        {
+            if (vertices != NULL)
+            {
+                glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+            }
+            if (indices != NULL)
+            {
+                glUnmapBuffer(GL_COPY_READ_BUFFER);
+            }
+            vector<char> stagingVertices(vertexBytes);
+            vector<GLuint> stagingIndices(indexCount);
+            VertexWriter writer(stagingVertices.data(), this->packed);
+            fill(writer, stagingIndices.data());
+            glBufferSubData(GL_COPY_WRITE_BUFFER, vertexOffset, vertexBytes, stagingVertices.data());
+            glBufferSubData(GL_COPY_READ_BUFFER, indexOffset, indexBytes, stagingIndices.data());
+        }
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+        glBindBuffer(GL_COPY_READ_BUFFER, 0);
+
+        this->vertexCount += vertexCount;
+        this->indexCount += indexCount;
+        this->meshCount++;
+        this->account();
+        return range;
+    }
+
+    // make sure draw indices up to <count> exist (the baseInstance of any draw)
+    void reserveDraws(GLuint count)
+    {
+        if (count <= this->drawIndexCapacity)
+        {
+            return;
+        }
+        while (this->drawIndexCapacity < count)
+        {
+            this->drawIndexCapacity *= 2;
+        }
+        glDeleteBuffers(1, &this->drawIndexBuffer);
+        this->drawIndexBuffer = createDrawIndexBuffer(this->drawIndexCapacity);
+        this->setupVertexArray();
+        this->account();
+    }
+
+    GLuint getVertexArray()
+    {
+        return this->VAO;
+    }
+
+    void printStats()
+    {
+        cout << "GeometryPool: " << this->meshCount << " meshes, " << this->vertexCount << " / " << this->vertexCapacity << " vertices, "
+            << this->indexCount << " / " << this->indexCapacity << " indices, " << this->vertexStride << " bytes per vertex\n";
+    }
+};
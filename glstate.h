@@ -0,0 +1,271 @@
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <unordered_map>
+#include <cstring>
+
+#include <GL/glew.h>
+
+using namespace std;
+
+
+// texture unit used for uploads, so they don't disturb the units the materials sample from
+const GLuint TEXTURE_UNIT_UPLOAD = 7;
+
+const GLuint STATE_UNKNOWN = ~0u;   // shadowed value that never matches a real GL name
+
+enum GLStateCategory
+{
+    STATE_PROGRAM,
+    STATE_VAO,
+    STATE_TEXTURE,
+    STATE_UNIFORM,
+    STATE_CATEGORY_COUNT
+};
+
+// calls issued to / elided from the driver during one frame, per category
+struct GLStateStats
+{
+    int issued[STATE_CATEGORY_COUNT];
+    int elided[STATE_CATEGORY_COUNT];
+};
+
+
+// Shadows the bound program, VAO, per-unit textures and uniform values, and skips calls that would not change anything.
+// All binds of these kinds must go through it; objects deleted behind its back must be forgotten (forgetTexture etc.),
+// otherwise GL could hand the name out again and a real bind would be skipped.
+class GLStateCache
+{
+
+private:
+
+    static const int UNIT_COUNT = 16;
+    static const int TARGET_COUNT = 3;
+
+    struct UniformValue
+    {
+        GLsizei size;       // number of floats/ints stored
+        GLfloat data[16];
+    };
+
+    GLuint program;
+    GLuint VAO;
+    GLuint activeUnit;
+    GLuint textures[UNIT_COUNT][TARGET_COUNT];
+    unordered_map<GLuint, vector<UniformValue>> uniforms;  // program -> values by location
+
+    GLStateStats stats;
+    GLStateStats lastFrame;
+
+
+    GLStateCache()
+    {
+        this->invalidate();
+        memset(&this->stats, 0, sizeof(this->stats));
+        memset(&this->lastFrame, 0, sizeof(this->lastFrame));
+    }
+
+    GLStateCache(const GLStateCache&) = delete;
+    GLStateCache& operator=(const GLStateCache&) = delete;
+
+
+    static int targetIndex(GLenum target)
+    {
+        switch (target)
+        {
+        case GL_TEXTURE_2D: return 0;
+        case GL_TEXTURE_2D_ARRAY: return 1;
+        default: return 2;  // GL_TEXTURE_BUFFER
+        }
+    }
+
+    // true if the value differs from the shadowed one (which is then updated)
+    bool uniformChanged(GLint location, const GLfloat* data, GLsizei size)
+    {
+        if (location < 0)
+        {
+            return false;
+        }
+
+        vector<UniformValue>& values = this->uniforms[this->program];
+        if (GLuint(location) >= values.size())
+        {
+            UniformValue unset;
+            unset.size = 0;
+            values.resize(location + 1, unset);
+        }
+
+        UniformValue& value = values[location];
+        if (value.size == size && memcmp(value.data, data, size * sizeof(GLfloat)) == 0)
+        {
+            this->stats.elided[STATE_UNIFORM]++;
+            return false;
+        }
+
+        value.size = size;
+        memcpy(value.data, data, size * sizeof(GLfloat));
+        this->stats.issued[STATE_UNIFORM]++;
+        return true;
+    }
+
+
+public:
+
+    static GLStateCache& instance()
+    {
+        static GLStateCache cache;
+        return cache;
+    }
+
+    // forget everything (after code outside the cache changed GL state)
+    void invalidate()
+    {
+        this->program = STATE_UNKNOWN;
+        this->VAO = STATE_UNKNOWN;
+        this->activeUnit = STATE_UNKNOWN;
+        for (int unit = 0; unit < UNIT_COUNT; unit++)
+        {
+            for (int target = 0; target < TARGET_COUNT; target++)
+            {
+                this->textures[unit][target] = STATE_UNKNOWN;
+            }
+        }
+        this->uniforms.clear();
+    }
+
+    void useProgram(GLuint program)
+    {
+        if (program == this->program)
+        {
+            this->stats.elided[STATE_PROGRAM]++;
+            return;
+        }
+        glUseProgram(program);
+        this->program = program;
+        this->stats.issued[STATE_PROGRAM]++;
+    }
+
+    void bindVertexArray(GLuint VAO)
+    {
+        if (VAO == this->VAO)
+        {
+            this->stats.elided[STATE_VAO]++;
+            return;
+        }
+        glBindVertexArray(VAO);
+        this->VAO = VAO;
+        this->stats.issued[STATE_VAO]++;
+    }
+
+    void bindTexture(GLuint unit, GLenum target, GLuint texture)
+    {
+        GLuint& bound = this->textures[unit][targetIndex(target)];
+        if (bound == texture)
+        {
+            this->stats.elided[STATE_TEXTURE]++;
+            return;
+        }
+        if (unit != this->activeUnit)
+        {
+            glActiveTexture(GL_TEXTURE0 + unit);
+            this->activeUnit = unit;
+        }
+        glBindTexture(target, texture);
+        bound = texture;
+        this->stats.issued[STATE_TEXTURE]++;
+    }
+
+    // bind a texture on the upload unit and make that unit active, for glTexImage/glTexSubImage/glTexParameter calls
+    void editTexture(GLenum target, GLuint texture)
+    {
+        this->bindTexture(TEXTURE_UNIT_UPLOAD, target, texture);
+        if (this->activeUnit != TEXTURE_UNIT_UPLOAD)
+        {
+            glActiveTexture(GL_TEXTURE0 + TEXTURE_UNIT_UPLOAD);
+            this->activeUnit = TEXTURE_UNIT_UPLOAD;
+        }
+    }
+
+    // uniform setters for the current program
+    void uniform1i(GLint location, GLint value)
+    {
+        GLfloat data;
+        memcpy(&data, &value, sizeof(data));    // compared bitwise
+        if (this->uniformChanged(location, &data, 1))
+        {
+            glUniform1i(location, value);
+        }
+    }
+
+    void uniform4fv(GLint location, const GLfloat* value)
+    {
+        if (this->uniformChanged(location, value, 4))
+        {
+            glUniform4fv(location, 1, value);
+        }
+    }
+
+    void uniformMatrix4fv(GLint location, const GLfloat* value)
+    {
+        if (this->uniformChanged(location, value, 16))
+        {
+            glUniformMatrix4fv(location, 1, false, value);
+        }
+    }
+
+    // objects about to be deleted (GL may reuse their names)
+    void forgetTexture(GLuint texture)
+    {
+        for (int unit = 0; unit < UNIT_COUNT; unit++)
+        {
+            for (int target = 0; target < TARGET_COUNT; target++)
+            {
+                if (this->textures[unit][target] == texture)
+                {
+                    this->textures[unit][target] = STATE_UNKNOWN;
+                }
+            }
+        }
+    }
+
+    void forgetProgram(GLuint program)
+    {
+        if (this->program == program)
+        {
+            this->program = STATE_UNKNOWN;
+        }
+        this->uniforms.erase(program);
+    }
+
+    void forgetVertexArray(GLuint VAO)
+    {
+        if (this->VAO == VAO)
+        {
+            this->VAO = STATE_UNKNOWN;
+        }
+    }
+
+    // close the statistics of the previous frame
+    void beginFrame()
+    {
+        this->lastFrame = this->stats;
+        memset(&this->stats, 0, sizeof(this->stats));
+    }
+
+    const GLStateStats& getLastFrameStats()
+    {
+        return this->lastFrame;
+    }
+
+    void printStats()
+    {
+        const char* names[STATE_CATEGORY_COUNT] = { "program", "VAO", "texture", "uniform" };
+        cout << "GLStateCache (last frame, issued / elided):";
+        for (int i = 0; i < STATE_CATEGORY_COUNT; i++)
+        {
+            cout << " " << names[i] << " " << this->lastFrame.issued[i] << " / " << this->lastFrame.elided[i] << ";";
+        }
+        cout << endl;
+    }
+};
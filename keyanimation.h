@@ -0,0 +1,130 @@
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <cstring>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include "shaderprogram.h"
+#include "glstate.h"
+#include "streambuffer.h"
+#include "memoryaccounting.h"
+
+using namespace std;
+
+
+// buffer texture with the press amount of every key (sampled by the SKINNED_KEY shader variants)
+const GLuint TEXTURE_UNIT_KEY_STATES = 6;
+const GLuint UBO_BINDING_KEY_PARTS = 2;
+
+// moving parts of a key, in the order they are stored in Model::meshes
+enum KeyPart
+{
+    KEY_PART_BASE,
+    KEY_PART_HAMMER,
+    KEY_PART_WIPPEN,
+    KEY_PART_REPETITION_LEVER,
+    KEY_PART_JACK,
+    KEY_PART_COUNT
+};
+
+// std140 mirror of the KeyParts block
+struct KeyPartUniforms
+{
+    glm::vec4 limits[KEY_PART_COUNT];   // x: rotation (degrees, about x) of the part when the key is fully pressed
+    glm::vec4 parents[KEY_PART_COUNT];  // xyz: offset from the part's origin to its parent's pivot, w: parent's rotation limit (0: no parent)
+};
+
+struct KeyAnimationStats
+{
+    int keys;
+    GLsizeiptr bytes;       // key states uploaded by the last frame
+};
+
+
+// GPU-driven key animation: instead of a matrix per moving part, one float per key (0 = up, 1 = fully pressed)
+// is streamed each frame. The SKINNED_KEY vertex shader rebuilds each part's rotation about its pivot from
+// that amount and the per-part limit/parent tables, which are uploaded once; the parts' rest matrices stay
+// unchanged in the render queue's draw records, so they aren't sent again.
+class KeyAnimation
+{
+
+private:
+
+    StreamBuffer keyStates;
+    GLuint partUBO;
+
+    KeyAnimationStats stats;
+
+
+public:
+
+    KeyAnimation() : keyStates("key states", GL_R32F, 4096)
+    {
+        KeyPartUniforms parts;
+        memset(&parts, 0, sizeof(parts));
+        glGenBuffers(1, &this->partUBO);
+        glBindBuffer(GL_UNIFORM_BUFFER, this->partUBO);
+        glBufferData(GL_UNIFORM_BUFFER, sizeof(KeyPartUniforms), &parts, GL_STATIC_DRAW);
+        glBindBufferBase(GL_UNIFORM_BUFFER, UBO_BINDING_KEY_PARTS, this->partUBO);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+        MemoryAccounting::instance().set("key part uniforms", MEMORY_GL_BUFFERS, sizeof(KeyPartUniforms));
+
+        memset(&this->stats, 0, sizeof(this->stats));
+    }
+
+    ~KeyAnimation()
+    {
+        glDeleteBuffers(1, &this->partUBO);
+        MemoryAccounting::instance().set("key part uniforms", MEMORY_GL_BUFFERS, 0);
+    }
+
+    KeyAnimation(const KeyAnimation&) = delete;
+    KeyAnimation& operator=(const KeyAnimation&) = delete;
+
+    // connect the program's KeyParts block and key state sampler (once per program)
+    void attach(ShaderProgram* shader)
+    {
+        shader->bindUniformBlock("KeyParts", UBO_BINDING_KEY_PARTS);
+        shader->use();
+        GLStateCache::instance().uniform1i(shader->u("keyStates"), TEXTURE_UNIT_KEY_STATES);
+    }
+
+    // the part tables (once, after the model is loaded)
+    void setParts(const KeyPartUniforms& parts)
+    {
+        glBindBuffer(GL_UNIFORM_BUFFER, this->partUBO);
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(KeyPartUniforms), &parts);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    }
+
+    // once per frame: upload the press amounts and bind them for drawing
+    void update(const vector<GLfloat>& pressAmounts)
+    {
+        GLsizeiptr size = GLsizeiptr(pressAmounts.size() * sizeof(GLfloat));
+        memcpy(this->keyStates.begin(size), pressAmounts.data(), size);
+        this->keyStates.end();
+        GLStateCache::instance().bindTexture(TEXTURE_UNIT_KEY_STATES, GL_TEXTURE_BUFFER, this->keyStates.texture());
+
+        this->stats.keys = int(pressAmounts.size());
+        this->stats.bytes = size;
+    }
+
+    // after the frame's draws
+    void fence()
+    {
+        this->keyStates.fence();
+    }
+
+    const KeyAnimationStats& getStats()
+    {
+        return this->stats;
+    }
+
+    void printStats()
+    {
+        cout << "KeyAnimation: " << this->stats.keys << " keys, " << this->stats.bytes << " bytes of key states uploaded this frame\n";
+    }
+};
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <GL/glew.h>
+
+
+// Where the keys of a keyboard go, computed from MIDI note numbers instead of a hand-written list.
+// The model's key prototypes are posed at the lowest key (A0); every other key is the same prototype
+// moved along x by its offset. The octave from C1 up repeats every KEY_OCTAVE_WIDTH.
+
+const int MIDI_PIANO_LOWEST = 21;   // A0, the lowest key of a full piano (and of the model)
+const int MIDI_PIANO_HIGHEST = 108; // C8
+const int MIDI_OCTAVE_START = 24;   // C1, the first key of the repeating pattern
+
+// distances between the kinds of keys (as modelled)
+constexpr GLfloat KEY_D1 = 0.020929f;
+constexpr GLfloat KEY_D2 = 0.023909f;
+constexpr GLfloat KEY_D3 = 0.016191f;
+constexpr GLfloat KEY_OCTAVE_WIDTH = 0.23f;
+
+// by pitch class (C = 0): black key?, offset of the key in its octave
+constexpr bool KEY_IS_BLACK[12] = { false, true, false, true, false, false, true, false, true, false, true, false };
+constexpr GLfloat KEY_PATTERN_OFFSETS[12] =
+{
+    2 * KEY_D1 + KEY_D2,                        // C
+    3 * KEY_D1 + KEY_D2,                        // C#
+    3 * KEY_D1 + KEY_D2 + KEY_D3,               // D
+    3 * KEY_D1 + KEY_D2 + 2 * KEY_D3,           // D#
+    4 * KEY_D1 + KEY_D2 + 2 * KEY_D3,           // E
+    4 * KEY_D1 + 2 * KEY_D2 + 2 * KEY_D3,       // F
+    5 * KEY_D1 + 2 * KEY_D2 + 2 * KEY_D3,       // F#
+    5 * KEY_D1 + 2 * KEY_D2 + 3 * KEY_D3,       // G
+    5 * KEY_D1 + 2 * KEY_D2 + 4 * KEY_D3,       // G#
+    5 * KEY_D1 + 2 * KEY_D2 + 5 * KEY_D3,       // A
+    5 * KEY_D1 + 2 * KEY_D2 + 6 * KEY_D3,       // A#
+    6 * KEY_D1 + 2 * KEY_D2 + 6 * KEY_D3        // B
+};
+
+// the three keys below C1 (A0, A#0, B0) sit closer together than the pattern
+constexpr GLfloat KEY_BOTTOM_OFFSETS[MIDI_OCTAVE_START - MIDI_PIANO_LOWEST] = { 0.0f, KEY_D1, 2 * KEY_D1 };
+
+// prototypes (indices in the model's <elements>) of the key bases: black, and white cut for a black key on the right / left / both sides
+const int KEY_BASE_BLACK = 0;
+const int KEY_BASE_WHITE_RIGHT = 1;
+const int KEY_BASE_WHITE_LEFT = 2;
+const int KEY_BASE_WHITE_BOTH = 3;
+// the model has no uncut white key base: a white key with no black neighbour on the keyboard (E1 of KEYBOARD_76,
+// C7 of KEYBOARD_61, C8 of KEYBOARD_88) reuses the right-cut one, so it shows a notch for a black key that isn't there
+const int KEY_BASE_WHITE_UNCUT = KEY_BASE_WHITE_RIGHT;
+
+// sides of a white key cut for a neighbouring black key
+const int KEY_CUT_NONE = 0;
+const int KEY_CUT_LEFT = 1;
+const int KEY_CUT_RIGHT = 2;
+const int KEY_CUT_BOTH = KEY_CUT_LEFT | KEY_CUT_RIGHT;
+
+
+// a range of keys, both ends included
+struct KeyboardLayout
+{
+    int lowestNote, highestNote;    // MIDI notes, within A0..C8
+
+    constexpr int keyCount() const
+    {
+        return this->highestNote - this->lowestNote + 1;
+    }
+
+    constexpr bool contains(int note) const
+    {
+        return note >= this->lowestNote && note <= this->highestNote;
+    }
+
+    constexpr bool isBlack(int note) const
+    {
+        return KEY_IS_BLACK[note % 12];
+    }
+
+    // x offset of a key from the model's A0
+    constexpr GLfloat offset(int note) const
+    {
+        return note < MIDI_OCTAVE_START ? KEY_BOTTOM_OFFSETS[note - MIDI_PIANO_LOWEST]
+            : KEY_PATTERN_OFFSETS[note % 12] + GLfloat((note - MIDI_OCTAVE_START) / 12) * KEY_OCTAVE_WIDTH;
+    }
+
+    // sides of a white key next to a black key of the keyboard
+    constexpr int cuts(int note) const
+    {
+        return (this->contains(note - 1) && this->isBlack(note - 1) ? KEY_CUT_LEFT : KEY_CUT_NONE)
+            | (this->contains(note + 1) && this->isBlack(note + 1) ? KEY_CUT_RIGHT : KEY_CUT_NONE);
+    }
+
+    // base prototype of a key: white keys are cut where a black key of the keyboard lies next to them
+    constexpr int basePrototype(int note) const
+    {
+        return this->isBlack(note) ? KEY_BASE_BLACK
+            : this->cuts(note) == KEY_CUT_BOTH ? KEY_BASE_WHITE_BOTH
+            : this->cuts(note) == KEY_CUT_LEFT ? KEY_BASE_WHITE_LEFT
+            : this->cuts(note) == KEY_CUT_RIGHT ? KEY_BASE_WHITE_RIGHT
+            : KEY_BASE_WHITE_UNCUT;
+    }
+
+    // octave of a key counted from the keyboard's first one (the keys below C1 count as an octave of their own)
+    constexpr int octave(int note) const
+    {
+        return octaveOfNote(note) - octaveOfNote(this->lowestNote);
+    }
+
+    static constexpr int octaveOfNote(int note)
+    {
+        return note < MIDI_OCTAVE_START ? 0 : 1 + (note - MIDI_OCTAVE_START) / 12;
+    }
+};
+
+constexpr KeyboardLayout KEYBOARD_61 = { 36, 96 };     // C2..C7
+constexpr KeyboardLayout KEYBOARD_76 = { 28, 103 };    // E1..G7
+constexpr KeyboardLayout KEYBOARD_87 = { 21, 107 };    // A0..B7, the keyboard the model was built with
+constexpr KeyboardLayout KEYBOARD_88 = { 21, 108 };    // A0..C8
+
+static_assert(KEYBOARD_88.keyCount() == 88 && KEYBOARD_61.keyCount() == 61 && KEYBOARD_76.keyCount() == 76, "keyboard sizes");
+static_assert(KEYBOARD_87.basePrototype(21) == KEY_BASE_WHITE_RIGHT && KEYBOARD_87.basePrototype(23) == KEY_BASE_WHITE_LEFT
+    && KEYBOARD_87.basePrototype(26) == KEY_BASE_WHITE_BOTH, "white key cuts");
+static_assert(KEYBOARD_76.cuts(28) == KEY_CUT_NONE && KEYBOARD_76.basePrototype(28) == KEY_BASE_WHITE_UNCUT
+    && KEYBOARD_88.cuts(108) == KEY_CUT_NONE && KEYBOARD_88.basePrototype(108) == KEY_BASE_WHITE_UNCUT, "uncut edge keys");
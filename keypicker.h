@@ -0,0 +1,325 @@
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <map>
+#include <chrono>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include "bvh.h"
+#include "model.h"
+#include "memoryaccounting.h"
+
+using namespace std;
+
+
+// what a picking ray hit first
+struct PickResult
+{
+    bool hit;
+    int piano;          // concert hall piano (0: the model's own)
+    int mesh;           // index in the model's meshes
+    int key, part;      // piano key and its mesh, in KEY_MESH_NAMES order (-1: not a key)
+    GLfloat distance;   // along the ray (world units, for a unit direction)
+};
+
+const char* const KEY_PICKER_ASSET = "key picker";     // MemoryAccounting asset of the picker's triangles and trees
+
+struct KeyPickerStats
+{
+    int meshNodes, pianoNodes;
+    int prototypes;             // meshes with a triangle BVH
+    int refits;                 // meshes refitted by the last update
+    double pickMicroseconds;    // duration of the last pick
+};
+
+
+// Ray picking of the piano's meshes in three levels of BVH: pianos (one box per concert hall piano),
+// meshes of a piano (boxes in their current pose, refitted only for meshes that move) and triangles of a
+// mesh's prototype (built once in model space and shared by all the copies of the prototype).
+// The ray is taken into each level's space instead of transforming any geometry. The other concert hall
+// pianos are tested in piano 0's key poses (their own keys move a few degrees at most).
+class KeyPicker
+{
+
+private:
+
+    // triangles of a prototype mesh, in its model space
+    struct PrototypeTriangles
+    {
+        vector<glm::vec3> positions;
+        vector<GLuint> indices;
+        BVH bvh;    // over the triangles
+    };
+
+    map<GLuint, PrototypeTriangles> prototypes;    // by the first index of the shared geometry
+    vector<PrototypeTriangles*> meshPrototypes;     // by mesh
+    vector<glm::mat4> inversePoses;                 // by mesh: world -> model space
+    vector<bool> moving;                            // by mesh: moved during the last update
+    vector<KeyMeshRef> meshKeys;                    // by mesh: the key it belongs to
+    BVH meshBVH;
+
+    vector<glm::mat4> inversePlacements;            // by piano
+    BVH pianoBVH;
+    AABB pianoBounds;                               // piano 0's box the piano level was built with
+
+    KeyPickerStats stats;
+
+
+    // (reads the model's CPU copy - the one kept from the import while the picker is built, or paged in through the MeshCache -
+    // and keeps only the positions and indices)
+    PrototypeTriangles* prototypeOf(Mesh& mesh)
+    {
+        map<GLuint, PrototypeTriangles>::iterator built = this->prototypes.find(mesh.getGeometry().firstIndex);
+        if (built != this->prototypes.end())
+        {
+            return &built->second;
+        }
+        PrototypeTriangles& prototype = this->prototypes[mesh.getGeometry().firstIndex];
+        if (!mesh.acquireGeometry())
+        {
+            cout << "KeyPicker: the geometry of " << mesh.getName() << " isn't kept on the CPU, it can't be picked\n";
+        }
+        else
+        {
+            const Vertex* vertices = mesh.getVertices();
+            prototype.positions.resize(mesh.getVertexCount());
+            for (GLuint i = 0; i < mesh.getVertexCount(); i++)
+            {
+                prototype.positions[i] = vertices[i].Position;
+            }
+            prototype.indices.assign(mesh.getIndices(), mesh.getIndices() + mesh.getIndexCount());
+
+            vector<AABB> triangles(prototype.indices.size() / 3);
+            for (GLuint i = 0; i < triangles.size(); i++)
+            {
+                const glm::vec3& a = prototype.positions[prototype.indices[i * 3]];
+                const glm::vec3& b = prototype.positions[prototype.indices[i * 3 + 1]];
+                const glm::vec3& c = prototype.positions[prototype.indices[i * 3 + 2]];
+                triangles[i].min = glm::min(a, glm::min(b, c));
+                triangles[i].max = glm::max(a, glm::max(b, c));
+            }
+            prototype.bvh.build(triangles, 4);
+            mesh.releaseGeometry();
+        }
+        return &prototype;
+    }
+
+    // report the prototypes' triangles and all the trees to the MemoryAccounting (after every build)
+    void account()
+    {
+        size_t bytes = this->meshBVH.getBytes() + this->pianoBVH.getBytes()
+            + (this->inversePoses.size() + this->inversePlacements.size()) * sizeof(glm::mat4);
+        for (map<GLuint, PrototypeTriangles>::iterator it = this->prototypes.begin(); it != this->prototypes.end(); ++it)
+        {
+            bytes += it->second.positions.size() * sizeof(glm::vec3) + it->second.indices.size() * sizeof(GLuint) + it->second.bvh.getBytes();
+        }
+        MemoryAccounting::instance().set(KEY_PICKER_ASSET, MEMORY_CPU_GEOMETRY, bytes);
+    }
+
+    AABB meshBox(Model& model, int mesh, const glm::mat4& pose)
+    {
+        AABB bounds;
+        model.getMesh(mesh).getBounds(bounds.min, bounds.max);
+        return BVH::transform(bounds, pose);
+    }
+
+    // Moller-Trumbore; true if the ray hits the triangle before tMax
+    static bool intersectTriangle(const Ray& ray, const glm::vec3& a, const glm::vec3& b, const glm::vec3& c, GLfloat& tMax)
+    {
+        glm::vec3 edge1 = b - a, edge2 = c - a;
+        glm::vec3 p = glm::cross(ray.direction, edge2);
+        GLfloat determinant = glm::dot(edge1, p);
+        if (fabs(determinant) < 1e-12f)
+        {
+            return false;
+        }
+        GLfloat inverse = 1.0f / determinant;
+        glm::vec3 s = ray.origin - a;
+        GLfloat u = glm::dot(s, p) * inverse;
+        if (u < 0.0f || u > 1.0f)
+        {
+            return false;
+        }
+        glm::vec3 q = glm::cross(s, edge1);
+        GLfloat v = glm::dot(ray.direction, q) * inverse;
+        if (v < 0.0f || u + v > 1.0f)
+        {
+            return false;
+        }
+        GLfloat t = glm::dot(edge2, q) * inverse;
+        if (t <= 0.0f || t >= tMax)
+        {
+            return false;
+        }
+        tMax = t;
+        return true;
+    }
+
+    static Ray transformRay(const Ray& ray, const glm::mat4& M)
+    {
+        Ray result;
+        result.origin = glm::vec3(M * glm::vec4(ray.origin, 1.0f));
+        result.direction = glm::vec3(M * glm::vec4(ray.direction, 0.0f));    // not normalized: t stays comparable between spaces
+        return result;
+    }
+
+    // nearest hit among the meshes of one piano (ray in piano space)
+    void pickMeshes(const Ray& ray, GLfloat& tMax, int& hitMesh)
+    {
+        this->meshBVH.traverse(ray, tMax, [&](GLuint mesh, GLfloat& meshMax)
+        {
+            Ray local = transformRay(ray, this->inversePoses[mesh]);
+            PrototypeTriangles* prototype = this->meshPrototypes[mesh];
+            prototype->bvh.traverse(local, meshMax, [&](GLuint triangle, GLfloat& triangleMax)
+            {
+                const GLuint* index = &prototype->indices[triangle * 3];
+                if (intersectTriangle(local, prototype->positions[index[0]], prototype->positions[index[1]], prototype->positions[index[2]], triangleMax))
+                {
+                    hitMesh = int(mesh);
+                }
+            });
+        });
+    }
+
+
+public:
+
+    // builds the mesh and triangle levels from the model's current poses
+    KeyPicker(Model& model)
+    {
+        int meshCount = model.getPianoMeshCount();
+        vector<AABB> boxes(meshCount);
+        this->meshPrototypes.resize(meshCount);
+        this->inversePoses.resize(meshCount);
+        this->moving.assign(meshCount, true);     // refitted by the first update (the matrices of meshes moved at load time are set by Submit)
+        this->meshKeys.resize(meshCount);
+        for (int i = 0; i < meshCount; i++)
+        {
+            model.getMeshKey(i, this->meshKeys[i].key, this->meshKeys[i].part);
+            glm::mat4 pose = model.getMeshPose(i);
+            this->inversePoses[i] = glm::inverse(pose);
+            this->meshPrototypes[i] = this->prototypeOf(model.getMesh(i));
+            boxes[i] = this->meshBox(model, i, pose);
+        }
+        this->meshBVH.build(boxes, 2);
+
+        this->pianoBounds = AABB();
+        this->stats = KeyPickerStats();
+        this->stats.meshNodes = this->meshBVH.getNodeCount();
+        this->stats.prototypes = int(this->prototypes.size());
+        this->account();
+    }
+
+    ~KeyPicker()
+    {
+        MemoryAccounting::instance().set(KEY_PICKER_ASSET, MEMORY_CPU_GEOMETRY, 0);
+    }
+
+    KeyPicker(const KeyPicker&) = delete;
+    KeyPicker& operator=(const KeyPicker&) = delete;
+
+    // once per frame, after the model was animated: refit the meshes that are moving (or just stopped),
+    // rebuild the piano level if the concert hall changed
+    void update(Model& model, const vector<glm::mat4>& placements)
+    {
+        this->stats.refits = 0;
+        for (int i = 0; i < int(this->moving.size()); i++)
+        {
+            Mesh& mesh = model.getMesh(i);
+            bool movingNow = mesh.isRising || mesh.isFalling;
+            if (movingNow || this->moving[i])
+            {
+                glm::mat4 pose = model.getMeshPose(i);
+                this->inversePoses[i] = glm::inverse(pose);
+                this->meshBVH.refit(i, this->meshBox(model, i, pose));
+                this->stats.refits++;
+            }
+            this->moving[i] = movingNow;
+        }
+
+        // the pianos (rebuilt when the hall changes or piano 0's box does)
+        if (this->meshBVH.isEmpty())
+        {
+            return;
+        }
+        const AABB& bounds = this->meshBVH.getBounds();
+        bool rebuild = placements.size() != this->inversePlacements.size()
+            || bounds.min != this->pianoBounds.min || bounds.max != this->pianoBounds.max;
+        if (!rebuild)
+        {
+            return;
+        }
+        this->pianoBounds = bounds;
+        vector<AABB> pianos(placements.size());
+        this->inversePlacements.resize(placements.size());
+        for (GLuint i = 0; i < placements.size(); i++)
+        {
+            this->inversePlacements[i] = glm::inverse(placements[i]);
+            pianos[i] = BVH::transform(bounds, placements[i]);
+        }
+        this->pianoBVH.build(pianos, 1);
+        this->stats.pianoNodes = this->pianoBVH.getNodeCount();
+        this->account();
+    }
+
+    // the first mesh a world-space ray hits
+    PickResult pick(const Ray& ray)
+    {
+        auto start = chrono::high_resolution_clock::now();
+
+        PickResult result;
+        result.hit = false;
+        result.piano = result.mesh = result.key = result.part = -1;
+        GLfloat tMax = FLT_MAX;
+
+        this->pianoBVH.traverse(ray, tMax, [&](GLuint piano, GLfloat& pianoMax)
+        {
+            int hitMesh = -1;
+            this->pickMeshes(transformRay(ray, this->inversePlacements[piano]), pianoMax, hitMesh);
+            if (hitMesh >= 0)
+            {
+                result.hit = true;
+                result.piano = int(piano);
+                result.mesh = hitMesh;
+            }
+        });
+
+        if (result.hit)
+        {
+            result.distance = tMax;
+            result.key = this->meshKeys[result.mesh].key;
+            result.part = this->meshKeys[result.mesh].part;
+        }
+
+        this->stats.pickMicroseconds = chrono::duration<double, micro>(chrono::high_resolution_clock::now() - start).count();
+        return result;
+    }
+
+    // the world-space ray through a window pixel (y down, as GLFW reports the cursor)
+    static Ray screenRay(double x, double y, int width, int height, const glm::mat4& P, const glm::mat4& V)
+    {
+        glm::mat4 inversePV = glm::inverse(P * V);
+        glm::vec2 ndc(GLfloat(2.0 * x / width - 1.0), GLfloat(1.0 - 2.0 * y / height));
+        glm::vec4 nearPoint = inversePV * glm::vec4(ndc, -1.0f, 1.0f);
+        glm::vec4 farPoint = inversePV * glm::vec4(ndc, 1.0f, 1.0f);
+
+        Ray ray;
+        ray.origin = glm::vec3(nearPoint) / nearPoint.w;
+        ray.direction = glm::normalize(glm::vec3(farPoint) / farPoint.w - ray.origin);
+        return ray;
+    }
+
+    const KeyPickerStats& getStats()
+    {
+        return this->stats;
+    }
+
+    void printStats()
+    {
+        cout << "KeyPicker: " << this->stats.meshNodes << " mesh nodes, " << this->stats.pianoNodes << " piano nodes, " << this->stats.prototypes
+            << " prototype triangle trees, " << this->stats.refits << " meshes refitted, last pick " << this->stats.pickMicroseconds << " us\n";
+    }
+};
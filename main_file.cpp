@@ -5,14 +5,30 @@
 #include <glm/glm.hpp>
 #include <glm/gtc/type_ptr.hpp>
 #include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/constants.hpp>
 #include <assimp/Importer.hpp>
 #include <stdlib.h>
 #include <stdio.h>
+#include <new>
 #include "constants.h"
 #include "shaderprogram.h"
 #include "camera.h"
 #include "mesh.h"
 #include "model.h"
+#include "texturestreamer.h"
+#include "renderqueue.h"
+#include "glstate.h"
+#include "uniformbuffers.h"
+#include "clusteredlighting.h"
+#include "shaderpermutations.h"
+#include "keyanimation.h"
+#include "dynamicresolution.h"
+#include "concerthall.h"
+#include "keypicker.h"
+#include "allocationcounter.h"
+#include "meshupload.h"
+#include "memoryaccounting.h"
+#include "startuptrace.h"
 
 
 // Properties
@@ -26,10 +42,35 @@ void ScrollCallback(GLFWwindow* window, double xoffset, double yoffset);
 void MouseButtonCallback(GLFWwindow* window, int button, int action, int mods);
 void DoAction(Model* model, int* keyPointer);
 void windowResizeCallback(GLFWwindow* window, int width, int height);
+bool sceneIsIdle(Model* model);
+vector<Light> makeStageLights();
 void error_callback(int error, const char* description) {
     fputs(description, stderr);
 }
 
+// Heap allocations go through these to be counted (see allocationcounter.h)
+// (the array and nothrow forms call them)
+void* operator new(size_t size)
+{
+    AllocationCounter::instance().add();
+    void* memory = malloc(size > 0 ? size : 1);
+    if (memory == NULL)
+    {
+        throw bad_alloc();
+    }
+    return memory;
+}
+
+void operator delete(void* memory) noexcept
+{
+    free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept
+{
+    free(memory);
+}
+
 
 
 // Camera
@@ -45,9 +86,57 @@ bool firstMouseClick = true;
 // Frame-to-frame time interval
 GLfloat deltaTime = 0.0f;
 GLfloat prevFrame = 0.0f;
+const GLfloat MAX_FRAME_INTERVAL = 0.1f;    // longer gaps (after sleeping in on-demand mode) don't make the camera jump
+
+// on-demand rendering (toggled with R): while nothing moves, the loop sleeps until input arrives instead of redrawing
+bool renderOnDemand = true;
+const double IDLE_WAIT_TIMEOUT = 1.0;       // seconds between redraws of an idle scene
+
+// shader variants (compiled on demand, one per feature combination)
+ShaderPermutations* shaders;
+
+// draw calls of the current frame (sorted to minimize GL state changes)
+RenderQueue* renderQueue;
+
+// Scene lights (position, color, specular exponent, radius, spot direction, spot angle)
+vector<Light> lights = {
+    { glm::vec3(2.5f, -0.5f, 2.2f), glm::vec3(1.0f), 50.0f, 0.0f, glm::vec3(0.0f), 0.0f },
+    { glm::vec3(-2.5f, 0.5f, -2.2f), glm::vec3(1.0f), 10.0f, 0.0f, glm::vec3(0.0f), 0.0f }
+};
+glm::vec3 ambientLight = glm::vec3(0.4f);
+
+// key animation on the GPU (toggled with G): one float per key instead of a matrix per moving part
+KeyAnimation* keyAnimation;
+bool animateKeysOnGPU = true;
+
+// render scale following the GPU frame time (toggled with F): the frame is drawn offscreen and stretched to the window
+DynamicResolution* dynamicResolution;
 
-// shader handle
-ShaderProgram* sp;
+// keyboard the piano is generated with (see keyboardlayout.h)
+constexpr KeyboardLayout KEYBOARD = KEYBOARD_87;
+
+// concert hall (toggled with H): copies of the piano drawn with instancing, each playing its own keys
+ConcertHall* concertHall = NULL;
+const int HALL_PIANO_COUNT = 16;
+HallBenchmark hallBenchmark;    // started with B: 1, 10, 100 and 1000 pianos
+
+// vertices stored packed in the geometry pool (20 bytes instead of 32: normals as 10-bit ints, texture coordinates as half floats)
+const bool PACK_VERTICES = false;
+const char* UPLOAD_BENCHMARK_MODEL = "models/-z_front/piano_body_open.obj";     // timed with U (see meshupload.h)
+
+// memory held per asset and category (see memoryaccounting.h): dumped with M and every MEMORY_DUMP_INTERVAL seconds (0: only with M)
+const double MEMORY_DUMP_INTERVAL = 300.0;
+
+// clicking a key presses it (picked by a ray through the cursor, see keypicker.h)
+KeyPicker* keyPicker;
+glm::mat4 frameP, frameV;       // the camera of the last frame (the click's ray is cast through it)
+bool clickPending = false, clickReleased = false;
+double clickX, clickY;
+int clickedKey = -1;            // key of piano 0 held down by the mouse (-1: none)
+
+// stage lighting (toggled with L): many small colored lights, binned per cluster
+vector<Light> stageLights = makeStageLights();
+bool stageLightsOn = false;
 
 
 
@@ -55,6 +144,9 @@ int main()
 {
     // --- INITIALIZATION --- // 
 
+    // startup timeline (written to STARTUP_TRACE_FILE once the first frame with every texture is shown, see startuptrace.h)
+    StartupTrace::instance();
+
     // variables
     int keyPointer = 88; // for pressing piano keys with arrows
 
@@ -96,11 +188,43 @@ int main()
     glfwSetScrollCallback(window, ScrollCallback);
     glfwSetMouseButtonCallback(window, MouseButtonCallback);
 
-    // Setup and compile our shaders
-    sp = new ShaderProgram("vertex_shader.glsl", NULL, "fragment_shader.glsl");
-    
+    // camera and light data shared by all shader programs
+    UniformBuffers uniformBuffers;
+
+    // per-cluster light lists
+    ClusteredLighting clusteredLighting;
+
+    // key states and key part tables
+    keyAnimation = new KeyAnimation();
+
+    // placements and key states of the concert hall pianos (one piano until H or B)
+    // (before the shaders: every variant is attached to it when it is compiled, which may happen while the models load)
+    concertHall = new ConcertHall(KEYBOARD.keyCount());
+
+    // Setup our shaders: every variant is connected to the shared buffers when it is compiled
+    shaders = new ShaderPermutations("vertex_shader.glsl", "fragment_shader.glsl", [&](ShaderProgram* program)
+    {
+        // the material samplers read from fixed texture units (see texturearray.h)
+        program->use();
+        GLStateCache::instance().uniform1i(program->u("texture_diffuse"), TEXTURE_UNIT_DIFFUSE);
+        GLStateCache::instance().uniform1i(program->u("texture_specular"), TEXTURE_UNIT_SPECULAR);
+        GLStateCache::instance().uniform1i(program->u("drawData"), TEXTURE_UNIT_DRAW_DATA);
+
+        uniformBuffers.attach(program);
+        clusteredLighting.attach(program);
+        keyAnimation->attach(program);
+        concertHall->attach(program);
+    });
+
+    // draw calls of the frame (streams its matrices through GL buffers, so it needs the context)
+    renderQueue = new RenderQueue();
+
+    // offscreen framebuffer for rendering at a reduced scale
+    dynamicResolution = new DynamicResolution();
+
 
     // Load models
+    GeometryPool::instance().setPacked(PACK_VERTICES);
     vector<string> paths = {
         "models/-z_front/key_base_black.obj",           // 0 - base variant
         "models/-z_front/key_base_white01.obj",         // 1 - base variant
@@ -119,7 +243,28 @@ int main()
         "models/-z_front/cube.obj"                      // 16-17 - light source markers
 
     };
-    Model model(paths);
+    vector<glm::vec3> lightPositions;
+    for (GLuint i = 0; i < lights.size(); i++)
+    {
+        lightPositions.push_back(lights[i].position);
+    }
+    // CPU copies of the geometry: kept from the import until the picker has built its triangle trees from them,
+    // then released (the light markers are never picked, so theirs is never kept)
+    vector<MeshResidency> residency(paths.size(), MESH_KEEP);
+    residency.back() = MESH_DROP;
+    Model model(paths, lightPositions, KEYBOARD, residency);
+    keyAnimation->setParts(model.getKeyPartTable());
+    renderQueue->setCullGroups(model.getCullGroups());
+
+    // bounding volume hierarchies for mouse picking
+    {
+        TraceScope picking(STAGE_PICKING);
+        keyPicker = new KeyPicker(model);
+    }
+    model.releaseKeptGeometry(MESH_ON_DEMAND);
+
+    MemoryAccounting::instance().setDumpInterval(MEMORY_DUMP_INTERVAL);
+    MemoryAccounting::instance().dump();
 
 
 
@@ -128,46 +273,110 @@ int main()
 
     while (!glfwWindowShouldClose(window))
     {
+        double frameStart = glfwGetTime();
+        if (hallBenchmark.isRunning())
+        {
+            concertHall->setPianoCount(hallBenchmark.getPianoCount());
+        }
+
+        // draw into the scaled framebuffer (its size follows the frame time)
+        dynamicResolution->begin(SCREEN_WIDTH, SCREEN_HEIGHT);
+
+        // the overdraw view adds up on black
+        if (renderQueue->getOverdrawView())
+        {
+            glClearColor(0, 0, 0, 1);
+        }
+        else
+        {
+            glClearColor(1, 1, 1, 1);
+        }
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        GLStateCache::instance().beginFrame();
 
         // Set delta Time
         GLfloat currentFrame = glfwGetTime();
-        deltaTime = 0.5f * (currentFrame - prevFrame);
+        deltaTime = 0.5f * min(currentFrame - prevFrame, MAX_FRAME_INTERVAL);
         prevFrame = currentFrame;
 
+        // swap in the textures decoded since the last frame
+        TextureStreamer::instance().pump();
+        MemoryAccounting::instance().update(currentFrame);
+
         // Set view matrix
         glm::mat4 V = camera.getViewMatrix();
 
         // Set projection matrix
-        glm::mat4 P = glm::perspective(camera.getZoom(), (float)SCREEN_WIDTH / (float)SCREEN_HEIGHT, 0.1f, 100.0f);
+        GLfloat nearPlane = 0.1f, farPlane = 100.0f;
+        glm::mat4 P = glm::perspective(camera.getZoom(), (float)SCREEN_WIDTH / (float)SCREEN_HEIGHT, nearPlane, farPlane);
 
-        // Set model matrix (and adjust model position)
-        glm::mat4 M = glm::mat4(1.0f);
+        // send the camera parameters to all shader programs at once
+        uniformBuffers.updateFrame(P, V, camera.getPosition());
+        frameP = P;
+        frameV = V;
 
-        sp->use();
+        // bin the lights into the clusters of this view
+        clusteredLighting.update(stageLightsOn ? stageLights : lights, ambientLight, V, P, nearPlane, farPlane, dynamicResolution->getWidth(), dynamicResolution->getHeight(), uniformBuffers);
+        clusteredLighting.bind();
 
-        // send parametrs to the shader program
-        glUniformMatrix4fv(sp->u("P"), 1, false, glm::value_ptr(P));
-        glUniformMatrix4fv(sp->u("V"), 1, false, glm::value_ptr(V));
-        glUniformMatrix4fv(sp->u("M"), 1, false, glm::value_ptr(M));
 
+        // draw the model: record a draw packet per mesh, then issue them sorted by shader, textures and depth (batched into multi-draws)
+        renderQueue->begin(V, farPlane);
+        const vector<GLfloat>& pressAmounts = concertHall->update(model.getKeyPressAmounts());
+        if (animateKeysOnGPU)
+        {
+            keyAnimation->update(pressAmounts);
+        }
+        concertHall->bind();
+        model.Submit(*renderQueue, *shaders, animateKeysOnGPU, concertHall->getPianoCount());
+        keyPicker->update(model, concertHall->getPlacements());
+        renderQueue->execute();
+        clusteredLighting.fence();
+        keyAnimation->fence();
 
-        // draw the model: pass all the verticies, vertex colors and texture coordinates to the shader program
-        model.Draw(sp);
- 
-        // call events
-        glfwPollEvents();
+        // stretch the frame to the window
+        dynamicResolution->end();
 
-        // execute animations, actions etc...
-        DoAction(&model, &keyPointer);
+        glfwSwapBuffers(window);
 
+        // the start is over once a frame was shown with every texture in place
+        if (StartupTrace::instance().isRecording() && TextureStreamer::instance().isIdle())
+        {
+            StartupTrace::instance().finish();
+        }
 
+        // concert hall benchmark: back to vsync and one piano when it is done
+        if (hallBenchmark.isRunning())
+        {
+            hallBenchmark.frameDone(glfwGetTime() - frameStart, renderQueue->getStats(), concertHall->getInstanceBytes() + renderQueue->getDrawDataBytes());
+            if (!hallBenchmark.isRunning())
+            {
+                concertHall->setPianoCount(1);
+                glfwSwapInterval(1);
+            }
+        }
 
-        glfwSwapBuffers(window);
+        // call events (an idle scene waits for them, see sceneIsIdle)
+        if (renderOnDemand && !hallBenchmark.isRunning() && sceneIsIdle(&model))
+        {
+            glfwWaitEventsTimeout(IDLE_WAIT_TIMEOUT);
+        }
+        else
+        {
+            glfwPollEvents();
+        }
+
+        // execute animations, actions etc...
+        DoAction(&model, &keyPointer);
     }
 
 
-    delete sp;
+    delete renderQueue;
+    delete dynamicResolution;
+    delete concertHall;
+    delete keyPicker;
+    delete shaders;
+    delete keyAnimation;
     glfwDestroyWindow(window);
     glfwTerminate();
     exit(EXIT_SUCCESS);
@@ -176,6 +385,15 @@ int main()
 
 
 
+// true when the next frame would look the same as the last one: no mesh animating,
+// no camera movement key held, no concert hall pianos playing and no textures still streaming in
+bool sceneIsIdle(Model* model)
+{
+    bool cameraMoving = keyPressCounter[GLFW_KEY_W] > 0 || keyPressCounter[GLFW_KEY_S] > 0
+        || keyPressCounter[GLFW_KEY_A] > 0 || keyPressCounter[GLFW_KEY_D] > 0;
+    return !cameraMoving && !model->isAnimating() && concertHall->getPianoCount() == 1 && TextureStreamer::instance().isIdle();
+}
+
 // Moves/alters the camera positions based on user input
 void DoAction(Model* model, int* keyPointer)
 {
@@ -264,6 +482,35 @@ void DoAction(Model* model, int* keyPointer)
 
     
 
+    // Piano keyboard controls - clicking keys with the mouse
+    if (clickPending)
+    {
+        PickResult picked = keyPicker->pick(KeyPicker::screenRay(clickX, clickY, SCREEN_WIDTH, SCREEN_HEIGHT, frameP, frameV));
+        if (picked.key >= 0)
+        {
+            cout << "Picked key " << picked.key + 1 << " (part " << picked.part << ") of piano " << picked.piano << " in " << keyPicker->getStats().pickMicroseconds << " us\n";
+            if (picked.piano == 0)
+            {
+                model->keyPressed(picked.key + 1);
+                clickedKey = picked.key + 1;
+            }
+            else
+            {
+                concertHall->pressKey(picked.piano, picked.key);
+            }
+        }
+        clickPending = false;
+    }
+    if (clickReleased)
+    {
+        if (clickedKey >= 0)
+        {
+            model->keyReleased(clickedKey);
+            clickedKey = -1;
+        }
+        clickReleased = false;
+    }
+
     // Piano lid controls
     if (keyPressCounter[GLFW_KEY_O] == 1)
     {
@@ -278,6 +525,107 @@ void DoAction(Model* model, int* keyPointer)
         keyPressCounter[GLFW_KEY_C] = 0;
     }
 
+    // Rendering statistics of the last frame
+    if (keyPressCounter[GLFW_KEY_I] == 1)
+    {
+        renderQueue->printStats();
+        GeometryPool::instance().printStats();
+        if (animateKeysOnGPU)
+        {
+            keyAnimation->printStats();
+        }
+        shaders->printStats();
+        dynamicResolution->printStats();
+        concertHall->printStats();
+        keyPicker->printStats();
+        GLStateCache::instance().printStats();
+        keyPressCounter[GLFW_KEY_I] = 0;
+    }
+
+    // Key animation on the GPU / on the CPU
+    if (keyPressCounter[GLFW_KEY_G] == 1)
+    {
+        animateKeysOnGPU = !animateKeysOnGPU;
+        cout << "Key animation on the " << (animateKeysOnGPU ? "GPU" : "CPU") << endl;
+        keyPressCounter[GLFW_KEY_G] = 0;
+    }
+
+    // Depth prepass on/off
+    if (keyPressCounter[GLFW_KEY_P] == 1)
+    {
+        renderQueue->setDepthPrepass(!renderQueue->getDepthPrepass());
+        cout << "Depth prepass " << (renderQueue->getDepthPrepass() ? "on" : "off") << endl;
+        keyPressCounter[GLFW_KEY_P] = 0;
+    }
+
+    // Overdraw view on/off
+    if (keyPressCounter[GLFW_KEY_V] == 1)
+    {
+        renderQueue->setOverdrawView(!renderQueue->getOverdrawView());
+        keyPressCounter[GLFW_KEY_V] = 0;
+    }
+
+    // Occlusion culling of the key actions on/off
+    if (keyPressCounter[GLFW_KEY_Q] == 1)
+    {
+        renderQueue->setOcclusionCulling(!renderQueue->getOcclusionCulling());
+        cout << "Occlusion culling " << (renderQueue->getOcclusionCulling() ? "on" : "off") << endl;
+        keyPressCounter[GLFW_KEY_Q] = 0;
+    }
+
+    // On-demand rendering on/off
+    if (keyPressCounter[GLFW_KEY_R] == 1)
+    {
+        renderOnDemand = !renderOnDemand;
+        cout << "Rendering " << (renderOnDemand ? "on demand" : "continuously") << endl;
+        keyPressCounter[GLFW_KEY_R] = 0;
+    }
+
+    // Dynamic resolution on/off
+    if (keyPressCounter[GLFW_KEY_F] == 1)
+    {
+        dynamicResolution->setEnabled(!dynamicResolution->isEnabled());
+        cout << "Dynamic resolution " << (dynamicResolution->isEnabled() ? "on" : "off") << endl;
+        keyPressCounter[GLFW_KEY_F] = 0;
+    }
+
+    // Concert hall on/off
+    if (keyPressCounter[GLFW_KEY_H] == 1 && !hallBenchmark.isRunning())
+    {
+        concertHall->setPianoCount(concertHall->getPianoCount() == 1 ? HALL_PIANO_COUNT : 1);
+        cout << "Concert hall: " << concertHall->getPianoCount() << " pianos" << endl;
+        keyPressCounter[GLFW_KEY_H] = 0;
+    }
+
+    // Concert hall benchmark (vsync off while it runs)
+    if (keyPressCounter[GLFW_KEY_B] == 1 && !hallBenchmark.isRunning())
+    {
+        hallBenchmark.start();
+        glfwSwapInterval(0);
+        keyPressCounter[GLFW_KEY_B] = 0;
+    }
+
+    // Geometry upload benchmark
+    if (keyPressCounter[GLFW_KEY_U] == 1)
+    {
+        UploadBenchmark::run(UPLOAD_BENCHMARK_MODEL);
+        keyPressCounter[GLFW_KEY_U] = 0;
+    }
+
+    // Stage lighting on/off
+    if (keyPressCounter[GLFW_KEY_L] == 1)
+    {
+        stageLightsOn = !stageLightsOn;
+        keyPressCounter[GLFW_KEY_L] = 0;
+    }
+
+    // Memory held by each asset
+    if (keyPressCounter[GLFW_KEY_M] == 1)
+    {
+        MemoryAccounting::instance().dump();
+        keyPressCounter[GLFW_KEY_M] = 0;
+    }
+
     
 }
 
@@ -358,6 +706,17 @@ void MouseButtonCallback(GLFWwindow* window, int button, int action, int mods)
 {
     cout << button << " " << action << " " << mods << endl;
     
+    // left button: press the key under the cursor (picked in DoAction)
+    if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_PRESS)
+    {
+        glfwGetCursorPos(window, &clickX, &clickY);
+        clickPending = true;
+    }
+    else if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_RELEASE)
+    {
+        clickReleased = true;
+    }
+
     // scroll wheel: press
     if (button == 2 && action == 1)
     {
@@ -372,6 +731,41 @@ void MouseButtonCallback(GLFWwindow* window, int button, int action, int mods)
 
 void windowResizeCallback(GLFWwindow* window, int width, int height) {
     if (height == 0) return;
+    SCREEN_WIDTH = width;
+    SCREEN_HEIGHT = height;
     aspectRatio = (float)width / (float)height;
     glViewport(0, 0, width, height);
-}
\ No newline at end of file
+}
+
+// a ring of colored spot lights above the piano, aimed at the keyboard, plus a few warm point lights around it
+vector<Light> makeStageLights()
+{
+    vector<Light> stage;
+    const int spotCount = 32;
+    glm::vec3 target = glm::vec3(0.0f, 0.8f, 0.0f);
+    for (int i = 0; i < spotCount; i++)
+    {
+        GLfloat angle = glm::two_pi<GLfloat>() * i / spotCount;
+        Light spot;
+        spot.position = glm::vec3(4.0f * cos(angle), 3.5f, 4.0f * sin(angle));
+        spot.color = 0.5f * glm::vec3(0.5f + 0.5f * cos(angle), 0.5f + 0.5f * cos(angle + 2.1f), 0.5f + 0.5f * cos(angle + 4.2f));
+        spot.shininess = 30.0f;
+        spot.radius = 8.0f;
+        spot.direction = target - spot.position;
+        spot.spotAngle = 12.0f;
+        stage.push_back(spot);
+    }
+    for (int i = 0; i < 8; i++)
+    {
+        GLfloat angle = glm::two_pi<GLfloat>() * (i + 0.5f) / 8;
+        Light point;
+        point.position = glm::vec3(2.5f * cos(angle), 0.3f, 2.5f * sin(angle));
+        point.color = glm::vec3(0.6f, 0.45f, 0.3f);
+        point.shininess = 10.0f;
+        point.radius = 2.5f;
+        point.direction = glm::vec3(0.0f);
+        point.spotAngle = 0.0f;
+        stage.push_back(point);
+    }
+    return stage;
+}
@@ -0,0 +1,202 @@
+#pragma once
+
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+
+// what the memory is used for
+enum MemoryCategory
+{
+    MEMORY_CPU_GEOMETRY,    // vertex and index copies kept on the CPU
+    MEMORY_GL_BUFFERS,      // buffer objects (the geometry pool, uniform and stream buffers...)
+    MEMORY_TEXTURES,        // texture storage with its mip chain, render targets
+    MEMORY_SHADERS,         // linked programs (the driver's binary size where it reports one)
+    MEMORY_CATEGORY_COUNT
+};
+
+const char* const MEMORY_CATEGORY_NAMES[MEMORY_CATEGORY_COUNT] = { "CPU geometry", "GL buffers", "textures", "shaders" };
+
+struct MemoryUsage
+{
+    size_t current, peak;   // bytes
+};
+
+
+// Bytes held by each asset (a model file, a texture image, a shader pair, or a named subsystem buffer) in each
+// category, with the peak of every figure since startup. The owners report what they allocate and free;
+// the numbers are what was requested from GL / the heap, not what the driver actually reserves.
+// GL thread only.
+class MemoryAccounting
+{
+
+private:
+
+    struct Asset
+    {
+        MemoryUsage categories[MEMORY_CATEGORY_COUNT];
+        MemoryUsage total;
+    };
+
+    map<string, Asset> assets;      // sorted, for the dump
+    MemoryUsage categories[MEMORY_CATEGORY_COUNT];
+    MemoryUsage total;
+
+    double dumpInterval;    // seconds between the periodic dumps (0: off)
+    double lastDump;
+
+
+    MemoryAccounting()
+    {
+        memset(this->categories, 0, sizeof(this->categories));
+        memset(&this->total, 0, sizeof(this->total));
+        this->dumpInterval = 0.0;
+        this->lastDump = 0.0;
+    }
+
+    MemoryAccounting(const MemoryAccounting&) = delete;
+    MemoryAccounting& operator=(const MemoryAccounting&) = delete;
+
+    static void change(MemoryUsage& usage, long long delta)
+    {
+        usage.current = delta < 0 && size_t(-delta) > usage.current ? 0 : size_t((long long)usage.current + delta);
+        usage.peak = max(usage.peak, usage.current);
+    }
+
+    static string megabytes(size_t bytes)
+    {
+        ostringstream text;
+        text << fixed << setprecision(2) << bytes / (1024.0 * 1024.0);
+        return text.str();
+    }
+
+    static string usageText(const MemoryUsage& usage)
+    {
+        return usage.current == 0 && usage.peak == 0 ? "-" : megabytes(usage.current) + " / " + megabytes(usage.peak);
+    }
+
+
+public:
+
+    static MemoryAccounting& instance()
+    {
+        static MemoryAccounting accounting;
+        return accounting;
+    }
+
+    void add(const string& asset, MemoryCategory category, size_t bytes)
+    {
+        this->set(asset, category, this->assets[asset].categories[category].current + bytes);
+    }
+
+    void remove(const string& asset, MemoryCategory category, size_t bytes)
+    {
+        size_t current = this->assets[asset].categories[category].current;
+        this->set(asset, category, current > bytes ? current - bytes : 0);
+    }
+
+    // for owners that recompute their figure instead of tracking every allocation
+    void set(const string& asset, MemoryCategory category, size_t bytes)
+    {
+        Asset& entry = this->assets[asset];
+        long long delta = (long long)bytes - (long long)entry.categories[category].current;
+        if (delta == 0)
+        {
+            return;
+        }
+        change(entry.categories[category], delta);
+        change(entry.total, delta);
+        change(this->categories[category], delta);
+        change(this->total, delta);
+    }
+
+    // an asset's bytes in one category / in all of them (zeros for an unknown asset)
+    MemoryUsage getUsage(const string& asset, MemoryCategory category)
+    {
+        map<string, Asset>::iterator entry = this->assets.find(asset);
+        MemoryUsage none = { 0, 0 };
+        return entry != this->assets.end() ? entry->second.categories[category] : none;
+    }
+
+    MemoryUsage getAssetUsage(const string& asset)
+    {
+        map<string, Asset>::iterator entry = this->assets.find(asset);
+        MemoryUsage none = { 0, 0 };
+        return entry != this->assets.end() ? entry->second.total : none;
+    }
+
+    MemoryUsage getCategoryUsage(MemoryCategory category)
+    {
+        return this->categories[category];
+    }
+
+    MemoryUsage getTotalUsage()
+    {
+        return this->total;
+    }
+
+    // every asset ever reported (also those down to 0 bytes, their peaks stay)
+    vector<string> getAssets()
+    {
+        vector<string> names;
+        names.reserve(this->assets.size());
+        for (map<string, Asset>::iterator it = this->assets.begin(); it != this->assets.end(); ++it)
+        {
+            names.push_back(it->first);
+        }
+        return names;
+    }
+
+    // dump every <seconds> from update() (0: only on request)
+    void setDumpInterval(double seconds)
+    {
+        this->dumpInterval = seconds;
+    }
+
+    // once per frame (time: glfwGetTime)
+    void update(double time)
+    {
+        if (this->dumpInterval > 0.0 && time - this->lastDump >= this->dumpInterval)
+        {
+            this->lastDump = time;
+            this->dump();
+        }
+    }
+
+    // a table of current / peak MB by asset and category
+    void dump()
+    {
+        const int nameWidth = 44, columnWidth = 18;
+        cout << "\nMemoryAccounting (MB, current / peak):\n" << left << setw(nameWidth) << "asset";
+        for (int c = 0; c < MEMORY_CATEGORY_COUNT; c++)
+        {
+            cout << right << setw(columnWidth) << MEMORY_CATEGORY_NAMES[c];
+        }
+        cout << right << setw(columnWidth) << "total" << "\n";
+
+        for (map<string, Asset>::iterator it = this->assets.begin(); it != this->assets.end(); ++it)
+        {
+            string name = it->first.size() > size_t(nameWidth - 1) ? "..." + it->first.substr(it->first.size() - (nameWidth - 4)) : it->first;
+            cout << left << setw(nameWidth) << name << right;
+            for (int c = 0; c < MEMORY_CATEGORY_COUNT; c++)
+            {
+                cout << setw(columnWidth) << usageText(it->second.categories[c]);
+            }
+            cout << setw(columnWidth) << usageText(it->second.total) << "\n";
+        }
+
+        cout << left << setw(nameWidth) << "all" << right;
+        for (int c = 0; c < MEMORY_CATEGORY_COUNT; c++)
+        {
+            cout << setw(columnWidth) << usageText(this->categories[c]);
+        }
+        cout << setw(columnWidth) << usageText(this->total) << "\n" << endl;
+    }
+};
@@ -11,109 +11,132 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include <assimp/Importer.hpp>
 #include "shaderprogram.h"
+#include "texturearray.h"
+#include "renderqueue.h"
+#include "shaderpermutations.h"
+#include "geometrypool.h"
+#include "slotmap.h"
+#include "meshcache.h"
 #include <glm/gtc/type_ptr.hpp>
 
 using namespace std;
 
-struct Vertex
-{
-    glm::vec3 Position;
-    glm::vec3 Normal;
-    glm::vec2 TexCoords;
-};
-
 struct Texture
 {
-    GLuint id;
+    GLuint handle;  // TextureArrayPool handle (resolved to an array layer at draw time)
     string type;
     aiString path;
 };
 
+// what all the copies of a prototype mesh share: its geometry (the CPU copy lives in the owning Model's arenas
+// or, paged back in, in the MeshCache; the GPU one in the GeometryPool), its material and its name
+struct MeshShape
+{
+    string name;
+    const Vertex* vertices;             // NULL while the CPU copy isn't resident (see residency)
+    GLuint vertexCount;
+    const GLuint* indices;
+    GLuint indexCount;
+    vector<Texture> textures;
+
+    MeshResidency residency;
+    string source;                      // the asset file and the mesh's index in its scene (for paging the geometry in)
+    GLuint sourceMesh;
+
+    GeometryRange geometry;             // this shape's part of the shared vertex/index buffers
+    glm::vec3 boundsMin, boundsMax;     // bounding box of the vertices (model space)
+};
+
 class Mesh
 {
 
 private:
   
-    GLuint VAO, VBO, EBO;
-
-    string name;
-    vector<Vertex> vertices;
-    vector<GLuint> indices;
-    vector<Texture> textures;
+    MeshShape* shape;   // shared with the other copies of the prototype
 
     GLfloat rotationLimit;
 
     glm::vec3 position;
     glm::vec3 rotation;
     glm::vec3 scale;
-    Mesh* parent;
+    Handle parent;      // the mesh this one rotates around (in the owning Model's registry)
 
     glm::mat4 M; // model matrix
 
+    bool lit;   // false: drawn with its own color (light markers)
 
-    // Initializes all the buffer objects/arrays
-    void SetupMesh()
-    {
-        
-        // Setup VAO
-        glGenVertexArrays(1, &this->VAO);
-        glBindVertexArray(this->VAO);
-
-        // Setup VBO
-        glGenBuffers(1, &this->VBO);
-        glBindBuffer(GL_ARRAY_BUFFER, this->VBO);
-
-        // Setup EBO
-        glGenBuffers(1, &this->EBO);
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, this->EBO);
+    GLint keyIndex, keyPart;    // piano key this mesh is a moving part of (-1: none), see keyanimation.h
+    GLint cullGroup;            // occlusion culling group (-1: none, always drawn), see occlusionculling.h
 
-        // Load data into vertex buffers
-        glBufferData(GL_ARRAY_BUFFER, this->vertices.size() * sizeof(Vertex), &this->vertices[0], GL_STATIC_DRAW);
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER, this->indices.size() * sizeof(GLuint), &this->indices[0], GL_STATIC_DRAW);
 
-        // Set the vertex attribute pointers and enable
-        // Vertex Positions
-        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)0);
-        glEnableVertexAttribArray(0);
+    // copies are made by instantiate() only
+    Mesh(const Mesh&) = default;
 
-        // Vertex Normals
-        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)offsetof(Vertex, Normal));
-        glEnableVertexAttribArray(1);
 
-        // Vertex Texture Coords
-        glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)offsetof(Vertex, TexCoords));
-        glEnableVertexAttribArray(2);
-
-        glBindVertexArray(0); // reset vertex buffer
-        
+    // find the texture array layers holding this mesh's maps
+    // (a missing map is replaced by a placeholder layer)
+    void resolveTextures(TextureBinding& diffuse, TextureBinding& specular)
+    {
+        diffuse = TextureArrayPool::instance().placeholder(PLACEHOLDER_GREY);
+        specular = TextureArrayPool::instance().placeholder(PLACEHOLDER_BLACK);
 
+        const vector<Texture>& textures = this->shape->textures;
+        for (GLuint i = 0; i < textures.size(); i++)
+        {
+            if (textures[i].type == "texture_diffuse")
+            {
+                diffuse = TextureArrayPool::instance().resolve(textures[i].handle);
+            }
+            else if (textures[i].type == "texture_specular")
+            {
+                specular = TextureArrayPool::instance().resolve(textures[i].handle);
+            }
+        }
     }
 
-
-    // send current M matrix to the shading program
-    void updateUniformM(ShaderProgram* shader)
+    // the cheapest shader variant that can draw this mesh's material
+    GLuint shaderFeatures(bool posedOnGPU, bool pianoInstances)
     {
-        shader->use();
-        glUniformMatrix4fv(shader->u("M"), 1, false, glm::value_ptr(this->M));
-
+        GLuint features = SHADER_INSTANCED;     // the render queue streams the model matrices
+        if (posedOnGPU)
+        {
+            features |= SHADER_SKINNED_KEY;
+        }
+        if (pianoInstances)
+        {
+            features |= SHADER_PIANO_INSTANCES;
+        }
+        if (this->lit)
+        {
+            features |= SHADER_LIT;
+            for (GLuint i = 0; i < this->shape->textures.size(); i++)
+            {
+                if (this->shape->textures[i].type == "texture_specular")
+                {
+                    features |= SHADER_SPECULAR_MAP;
+                }
+            }
+        }
+        return features;
     }
 
-    void updateMeshMatrix()
+    // (parent: the mesh the parent handle resolves to, NULL if none)
+    void updateMeshMatrix(Mesh* parent)
     {
         this->M = glm::mat4(1.0f);
         
         //if mesh has a parent, rotate it around the parent's origin with the rotation = parent's rotation       
-        if (this->parent != nullptr)
+        if (parent != NULL)
         {
 
             // move to parent's origin
-            this->M = glm::translate(this->M, glm::vec3(this->parent->getPosition()));
+            this->M = glm::translate(this->M, glm::vec3(parent->getPosition()));
 
             // rotate
-            this->M = glm::rotate(this->M, glm::radians(this->parent->getRotation().x), glm::vec3(1.f, 0.f, 0.f));
+            this->M = glm::rotate(this->M, glm::radians(parent->getRotation().x), glm::vec3(1.f, 0.f, 0.f));
 
             // move back to original position
-            this->M = glm::translate(this->M, glm::vec3(-1.0f * this->parent->getPosition()));
+            this->M = glm::translate(this->M, glm::vec3(-1.0f * parent->getPosition()));
 
         }
         
@@ -133,7 +156,7 @@ private:
         if (this->isRising)
         {
             // rotating the lid (on z axis)
-            if (this->name == "lid")
+            if (this->shape->name == "lid")
             {
                 risingSpeed = 0.05f * this->getRotationLimit();
                 if ((this->rotation.z < this->rotationLimit && this->rotationLimit > 0) || (this->rotation.z > this->rotationLimit && this->rotationLimit < 0))
@@ -163,7 +186,7 @@ private:
         else if (this->isFalling)
         {
             // rotating the lid (on z axis)
-            if (this->name == "lid")
+            if (this->shape->name == "lid")
             {
                 fallingSpeed = 0.05f * this->getRotationLimit();
                 if ((this->rotation.z > 0 && this->rotationLimit > 0) || (this->rotation.z < 0 && this->rotationLimit < 0))
@@ -205,12 +228,11 @@ public:
     bool isRising;
     bool isFalling;
 
-    Mesh(vector<Vertex> vertices, vector<GLuint> indices, vector<Texture> textures)
+    // a prototype mesh of a shape (its geometry already in the GeometryPool, see meshupload.h)
+    Mesh(MeshShape* shape)
     {
-        this->name = "unknown";
-        this->vertices = vertices;
-        this->indices = indices;
-        this->textures = textures;
+        this->shape = shape;
+        this->shape->name = "unknown";
         this->position = glm::vec3(0.0f);
         this->scale = glm::vec3(1.0f);
         this->rotation = glm::vec3(0.0f);
@@ -220,38 +242,54 @@ public:
         this->isFalling = false;
 
         // for perent-relative transformations
-        this->parent = nullptr;
+        this->parent = INVALID_HANDLE;
+
+        this->lit = true;
+        this->keyIndex = -1;
+        this->keyPart = -1;
+        this->cullGroup = -1;
 
-        this->SetupMesh();
-        this->updateMeshMatrix();
+        this->updateMeshMatrix(NULL);
     }
 
+    Mesh(Mesh&&) = default;
+    Mesh& operator=(Mesh&&) = default;
+    Mesh& operator=(const Mesh&) = delete;
 
-    // Render the mesh
-    void Draw(ShaderProgram* shader)
+    // a copy sharing the shape (geometry, material and name) with this mesh; allocates nothing
+    Mesh instantiate() const
     {
-        for (GLuint i = 0; i < this->textures.size(); i++)
-        {
-            string name = this->textures[i].type;
+        return Mesh(*this);
+    }
 
-            // send tecture to the shader
-            glUniform1i(shader->u(name.c_str()), this->textures[i].id );
 
-            // activate texture
-            glActiveTexture(GL_TEXTURE0 + this->textures[i].id);
+    // Advance the mesh animation and record its draw call in the render queue
+    // (animateKeysOnGPU: key parts are drawn in their rest pose and rotated by the vertex shader)
+    // (pianoCount: draw a copy for each concert hall piano, see concerthall.h)
+    // (parent: the mesh getParent() resolves to, NULL if none)
+    void Submit(RenderQueue& queue, ShaderPermutations& shaders, Mesh* parent, bool animateKeysOnGPU = false, int pianoCount = 1)
+    {
+        updateAnimationPositions(); // sets the right rotation attributes depending on whether the mesh is currently in motion (isFalling, isRising)
 
-            // bind the texture
-            glBindTexture(GL_TEXTURE_2D, this->textures[i].id);
+        bool posedOnGPU = animateKeysOnGPU && this->keyPart >= 0;
+        if (posedOnGPU)
+        {
+            this->M = glm::translate(glm::mat4(1.0f), this->position);
+        }
+        else
+        {
+            updateMeshMatrix(parent);   // applies animation transformations to the M matrix
         }
 
-        updateUniformM(shader);  // re-sends the M matrix to the shader program
-        updateAnimationPositions(); // sets the right rotation attributes depending on whether the mesh is currently in motion (isFalling, isRising)
-        updateMeshMatrix();     // applies animation transformations to the M matrix
+        TextureBinding diffuse, specular;
+        resolveTextures(diffuse, specular);
+
+        // the depth-only variant keeps only the features that move vertices
+        GLuint features = this->shaderFeatures(posedOnGPU, pianoCount > 1);
+        GLuint depthFeatures = (features & (SHADER_INSTANCED | SHADER_SKINNED_KEY | SHADER_PIANO_INSTANCES)) | SHADER_DEPTH_ONLY;
 
-        // Draw mesh
-        glBindVertexArray(this->VAO);
-        glDrawElements(GL_TRIANGLES, this->indices.size(), GL_UNSIGNED_INT, 0);
-        glBindVertexArray(0);
+        queue.submit(shaders.get(features), shaders.get(depthFeatures), GeometryPool::instance().getVertexArray(), this->shape->geometry, diffuse, specular, this->M,
+            this->keyIndex, this->keyPart, this->cullGroup, GLuint(pianoCount));
     }
 
         
@@ -275,16 +313,33 @@ public:
         this->rotationLimit = limit;
     }
 
-    void setName(string name)
+    // (names the shape: every copy of the prototype)
+    void setName(const string& name)
     {
-        this->name = name;
+        this->shape->name = name;
     }
 
-    void setParent(Mesh* parent)
+    void setParent(Handle parent)
     {
         this->parent = parent;
     }
 
+    void setLit(bool lit)
+    {
+        this->lit = lit;
+    }
+
+    void setKeyPart(GLint keyIndex, GLint keyPart)
+    {
+        this->keyIndex = keyIndex;
+        this->keyPart = keyPart;
+    }
+
+    void setCullGroup(GLint cullGroup)
+    {
+        this->cullGroup = cullGroup;
+    }
+
 
     glm::vec3 getPosition()
     {
@@ -306,22 +361,112 @@ public:
         return this->rotationLimit;
     }
 
-    string getName()
+    GLint getKeyIndex()
+    {
+        return this->keyIndex;
+    }
+
+    GLint getKeyPart()
+    {
+        return this->keyPart;
+    }
+
+    // how far the animation has gone towards the rotation limit (0 - at rest, 1 - at the limit)
+    GLfloat getAnimationAmount()
+    {
+        return this->rotationLimit != 0.0f ? this->rotation.x / this->rotationLimit : 0.0f;
+    }
+
+    // make the CPU copy of the geometry available to getVertices / getIndices (MESH_ON_DEMAND pages it in);
+    // false if it was dropped after the upload. Pair with releaseGeometry.
+    bool acquireGeometry()
+    {
+        if (this->shape->residency != MESH_ON_DEMAND)
+        {
+            return this->shape->vertices != NULL;
+        }
+        return MeshCache::instance().acquire(this->shape->source, this->shape->sourceMesh, this->shape->vertexCount, this->shape->indexCount,
+            this->shape->vertices, this->shape->indices);
+    }
+
+    void releaseGeometry()
+    {
+        if (this->shape->residency == MESH_ON_DEMAND && this->shape->vertices != NULL)
+        {
+            MeshCache::instance().release(this->shape->source, this->shape->sourceMesh);
+            this->shape->vertices = NULL;
+            this->shape->indices = NULL;
+        }
+    }
+
+    // forget the CPU copy kept since the import (its owner frees it) and treat the geometry as <residency> from now on
+    void dropKeptGeometry(MeshResidency residency)
+    {
+        if (this->shape->residency == MESH_KEEP)
+        {
+            this->shape->vertices = NULL;
+            this->shape->indices = NULL;
+            this->shape->residency = residency;
+        }
+    }
+
+    // the CPU copy of the geometry (model space; NULL unless it's resident, see acquireGeometry)
+    const Vertex* getVertices()
+    {
+        return this->shape->vertices;
+    }
+
+    GLuint getVertexCount()
+    {
+        return this->shape->vertexCount;
+    }
+
+    const GLuint* getIndices()
+    {
+        return this->shape->indices;
+    }
+
+    GLuint getIndexCount()
+    {
+        return this->shape->indexCount;
+    }
+
+    // where the geometry lives in the shared buffers (copies of a prototype share it)
+    const GeometryRange& getGeometry()
+    {
+        return this->shape->geometry;
+    }
+
+    // the model matrix of the last submitted frame
+    glm::mat4 getModelMatrix()
+    {
+        return this->M;
+    }
+
+    // the model-space bounding box of the vertices
+    void getBounds(glm::vec3& boundsMin, glm::vec3& boundsMax)
+    {
+        boundsMin = this->shape->boundsMin;
+        boundsMax = this->shape->boundsMax;
+    }
+
+    const string& getName()
     {
-        return this->name;
+        return this->shape->name;
     }
 
-    Mesh* getParent()
+    Handle getParent()
     {
         return this->parent;
     }
 
     void printTexturesInfo()
     {
-        std::cout << "\tNumber of textures: " << this->textures.size() << std::endl;
-        for (int i = 0; i < this->textures.size(); i++)
+        const vector<Texture>& textures = this->shape->textures;
+        std::cout << "\tNumber of textures: " << textures.size() << std::endl;
+        for (int i = 0; i < textures.size(); i++)
         {
-            std::cout << "\t" << i << ") Texture ID: " << this->textures[i].id << ";\tType: " << this->textures[i].type << ";\t\tPath: " << this->textures[i].path.C_Str() << std::endl;
+            std::cout << "\t" << i << ") Texture handle: " << textures[i].handle << ";\tType: " << textures[i].type << ";\t\tPath: " << textures[i].path.C_Str() << std::endl;
 
         }
     }
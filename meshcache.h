@@ -0,0 +1,169 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include <assimp/Importer.hpp>
+#include <assimp/scene.h>
+#include <assimp/postprocess.h>
+
+#include "geometrypool.h"
+#include "meshupload.h"
+#include "memoryaccounting.h"
+#include "startuptrace.h"
+
+using namespace std;
+
+
+// what a Model does with the CPU copy of an asset's geometry once it is in the GeometryPool
+enum MeshResidency
+{
+    MESH_KEEP,          // keep it for the Model's lifetime
+    MESH_DROP,          // never keep it (the mesh can't be picked)
+    MESH_ON_DEMAND      // don't keep it, read it back from the asset through the MeshCache when it's needed
+};
+
+
+// Process-wide store of CPU geometry paged back in from the asset files, for meshes whose copy was released
+// after the upload (MESH_ON_DEMAND). Entries are keyed by file and mesh index and reference counted like the
+// TextureCache's; an entry is freed with its last reference. The last scene read is kept, so paging in several
+// meshes of one file reads it once; trim() frees it.
+class MeshCache
+{
+
+private:
+
+    struct CachedGeometry
+    {
+        vector<Vertex> vertices;
+        vector<GLuint> indices;
+        int refCount;
+    };
+
+    unordered_map<string, CachedGeometry> geometry;     // "file#mesh" -> geometry
+    Assimp::Importer importer;
+    string importedFile;    // file of the scene held by <importer> ("": none)
+
+    // statistics
+    int fileReads, hits;
+
+
+    MeshCache()
+    {
+        this->fileReads = 0;
+        this->hits = 0;
+        this->importer.SetIOHandler(new TracedIOSystem());
+    }
+
+    MeshCache(const MeshCache&) = delete;
+    MeshCache& operator=(const MeshCache&) = delete;
+
+    static string geometryKey(const string& file, GLuint mesh)
+    {
+        return file + "#" + to_string(mesh);
+    }
+
+    // the scene of a file, read with the flags Model::import uses (so mesh indices and vertex order match)
+    const aiScene* scene(const string& file)
+    {
+        if (file != this->importedFile || this->importer.GetScene() == NULL)
+        {
+            this->importedFile = "";
+            TraceScope parse(STAGE_ASSIMP_PARSE, file);
+            if (this->importer.ReadFile(file, aiProcess_Triangulate | aiProcess_FlipUVs) == NULL)
+            {
+                cout << "MeshCache: can't read " << file << ": " << this->importer.GetErrorString() << endl;
+                return NULL;
+            }
+            this->importedFile = file;
+            this->fileReads++;
+        }
+        return this->importer.GetScene();
+    }
+
+
+public:
+
+    static MeshCache& instance()
+    {
+        static MeshCache cache;
+        return cache;
+    }
+
+    // the geometry of mesh <mesh> of <file> (its index in the file's scene); false if it can't be read
+    // (<vertexCount> and <indexCount> are what the Model uploaded: a file changed since then isn't used)
+    bool acquire(const string& file, GLuint mesh, GLuint vertexCount, GLuint indexCount, const Vertex*& vertices, const GLuint*& indices)
+    {
+        string key = geometryKey(file, mesh);
+        unordered_map<string, CachedGeometry>::iterator cached = this->geometry.find(key);
+        if (cached != this->geometry.end())
+        {
+            this->hits++;
+        }
+        else
+        {
+            const aiScene* scene = this->scene(file);
+            if (scene == NULL || mesh >= scene->mNumMeshes || scene->mMeshes[mesh]->mNumVertices != vertexCount
+                || MeshUpload::countIndices(scene->mMeshes[mesh]) != indexCount)
+            {
+                cout << "MeshCache: mesh " << mesh << " of " << file << " doesn't match the uploaded one\n";
+                return false;
+            }
+
+            CachedGeometry entry;
+            entry.vertices.resize(vertexCount);
+            entry.indices.resize(indexCount);
+            entry.refCount = 0;
+            VertexWriter writer(entry.vertices.data(), false);
+            glm::vec3 boundsMin, boundsMax;
+            MeshUpload::writeVertices(scene->mMeshes[mesh], writer, NULL, boundsMin, boundsMax);
+            MeshUpload::writeIndices(scene->mMeshes[mesh], entry.indices.data());
+            cached = this->geometry.insert(make_pair(key, move(entry))).first;
+            MemoryAccounting::instance().add(file, MEMORY_CPU_GEOMETRY, vertexCount * sizeof(Vertex) + indexCount * sizeof(GLuint));
+        }
+
+        cached->second.refCount++;
+        vertices = cached->second.vertices.data();
+        indices = cached->second.indices.data();
+        return true;
+    }
+
+    void release(const string& file, GLuint mesh)
+    {
+        unordered_map<string, CachedGeometry>::iterator cached = this->geometry.find(geometryKey(file, mesh));
+        if (cached == this->geometry.end() || --cached->second.refCount > 0)
+        {
+            return;
+        }
+        MemoryAccounting::instance().remove(file, MEMORY_CPU_GEOMETRY,
+            cached->second.vertices.size() * sizeof(Vertex) + cached->second.indices.size() * sizeof(GLuint));
+        this->geometry.erase(cached);
+    }
+
+    // free the scene kept for paging in more meshes of the same file
+    void trim()
+    {
+        this->importer.FreeScene();
+        this->importedFile = "";
+    }
+
+    size_t getResidentBytes()
+    {
+        size_t bytes = 0;
+        for (unordered_map<string, CachedGeometry>::iterator it = this->geometry.begin(); it != this->geometry.end(); ++it)
+        {
+            bytes += it->second.vertices.size() * sizeof(Vertex) + it->second.indices.size() * sizeof(GLuint);
+        }
+        return bytes;
+    }
+
+    void printStats()
+    {
+        cout << "MeshCache: " << this->geometry.size() << " meshes resident (" << this->getResidentBytes() << " bytes); "
+             << this->fileReads << " file reads, " << this->hits << " hits\n";
+    }
+};
@@ -0,0 +1,264 @@
+#pragma once
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <cstring>
+#include <cfloat>
+#include <chrono>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include <assimp/Importer.hpp>
+#include <assimp/scene.h>
+#include <assimp/postprocess.h>
+
+#include "geometrypool.h"
+#include "startuptrace.h"
+
+using namespace std;
+
+
+// Moves ASSIMP meshes into the GeometryPool in one pass over ASSIMP's position/normal/texture coordinate arrays,
+// writing straight into the mapped vertex buffer in the pool's format (no intermediate vertex list).
+class MeshUpload
+{
+
+public:
+
+    // indices of a mesh's faces
+    static size_t countIndices(const aiMesh* mesh)
+    {
+        size_t count = 0;
+        for (GLuint i = 0; i < mesh->mNumFaces; i++)
+        {
+            count += mesh->mFaces[i].mNumIndices;
+        }
+        return count;
+    }
+
+    // the vertices of a mesh through <writer> (and into <copy> unless it's NULL), and their bounding box
+    static void writeVertices(const aiMesh* mesh, VertexWriter& writer, Vertex* copy, glm::vec3& boundsMin, glm::vec3& boundsMax)
+    {
+        const aiVector3D* positions = mesh->mVertices;
+        const aiVector3D* normals = mesh->HasNormals() ? mesh->mNormals : NULL;
+        const aiVector3D* texCoords = mesh->mTextureCoords[0];
+
+        boundsMin = mesh->mNumVertices > 0 ? glm::vec3(FLT_MAX) : glm::vec3(0.0f);
+        boundsMax = mesh->mNumVertices > 0 ? glm::vec3(-FLT_MAX) : glm::vec3(0.0f);
+        for (GLuint i = 0; i < mesh->mNumVertices; i++)
+        {
+            glm::vec3 position(positions[i].x, positions[i].y, positions[i].z);
+            glm::vec3 normal = normals != NULL ? glm::vec3(normals[i].x, normals[i].y, normals[i].z) : glm::vec3(0.0f);
+            glm::vec2 texCoord = texCoords != NULL ? glm::vec2(texCoords[i].x, texCoords[i].y) : glm::vec2(0.0f);
+
+            writer.write(i, position, normal, texCoord);
+            if (copy != NULL)
+            {
+                copy[i].Position = position;
+                copy[i].Normal = normal;
+                copy[i].TexCoords = texCoord;
+            }
+            boundsMin = glm::min(boundsMin, position);
+            boundsMax = glm::max(boundsMax, position);
+        }
+    }
+
+    static void writeIndices(const aiMesh* mesh, GLuint* indices)
+    {
+        GLuint index = 0;
+        for (GLuint i = 0; i < mesh->mNumFaces; i++)
+        {
+            const aiFace& face = mesh->mFaces[i];
+            for (GLuint j = 0; j < face.mNumIndices; j++)
+            {
+                indices[index++] = face.mIndices[j];
+            }
+        }
+    }
+
+    // put a mesh into the pool (and into the CPU copies unless they're NULL)
+    static GeometryRange upload(const aiMesh* mesh, Vertex* vertexCopy, GLuint* indexCopy, glm::vec3& boundsMin, glm::vec3& boundsMax)
+    {
+        GLuint indexCount = GLuint(countIndices(mesh));
+        return GeometryPool::instance().allocate(mesh->mNumVertices, indexCount, [&](VertexWriter& vertices, GLuint* indices)
+        {
+            TraceScope conversion(STAGE_VERTEX_CONVERSION);
+            writeVertices(mesh, vertices, vertexCopy, boundsMin, boundsMax);
+            if (indexCopy != NULL)
+            {
+                // (the mapped range is never read: the copy is written first)
+                writeIndices(mesh, indexCopy);
+                memcpy(indices, indexCopy, indexCount * sizeof(GLuint));
+            }
+            else
+            {
+                writeIndices(mesh, indices);
+            }
+        });
+    }
+};
+
+
+// Times getting one model file's geometry onto the GPU three ways: the old path (a vertex vector built with push_back,
+// then glBufferSubData), written into the mapped buffer, and written into the mapped buffer packed.
+// Uses its own scratch buffers, so the pool isn't touched.
+class UploadBenchmark
+{
+
+private:
+
+    static const int REPEATS = 10;
+
+    // one upload of all the scene's meshes; returns milliseconds (glFinish on both ends, so the driver's copy counts)
+    template <typename Upload>
+    static double timeUpload(Upload upload)
+    {
+        glFinish();
+        auto start = chrono::high_resolution_clock::now();
+        upload();
+        glFinish();
+        return chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count();
+    }
+
+    static void uploadStaged(const aiScene* scene, GLuint vertexBuffer, GLuint indexBuffer)
+    {
+        GLintptr vertexOffset = 0, indexOffset = 0;
+        for (GLuint m = 0; m < scene->mNumMeshes; m++)
+        {
+            const aiMesh* mesh = scene->mMeshes[m];
+            vector<Vertex> vertices;
+            vector<GLuint> indices;
+            for (GLuint i = 0; i < mesh->mNumVertices; i++)
+            {
+                Vertex vertex;
+                vertex.Position = glm::vec3(mesh->mVertices[i].x, mesh->mVertices[i].y, mesh->mVertices[i].z);
+                vertex.Normal = mesh->HasNormals() ? glm::vec3(mesh->mNormals[i].x, mesh->mNormals[i].y, mesh->mNormals[i].z) : glm::vec3(0.0f);
+                vertex.TexCoords = mesh->mTextureCoords[0] ? glm::vec2(mesh->mTextureCoords[0][i].x, mesh->mTextureCoords[0][i].y) : glm::vec2(0.0f);
+                vertices.push_back(vertex);
+            }
+            for (GLuint i = 0; i < mesh->mNumFaces; i++)
+            {
+                for (GLuint j = 0; j < mesh->mFaces[i].mNumIndices; j++)
+                {
+                    indices.push_back(mesh->mFaces[i].mIndices[j]);
+                }
+            }
+
+            glBindBuffer(GL_COPY_WRITE_BUFFER, vertexBuffer);
+            glBufferSubData(GL_COPY_WRITE_BUFFER, vertexOffset, vertices.size() * sizeof(Vertex), vertices.data());
+            glBindBuffer(GL_COPY_WRITE_BUFFER, indexBuffer);
+            glBufferSubData(GL_COPY_WRITE_BUFFER, indexOffset, indices.size() * sizeof(GLuint), indices.data());
+            vertexOffset += vertices.size() * sizeof(Vertex);
+            indexOffset += indices.size() * sizeof(GLuint);
+        }
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    }
+
+    // false if the driver refused a mapping (nothing is written then)
+    static bool uploadMapped(const aiScene* scene, GLuint vertexBuffer, GLuint indexBuffer, bool packed)
+    {
+        bool mapped = true;
+        GLsizeiptr stride = packed ? sizeof(PackedVertex) : sizeof(Vertex);
+        GLintptr vertexOffset = 0, indexOffset = 0;
+        GLbitfield access = GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT;
+        for (GLuint m = 0; m < scene->mNumMeshes; m++)
+        {
+            const aiMesh* mesh = scene->mMeshes[m];
+            GLsizeiptr vertexBytes = mesh->mNumVertices * stride, indexBytes = MeshUpload::countIndices(mesh) * sizeof(GLuint);
+            if (vertexBytes == 0 || indexBytes == 0)
+            {
+                continue;
+            }
+            glBindBuffer(GL_COPY_WRITE_BUFFER, vertexBuffer);
+            glBindBuffer(GL_COPY_READ_BUFFER, indexBuffer);
+            void* vertices = glMapBufferRange(GL_COPY_WRITE_BUFFER, vertexOffset, vertexBytes, access);
+            GLuint* indices = (GLuint*)glMapBufferRange(GL_COPY_READ_BUFFER, indexOffset, indexBytes, access);
+            if (vertices != NULL && indices != NULL)
+            {
+                VertexWriter writer(vertices, packed);
+                glm::vec3 boundsMin, boundsMax;
+                MeshUpload::writeVertices(mesh, writer, NULL, boundsMin, boundsMax);
+                MeshUpload::writeIndices(mesh, indices);
+            }
+            if (vertices != NULL)
+            {
+                glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+            }
+            if (indices != NULL)
+            {
+                glUnmapBuffer(GL_COPY_READ_BUFFER);
+            }
+            if (vertices == NULL || indices == NULL)
+            {
+                mapped = false;
+                break;
+            }
+            vertexOffset += vertexBytes;
+            indexOffset += indexBytes;
+        }
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+        glBindBuffer(GL_COPY_READ_BUFFER, 0);
+        return mapped;
+    }
+
+
+public:
+
+    static void run(const string& path)
+    {
+        Assimp::Importer importer;
+        const aiScene* scene = importer.ReadFile(path, aiProcess_Triangulate | aiProcess_FlipUVs);
+        if (!scene || scene->mFlags == AI_SCENE_FLAGS_INCOMPLETE)
+        {
+            cout << "UploadBenchmark: can't read " << path << ": " << importer.GetErrorString() << endl;
+            return;
+        }
+        size_t vertexCount = 0, indexCount = 0;
+        for (GLuint m = 0; m < scene->mNumMeshes; m++)
+        {
+            vertexCount += scene->mMeshes[m]->mNumVertices;
+            indexCount += MeshUpload::countIndices(scene->mMeshes[m]);
+        }
+
+        GLuint buffers[2];
+        glGenBuffers(2, buffers);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, buffers[0]);
+        glBufferData(GL_COPY_WRITE_BUFFER, vertexCount * sizeof(Vertex), NULL, GL_STATIC_DRAW);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, buffers[1]);
+        glBufferData(GL_COPY_WRITE_BUFFER, indexCount * sizeof(GLuint), NULL, GL_STATIC_DRAW);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+        const char* names[3] = { "vector + glBufferSubData", "mapped", "mapped, packed" };
+        size_t strides[3] = { sizeof(Vertex), sizeof(Vertex), sizeof(PackedVertex) };
+        double milliseconds[3] = { 0.0, 0.0, 0.0 };
+        bool mapped[3] = { true, true, true };
+        for (int repeat = 0; repeat < REPEATS; repeat++)
+        {
+            milliseconds[0] += timeUpload([&]() { uploadStaged(scene, buffers[0], buffers[1]); });
+            for (int i = 1; i < 3; i++)
+            {
+                if (mapped[i])
+                {
+                    milliseconds[i] += timeUpload([&]() { mapped[i] = uploadMapped(scene, buffers[0], buffers[1], i == 2); });
+                }
+            }
+        }
+        glDeleteBuffers(2, buffers);
+
+        cout << "\nUploadBenchmark: " << path << " (" << scene->mNumMeshes << " meshes, " << vertexCount << " vertices, " << indexCount << " indices, "
+            << REPEATS << " runs)\n";
+        cout << setw(26) << "path" << setw(12) << "ms" << setw(14) << "vertex bytes" << "\n";
+        for (int i = 0; i < 3; i++)
+        {
+            if (!mapped[i])
+            {
+                cout << setw(26) << names[i] << setw(12) << "map failed" << "\n";
+                continue;
+            }
+            cout << setw(26) << names[i] << setw(12) << fixed << setprecision(3) << milliseconds[i] / REPEATS << defaultfloat
+                << setw(14) << vertexCount * strides[i] << "\n";
+        }
+        cout << endl;
+    }
+};
@@ -5,21 +5,55 @@
 #include <sstream>
 #include <iostream>
 #include <map>
+#include <unordered_map>
 #include <vector>
+#include <cfloat>
 
 #include <GL/glew.h>
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
-#include "SOIL2/SOIL2.h"
 #include <assimp/Importer.hpp>
 #include <assimp/scene.h>
 #include <assimp/postprocess.h>
 
 #include "Mesh.h"
+#include "texturecache.h"
+#include "keyanimation.h"
+#include "slotmap.h"
+#include "keyboardlayout.h"
+#include "arena.h"
+#include "allocationcounter.h"
+#include "meshupload.h"
+#include "memoryaccounting.h"
+#include "startuptrace.h"
 
 using namespace std;
 
-GLint TextureFromFile(const char* path, string directory);
+
+const int KEY_MESH_COUNT = 8;       // meshes making up one piano key (the first KEY_PART_COUNT of them move)
+const int MIDI_NOTE_COUNT = 128;
+
+// block sizes of the import arenas (in items)
+const size_t VERTEX_ARENA_BLOCK = 1 << 16;
+const size_t INDEX_ARENA_BLOCK = 1 << 17;
+const size_t SHAPE_ARENA_BLOCK = 32;
+const char* const ARENA_ASSET = "model arenas (unused)";     // MemoryAccounting asset of the arena space no geometry took
+
+// names of a key's meshes in the registry ("key<number>.<part name>", numbered from 1 like keyPressed)
+const char* const KEY_MESH_NAMES[KEY_MESH_COUNT] = { "base", "hammer", "wippen", "repetition_lever", "jack", "top_bar", "jack_cylinder", "bottom_handle" };
+
+// the meshes of one piano key
+struct KeyEntry
+{
+    Handle meshes[KEY_MESH_COUNT];  // in KEY_MESH_NAMES order
+};
+
+// which key (and which of its meshes) a mesh is
+struct KeyMeshRef
+{
+    GLint key;      // -1: not part of a key
+    GLint part;
+};
 
 
 class Model
@@ -29,33 +63,299 @@ class Model
 public:
 
     // constructor - load all models linked by paths
-    Model(vector<string> paths)
+    // (a light marker cube is placed at each of <lightPositions>; layout: the range of keys to build, see keyboardlayout.h;
+    // residency: by path, what to do with the CPU copy of its geometry after the upload (MESH_KEEP for paths past its end))
+    Model(vector<string> paths, vector<glm::vec3> lightPositions = vector<glm::vec3>(), KeyboardLayout layout = KEYBOARD_87,
+        vector<MeshResidency> residency = vector<MeshResidency>())
+        : vertexArena(VERTEX_ARENA_BLOCK), indexArena(INDEX_ARENA_BLOCK), shapeArena(SHAPE_ARENA_BLOCK)
     {
+        this->lightPositions = lightPositions;
+        this->layout = layout;
+        this->residency = residency;
+        this->importResidency = MESH_KEEP;
+        this->keptBytes = 0;
+        this->releasedBytes = 0;
+        this->arenaSlackBytes = 0;
+        this->keyCount = 0;
+        this->lid = INVALID_HANDLE;
+        for (int note = 0; note < MIDI_NOTE_COUNT; note++)
+        {
+            this->noteKeys[note] = -1;
+        }
         this->import(paths);
     }
 
-    // draw each mesh within the model class using shader program
-    //void Draw(Shader shader)
-    void Draw(ShaderProgram* shader)
+    // hand the shared textures back to the cache, take the arenas off the MemoryAccounting
+    // (the geometry stays in the GeometryPool, which never frees it, so it stays accounted too)
+    ~Model()
     {
+        for (GLuint i = 0; i < this->materialKeys.size(); i++)
+        {
+            TextureCache::instance().releaseMaterial(this->materialKeys[i]);
+        }
+        for (map<string, size_t>::iterator it = this->assetGeometryBytes.begin(); it != this->assetGeometryBytes.end(); ++it)
+        {
+            MemoryAccounting::instance().remove(it->first, MEMORY_CPU_GEOMETRY, it->second);
+        }
+        MemoryAccounting::instance().remove(ARENA_ASSET, MEMORY_CPU_GEOMETRY, this->arenaSlackBytes);
+    }
+
+    Model(const Model&) = delete;
+    Model& operator=(const Model&) = delete;
+
+    // free the CPU geometry kept since the import, once its readers (the KeyPicker) are built; the prototypes
+    // kept MESH_KEEP become <residency> (MESH_ON_DEMAND: paged in again through the MeshCache if they're needed)
+    void releaseKeptGeometry(MeshResidency residency = MESH_ON_DEMAND)
+    {
+        for (GLuint i = 0; i < this->elements.size(); i++)
+        {
+            this->elements[i].dropKeptGeometry(residency);
+        }
+        for (map<string, size_t>::iterator it = this->assetGeometryBytes.begin(); it != this->assetGeometryBytes.end(); ++it)
+        {
+            MemoryAccounting::instance().remove(it->first, MEMORY_CPU_GEOMETRY, it->second);
+        }
+        MemoryAccounting::instance().remove(ARENA_ASSET, MEMORY_CPU_GEOMETRY, this->arenaSlackBytes);
+        size_t arenaBytes = this->vertexArena.getBytes() + this->indexArena.getBytes();
+        cout << "Model: released " << this->keptBytes << " bytes of CPU geometry (" << arenaBytes << " bytes of arenas)\n";
+
+        this->vertexArena.clear();
+        this->indexArena.clear();
+        this->assetGeometryBytes.clear();
+        this->arenaSlackBytes = 0;
+        this->releasedBytes += this->keptBytes;
+        this->keptBytes = 0;
+    }
+
+    // submit each mesh within the model class to the render queue (drawn when the queue is executed)
+    // (each mesh picks the shader variant its material needs; animateKeysOnGPU: see getKeyPressAmounts)
+    // (pianoCount: the piano is drawn once per concert hall piano, the light markers only once)
+    void Submit(RenderQueue& queue, ShaderPermutations& shaders, bool animateKeysOnGPU = false, int pianoCount = 1)
+    {
+        GLuint pianoMeshes = GLuint(this->meshes.size() - this->lightPositions.size());
         for (GLuint i = 0; i < this->meshes.size(); i++)
         {
-            this->meshes[i].Draw(shader);
+            Mesh& mesh = this->meshes[i];
+            mesh.Submit(queue, shaders, this->meshes.get(mesh.getParent()), animateKeysOnGPU, i < pianoMeshes ? pianoCount : 1);
         }
     }
 
+    int getKeyCount()
+    {
+        return this->keyCount;
+    }
+
+    // press amount of every key (0 - up, 1 - fully pressed), for posing the keys on the GPU
+    // (all moving parts of a key rotate towards their limits at the same rate, so the key base stands for the whole key)
+    const vector<GLfloat>& getKeyPressAmounts()
+    {
+        this->keyPressAmounts.resize(this->keyCount);
+        for (int i = 0; i < this->keyCount; i++)
+        {
+            this->keyPressAmounts[i] = this->meshes.get(this->keys[i].meshes[KEY_PART_BASE])->getAnimationAmount();
+        }
+        return this->keyPressAmounts;
+    }
+
+    // rotation limits and parent pivots of the moving key parts, taken from the first key
+    // (the same for every key; the pivots are relative to the part's own origin)
+    KeyPartUniforms getKeyPartTable()
+    {
+        KeyPartUniforms parts;
+        memset(&parts, 0, sizeof(parts));
+        for (int part = 0; part < KEY_PART_COUNT && this->keyCount > 0; part++)
+        {
+            Mesh& mesh = *this->meshes.get(this->keys[0].meshes[part]);
+            Mesh* parent = this->meshes.get(mesh.getParent());
+            parts.limits[part] = glm::vec4(mesh.getRotationLimit(), 0.0f, 0.0f, 0.0f);
+            if (parent != NULL)
+            {
+                parts.parents[part] = glm::vec4(parent->getPosition() - mesh.getPosition(), parent->getRotationLimit());
+            }
+        }
+        return parts;
+    }
+
+    // the model matrix of a key part at a press amount (the same transform as the SKINNED_KEY shader)
+    glm::mat4 keyPartMatrix(Mesh& mesh, int part, GLfloat press)
+    {
+        glm::mat4 M = glm::translate(glm::mat4(1.0f), mesh.getPosition());
+        if (part < KEY_PART_COUNT)
+        {
+            M = glm::rotate(M, glm::radians(press * mesh.getRotationLimit()), glm::vec3(1.f, 0.f, 0.f));
+            Mesh* parent = this->meshes.get(mesh.getParent());
+            if (parent != NULL)
+            {
+                glm::vec3 pivot = parent->getPosition();
+                M = glm::translate(glm::mat4(1.0f), pivot) * glm::rotate(glm::mat4(1.0f), glm::radians(press * parent->getRotationLimit()), glm::vec3(1.f, 0.f, 0.f))
+                    * glm::translate(glm::mat4(1.0f), -pivot) * M;
+            }
+        }
+        return M;
+    }
+
+    // meshes of the piano itself (the light markers follow them in the mesh list)
+    int getPianoMeshCount()
+    {
+        return int(this->meshes.size() - this->lightPositions.size());
+    }
+
+    Mesh& getMesh(int i)
+    {
+        return this->meshes[i];
+    }
+
+    // the registry handle of the i-th mesh (handles stay valid however the mesh list grows)
+    Handle getMeshHandle(int i)
+    {
+        return this->meshes.handleAt(i);
+    }
+
+    Mesh* getMesh(Handle handle)
+    {
+        return this->meshes.get(handle);
+    }
+
+    // a mesh by its registry name ("lid", "floor", "key40.hammer", "light0", ...), INVALID_HANDLE if there's none
+    Handle findMesh(const string& name)
+    {
+        // key meshes aren't stored by name: "key<number>.<part>" is looked up in the key table
+        if (name.compare(0, 3, "key") == 0)
+        {
+            size_t dot = name.find('.');
+            bool number = dot != string::npos && dot > 3 && dot <= 6;
+            int key = 0;
+            for (size_t i = 3; i < dot && number; i++)
+            {
+                number = name[i] >= '0' && name[i] <= '9';
+                key = key * 10 + (name[i] - '0');
+            }
+            for (int part = 0; part < KEY_MESH_COUNT && number && key >= 1 && key <= this->keyCount; part++)
+            {
+                if (name.compare(dot + 1, string::npos, KEY_MESH_NAMES[part]) == 0)
+                {
+                    return this->keys[key - 1].meshes[part];
+                }
+            }
+            return INVALID_HANDLE;
+        }
+
+        unordered_map<string, Handle>::iterator found = this->meshNames.find(name);
+        return found != this->meshNames.end() ? found->second : INVALID_HANDLE;
+    }
+
+    // the key (from 0) and the key mesh (KEY_MESH_NAMES order) the i-th mesh is; false if it isn't part of a key
+    bool getMeshKey(int i, int& key, int& part)
+    {
+        const KeyMeshRef& ref = this->slotKeys[this->meshes.handleAt(i).index];
+        key = ref.key;
+        part = ref.part;
+        return ref.key >= 0;
+    }
+
+    // the key (from 0) playing a MIDI note, -1 if the keyboard doesn't reach it
+    int getKeyOfNote(int note)
+    {
+        return note >= 0 && note < MIDI_NOTE_COUNT ? this->noteKeys[note] : -1;
+    }
+
+    // the meshes of a key (from 0)
+    const KeyEntry& getKey(int key)
+    {
+        return this->keys[key];
+    }
+
+    // the current pose of a mesh (key parts posed from their key's press amount, whether the GPU or the CPU animates them)
+    glm::mat4 getMeshPose(int i)
+    {
+        int key, part;
+        if (this->getMeshKey(i, key, part))
+        {
+            GLfloat press = this->meshes.get(this->keys[key].meshes[KEY_PART_BASE])->getAnimationAmount();
+            return this->keyPartMatrix(this->meshes[i], part, press);
+        }
+        return this->meshes[i].getModelMatrix();
+    }
+
+    // world-space boxes of the per-octave key action groups (see setCullGroups)
+    // (each box holds its parts in every pose between rest and fully pressed, so the culling stays conservative while keys move)
+    vector<OcclusionBox> getCullGroups()
+    {
+        vector<OcclusionBox> boxes;
+        for (int key = 0; key < this->keyCount; key++)
+        {
+            int group = this->cullGroupOfKey(key);
+            if (group >= int(boxes.size()))
+            {
+                OcclusionBox empty;
+                empty.min = glm::vec3(FLT_MAX);
+                empty.max = glm::vec3(-FLT_MAX);
+                boxes.resize(group + 1, empty);
+            }
+            for (int part = 1; part < KEY_MESH_COUNT; part++)
+            {
+                Mesh& mesh = *this->meshes.get(this->keys[key].meshes[part]);
+                glm::vec3 boundsMin, boundsMax;
+                mesh.getBounds(boundsMin, boundsMax);
+
+                // the part's pose at a few press amounts along its arc
+                int steps = part < KEY_PART_COUNT ? 4 : 0;
+                for (int step = 0; step <= steps; step++)
+                {
+                    glm::mat4 M = this->keyPartMatrix(mesh, part, steps > 0 ? GLfloat(step) / steps : 0.0f);
+                    for (int corner = 0; corner < 8; corner++)
+                    {
+                        glm::vec3 point((corner & 1) ? boundsMax.x : boundsMin.x, (corner & 2) ? boundsMax.y : boundsMin.y, (corner & 4) ? boundsMax.z : boundsMin.z);
+                        glm::vec3 world = glm::vec3(M * glm::vec4(point, 1.0f));
+                        boxes[group].min = glm::min(boxes[group].min, world);
+                        boxes[group].max = glm::max(boxes[group].max, world);
+                    }
+                }
+            }
+        }
+
+        // margin for the arcs between the sampled poses
+        for (GLuint i = 0; i < boxes.size(); i++)
+        {
+            boxes[i].min -= glm::vec3(0.01f);
+            boxes[i].max += glm::vec3(0.01f);
+        }
+        return boxes;
+    }
+
+    // true while any mesh is still moving (a key or the lid rising or falling)
+    bool isAnimating()
+    {
+        for (GLuint i = 0; i < this->meshes.size(); i++)
+        {
+            if (this->meshes[i].isRising || this->meshes[i].isFalling)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
     void openLid()
     {
         cout << "Model::openLid \n";
-        this->meshes[meshes.size() - 4].isFalling = false;
-        this->meshes[meshes.size() - 4].isRising = true;
+        Mesh* lidMesh = this->meshes.get(this->lid);
+        if (lidMesh != NULL)
+        {
+            lidMesh->isFalling = false;
+            lidMesh->isRising = true;
+        }
     }
 
     void closeLid()
     {
         cout << "Model::closeLid\n";
-        this->meshes[meshes.size() - 4].isFalling = true;
-        this->meshes[meshes.size() - 4].isRising = false;
+        Mesh* lidMesh = this->meshes.get(this->lid);
+        if (lidMesh != NULL)
+        {
+            lidMesh->isFalling = true;
+            lidMesh->isRising = false;
+        }
     }
 
     void rotateMesh(int meshID, glm::vec3 rotation)
@@ -88,52 +388,57 @@ public:
         }
     }
        
-    // called when a piano key is pressed
+    // called when a piano key is pressed (keys numbered from 1)
     void keyPressed(int keyNum)
     {
         cout << "Model::keyPressed(" << keyNum << ")\n";  
 
-        int elementsInKey = 8;  // the number of meshes making up 1 piano key
-
-        // save pointers to each of the elements making up the pressed key
-        // (elements are saved in [meshes] one after another)
-        // the 3 immobile elements of the key are ignored
-        Mesh* base = &meshes[(keyNum - 1) * elementsInKey];
-        Mesh* hammer = &meshes[(keyNum - 1) * elementsInKey + 1];
-        Mesh* wippen = &meshes[(keyNum - 1) * elementsInKey + 2];
-        Mesh* repetition_lever = &meshes[(keyNum - 1) * elementsInKey + 3];
-        Mesh* jack = &meshes[(keyNum - 1) * elementsInKey + 4];
-
-  
         // set all the mobile elements of the pressed key in motion
-        for (int keyElem = 0; keyElem < 5; keyElem++)
+        // (the 3 immobile elements of the key are ignored)
+        if (keyNum >= 1 && keyNum <= this->keyCount)
         {
-            this->meshes[(keyNum - 1) * elementsInKey + keyElem].isFalling = false;
-            this->meshes[(keyNum - 1) * elementsInKey + keyElem].isRising = true;
+            for (int keyElem = 0; keyElem < KEY_PART_COUNT; keyElem++)
+            {
+                Mesh* mesh = this->meshes.get(this->keys[keyNum - 1].meshes[keyElem]);
+                mesh->isFalling = false;
+                mesh->isRising = true;
+            }
         }
     }
 
-    // called when a piano key is released
+    // called when a piano key is released (keys numbered from 1)
     void keyReleased(int keyNum)
     {
         cout << "Model::keyReleased("<<keyNum<<")\n";
 
-        int elementsInKey = 8;  // the number of meshes making up 1 piano key
+        // let all the mobile elements of the released key fall back
+        if (keyNum >= 1 && keyNum <= this->keyCount)
+        {
+            for (int keyElem = 0; keyElem < KEY_PART_COUNT; keyElem++)
+            {
+                Mesh* mesh = this->meshes.get(this->keys[keyNum - 1].meshes[keyElem]);
+                mesh->isRising = false;
+                mesh->isFalling = true;
+            }
+        }
+    }
 
-        // save pointers to each of the elements making up the pressed key
-        // (elements are saved in [meshes] one after another)
-        // the 3 immobile elements of the key are ignored
-        Mesh* base = &meshes[(keyNum - 1) * elementsInKey];
-        Mesh* hammer = &meshes[(keyNum - 1) * elementsInKey + 1];
-        Mesh* wippen = &meshes[(keyNum - 1) * elementsInKey + 2];
-        Mesh* repetition_lever = &meshes[(keyNum - 1) * elementsInKey + 3];
-        Mesh* jack = &meshes[(keyNum - 1) * elementsInKey + 4];
+    // MIDI note on / off (notes the keyboard doesn't reach are ignored)
+    void notePressed(int note)
+    {
+        int key = this->getKeyOfNote(note);
+        if (key >= 0)
+        {
+            this->keyPressed(key + 1);
+        }
+    }
 
-        // set all the mobile elements of the pressed key in motion
-        for (int keyElem = 0; keyElem < 5; keyElem++)
+    void noteReleased(int note)
+    {
+        int key = this->getKeyOfNote(note);
+        if (key >= 0)
         {
-            this->meshes[(keyNum - 1) * elementsInKey + keyElem].isRising = false;
-            this->meshes[(keyNum - 1) * elementsInKey + keyElem].isFalling = true;
+            this->keyReleased(key + 1);
         }
     }
 
@@ -142,15 +447,33 @@ public:
 private:
 
     vector<Mesh> elements;  // stores all mesh prototypes
-    vector<Mesh> meshes;    // stores all loaded meshes
-    string directory;       // ???
-    vector<Texture> textures_loaded;	// stores all loaded textures
+    Arena<Vertex> vertexArena;      // CPU geometry of the prototypes (shared by their copies)
+    Arena<GLuint> indexArena;
+    Arena<MeshShape> shapeArena;
+    SlotMap<Mesh> meshes;   // stores all loaded meshes (referred to by handles, see slotmap.h)
+    string directory;       // directory of the file being imported (texture paths are relative to it)
+    string file;            // the file being imported
+    vector<MeshResidency> residency;    // by path
+    MeshResidency importResidency;      // of the file being imported
+    size_t keptBytes, releasedBytes;    // CPU geometry kept in the arenas / released after the upload
+    map<string, size_t> assetGeometryBytes;     // by path: its geometry kept in the arenas
+    size_t arenaSlackBytes;                     // arena blocks not holding any geometry
+    vector<string> materialKeys;    // materials referenced by this model (each holds one reference in the TextureCache)
+    KeyboardLayout layout;
+    int keyCount;                   // keys spawned by addKeys (each made of KEY_MESH_COUNT meshes, the first KEY_PART_COUNT of them moving)
+    vector<KeyEntry> keys;          // by key
+    vector<KeyMeshRef> slotKeys;    // by registry slot (Handle::index)
+    GLint noteKeys[MIDI_NOTE_COUNT];    // by MIDI note: its key (-1: none)
+    unordered_map<string, Handle> meshNames;    // the meshes that aren't keys, by name
+    vector<GLfloat> keyPressAmounts;
+    vector<glm::vec3> lightPositions;   // where to put the light marker cubes
+    Handle lid;
 
     // debugging: print the name of each loaded mesh
     void checkMeshes()
     {
         cout << "\nContents of <meshes>:\n\n";
-        for (int i = 0; i < meshes.size(); i++)
+        for (GLuint i = 0; i < meshes.size(); i++)
         {
             cout << i << ": " << meshes[i].getName() << endl;
         }
@@ -243,201 +566,104 @@ private:
         }
     }
     
+    // add a mesh to the registry
+    Handle addMesh(Mesh&& mesh)
+    {
+        Handle handle = this->meshes.insert(move(mesh));
+        KeyMeshRef none = { -1, -1 };
+        this->slotKeys.resize(max(this->slotKeys.size(), size_t(handle.index) + 1), none);
+        this->slotKeys[handle.index] = none;
+        return handle;
+    }
+
     // set the parent element for the elements rotating around their parent origin
-    void setMeshParents() {
-        int elementsInKey = 8;
-        int numOfKeyMeshes = 87 * elementsInKey; // 87 keys in a full keyboard
-        if (meshes.size() >= numOfKeyMeshes)
+    void setMeshParents()
+    {
+        for (int key = 0; key < this->keyCount; key++)
         {
-            for (int i = 0; i < 87; i++)
-            {
-                this->meshes[i * elementsInKey + 4].setParent(&this->meshes[i * elementsInKey + 2]); // jack -> wippen
-                this->meshes[i * elementsInKey + 3].setParent(&this->meshes[i * elementsInKey + 2]); // repetition lever -> wippen
-
-            }
-        }
-        else {
-            cout << "Model::setMeshParents: meshes not loaded properly\n";
+            Handle* parts = this->keys[key].meshes;
+            this->meshes.get(parts[KEY_PART_JACK])->setParent(parts[KEY_PART_WIPPEN]);
+            this->meshes.get(parts[KEY_PART_REPETITION_LEVER])->setParent(parts[KEY_PART_WIPPEN]);
         }
     }
     
 
-    // load the 12-key-long repeatable pattern and set each key in the right position
-    // (new position calculated as an offset on the x axis from the starting position)
-    void addRepeatableKeys()
+    // the moving parts of each key, in KeyPart order
+    void setKeyParts()
     {
-        // distances between different kinds of keys
-        GLfloat d1 = 0.020929f, d2 = 0.023909f, d3 = 0.016191f;
-        
-        // draw the first 12 pattern keys 
-        // (the same sequence of keys will be repeated later along the x axis to render the entire keyboard)
-
-        // 1 (white)
-        this->meshes.push_back(elements[1]); // elements[1]: white key base (1)
-        this->meshes.back().move(glm::vec3(2*d1 + d2, 0.0f, 0.0f));
-        for (int j = 4; j <= 10; j++) // elements[4-9]: hammer, wippen, repetition_lever, jack, top_bar, jack_cylinder
-        {
-            this->meshes.push_back(elements[j]);
-            this->meshes.back().move(glm::vec3(2 * d1 + d2, 0.0f, 0.0f));
-        }
-
-        // 2 (black)
-        this->meshes.push_back(elements[0]); 
-        this->meshes.back().move(glm::vec3(3 * d1 + d2, 0.0f, 0.0f));
-        for (int j = 4; j <= 10; j++)
-        {
-            this->meshes.push_back(elements[j]);
-            this->meshes.back().move(glm::vec3(3 * d1 + d2, 0.0f, 0.0f));
-        }
-
-        // 3 (white)
-        this->meshes.push_back(elements[3]);
-        this->meshes.back().move(glm::vec3(3 * d1 + d2 + d3, 0.0f, 0.0f));
-        for (int j = 4; j <= 10; j++)
-        {
-            this->meshes.push_back(elements[j]);
-            this->meshes.back().move(glm::vec3(3 * d1 + d2 + d3, 0.0f, 0.0f));
-        }
-
-        // 4 (black)
-        this->meshes.push_back(elements[0]);
-        this->meshes.back().move(glm::vec3(3 * d1 + d2 + 2 * d3, 0.0f, 0.0f));
-        for (int j = 4; j <= 10; j++)
-        {
-            this->meshes.push_back(elements[j]);
-            this->meshes.back().move(glm::vec3(3 * d1 + d2 + 2 * d3, 0.0f, 0.0f));
-        }
-
-        // 5 (white)
-        this->meshes.push_back(elements[2]);
-        this->meshes.back().move(glm::vec3(4 * d1 + d2 + 2 * d3, 0.0f, 0.0f));
-        for (int j = 4; j <= 10; j++)
-        {
-            this->meshes.push_back(elements[j]);
-            this->meshes.back().move(glm::vec3(4 * d1 + d2 + 2 * d3, 0.0f, 0.0f));
-        }
-
-        // 6 (white)
-        this->meshes.push_back(elements[1]);
-        this->meshes.back().move(glm::vec3(4 * d1 + 2 * d2 + 2 * d3, 0.0f, 0.0f));
-        for (int j = 4; j <= 10; j++)
-        {
-            this->meshes.push_back(elements[j]);
-            this->meshes.back().move(glm::vec3(4 * d1 + 2 * d2 + 2 * d3, 0.0f, 0.0f));
-        }
-
-        // 7 (black)
-        this->meshes.push_back(elements[0]);
-        this->meshes.back().move(glm::vec3(5 * d1 + 2 * d2 + 2 * d3, 0.0f, 0.0f));
-        for (int j = 4; j <= 10; j++)
-        {
-            this->meshes.push_back(elements[j]);
-            this->meshes.back().move(glm::vec3(5 * d1 + 2 * d2 + 2 * d3, 0.0f, 0.0f));
-        }
-
-        // 8 (white)
-        this->meshes.push_back(elements[3]);
-        this->meshes.back().move(glm::vec3(5 * d1 + 2 * d2 + 3 * d3, 0.0f, 0.0f));
-        for (int j = 4; j <= 10; j++)
-        {
-            this->meshes.push_back(elements[j]);
-            this->meshes.back().move(glm::vec3(5 * d1 + 2 * d2 + 3 * d3, 0.0f, 0.0f));
-        }
-
-        // 9 (black)
-        this->meshes.push_back(elements[0]);
-        this->meshes.back().move(glm::vec3(5 * d1 + 2 * d2 + 4 * d3, 0.0f, 0.0f));
-        for (int j = 4; j <= 10; j++)
-        {
-            this->meshes.push_back(elements[j]);
-            this->meshes.back().move(glm::vec3(5 * d1 + 2 * d2 + 4 * d3, 0.0f, 0.0f));
-        }
-
-        // 10 (white)
-        this->meshes.push_back(elements[3]);
-        this->meshes.back().move(glm::vec3(5 * d1 + 2 * d2 + 5 * d3, 0.0f, 0.0f));
-        for (int j = 4; j <= 10; j++)
+        for (int key = 0; key < this->keyCount; key++)
         {
-            this->meshes.push_back(elements[j]);
-            this->meshes.back().move(glm::vec3(5 * d1 + 2 * d2 + 5 * d3, 0.0f, 0.0f));
+            for (int part = 0; part < KEY_PART_COUNT; part++)
+            {
+                this->meshes.get(this->keys[key].meshes[part])->setKeyPart(key, part);
+            }
         }
+    }
 
-        // 11 (black)
-        this->meshes.push_back(elements[0]);
-        this->meshes.back().move(glm::vec3(5 * d1 + 2 * d2 + 6 * d3, 0.0f, 0.0f));
-        for (int j = 4; j <= 10; j++)
-        {
-            this->meshes.push_back(elements[j]);
-            this->meshes.back().move(glm::vec3(5 * d1 + 2 * d2 + 6 * d3, 0.0f, 0.0f));
-        }
+    // occlusion culling group of a key: one per octave of the keyboard (the keys below C1 make one of their own)
+    int cullGroupOfKey(int key)
+    {
+        return this->layout.octave(this->layout.lowestNote + key);
+    }
 
-        // 12 (white)
-        this->meshes.push_back(elements[2]);
-        this->meshes.back().move(glm::vec3(6 * d1 + 2 * d2 + 6 * d3, 0.0f, 0.0f));
-        for (int j = 4; j <= 10; j++)
+    // the hidden parts of each key (everything but the key base) are culled per octave when the case covers them
+    void setCullGroups()
+    {
+        for (int key = 0; key < this->keyCount; key++)
         {
-            this->meshes.push_back(elements[j]);
-            this->meshes.back().move(glm::vec3(6 * d1 + 2 * d2 + 6 * d3, 0.0f, 0.0f));
+            for (int part = 0; part < KEY_MESH_COUNT; part++)
+            {
+                if (part != KEY_PART_BASE)
+                {
+                    this->meshes.get(this->keys[key].meshes[part])->setCullGroup(this->cullGroupOfKey(key));
+                }
+            }
         }
-
-        cout << "Model::addRepeatableKeys: Loaded " << meshes.size() << " meshes (all the repeatable meshes).\n";
-
     }
 
-    // load the entire keyboard of keys by repeating the key pattern and translating it on the x axis by a set increment
+    // spawn a key of every note of the layout, each moved along the x axis by the key's offset, and register it
+    // in the key table and the MIDI note table
     void addKeys()
-    {   
-        // distance between each key
-        GLfloat increment = 0.23f, d1 = 0.020929f, d2= 0.023909f, d3 = 0.016191f;
-
-        // add the first 3 off-pattern keys
-        // 1 (white)
-        this->meshes.push_back(elements[1]);
-        for (int i = 4; i <= 10; i++)
-        {
-            this->meshes.push_back(elements[i]);
-        }
-
-        // 2 (black)
-        this->meshes.push_back(elements[0]);
-        this->meshes.back().move(glm::vec3(d1, 0.0f, 0.0f));
-        for (int i = 4; i <= 10; i++)
-        {
-            this->meshes.push_back(elements[i]);
-            this->meshes.back().move(glm::vec3(d1, 0.0f, 0.0f));
-        }   
+    {
+        this->keyCount = this->layout.keyCount();
+        this->keys.resize(this->keyCount);
+        this->meshes.reserve(this->keyCount * KEY_MESH_COUNT + 5 + this->lightPositions.size());
+        this->slotKeys.reserve(this->keyCount * KEY_MESH_COUNT + 5 + this->lightPositions.size());
 
-        // 3 (white)
-        this->meshes.push_back(elements[2]);
-        this->meshes.back().move(glm::vec3(2 * d1, 0.0f, 0.0f));
-        for (int i = 4; i <= 10; i++)
+        for (int key = 0; key < this->keyCount; key++)
         {
-            this->meshes.push_back(elements[i]);
-            this->meshes.back().move(glm::vec3(2 * d1, 0.0f, 0.0f));
-        }
-        
-        // add the repeatable key pattern 7 times for a full keyboard
-        for (int i = 0; i < 7; i++)
-        { 
-            addRepeatableKeys();
+            int note = this->layout.lowestNote + key;
+            glm::vec3 offset(this->layout.offset(note), 0.0f, 0.0f);
 
-            // move each pattern group (of 12 keys - each consisting of 8 meshes!) by a set increment
-            for (int j = 12 * 8; j > 0; j--) 
+            // the base, then <elements>[4-10]: hammer, wippen, repetition_lever, jack, top_bar, jack_cylinder, bottom_handle
+            for (int part = 0; part < KEY_MESH_COUNT; part++)
             {
-                this->meshes[meshes.size() - j].move(GLfloat(i) * glm::vec3(increment, 0.0f, 0.0f));
+                const Mesh& prototype = this->elements[part == 0 ? this->layout.basePrototype(note) : 3 + part];
+                Handle handle = this->addMesh(prototype.instantiate());
+                this->meshes.get(handle)->move(offset);
+                this->keys[key].meshes[part] = handle;
+                this->slotKeys[handle.index].key = key;
+                this->slotKeys[handle.index].part = part;
             }
         }
 
+        for (int note = 0; note < MIDI_NOTE_COUNT; note++)
+        {
+            this->noteKeys[note] = this->layout.contains(note) ? note - this->layout.lowestNote : -1;
+        }
+
+        cout << "Model::addKeys: Loaded " << this->keyCount << " keys (" << meshes.size() << " meshes).\n";
     }
 
 
     void addPianoBody()
     {
-        // <elements>: 11-15 - piano body (+ the floor) meshes
+        // <elements>: 11-15 - piano body (+ the floor) meshes, registered under their element names
         for (int i = 11; i <= 15; i++)
         {
-            this->meshes.push_back(elements[i]);
+            this->meshNames[elements[i].getName()] = this->addMesh(elements[i].instantiate());
         }
+        this->lid = this->findMesh("lid");
     }
 
     // Loads .obj models using ASSIMP and stores the resulting meshes in the <meshes> vector.
@@ -445,41 +671,83 @@ private:
     {
         cout << "model::import() initiated\n";
 
-        // Define an ASSIMP importer object
+        // Define an ASSIMP importer object (reading through the startup trace, so file reads and parsing are timed apart)
         Assimp::Importer importer;
+        importer.SetIOHandler(new TracedIOSystem());
+
+        // heap allocations of each stage (ASSIMP's own, building the prototypes, spawning the keyboard)
+        AllocationCounter& allocations = AllocationCounter::instance();
+        unsigned long long assimpAllocations = 0, meshAllocations = 0;
+        unsigned long long start = allocations.getCount();
 
-        // store all assimp-generated scenes in a vector (always 1 scene generated per 1 file import)
-        vector<const aiScene*> scenes;
+        this->elements.reserve(paths.size() + 4);
 
-        // import all elements from <paths> into a new assimp scene 
+        // import all elements from <paths> into a new assimp scene (always 1 scene generated per 1 file import)
         for (int i = 0; i < paths.size(); i++)
         {
-            scenes.push_back(importer.ReadFile(paths[i], aiProcess_Triangulate | aiProcess_FlipUVs));
+            unsigned long long readStart = allocations.getCount();
+            const aiScene* scene;
+            {
+                TraceScope parse(STAGE_ASSIMP_PARSE, paths[i]);
+                scene = importer.ReadFile(paths[i], aiProcess_Triangulate | aiProcess_FlipUVs);
+            }
+            assimpAllocations += allocations.getCount() - readStart;
 
             // Check for errors
-            if (!scenes[i] || scenes[i]->mFlags == AI_SCENE_FLAGS_INCOMPLETE || !scenes[i]->mRootNode)
+            if (!scene || scene->mFlags == AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode)
             {
                 cout << "ERROR::ASSIMP:: " << importer.GetErrorString() << endl;
                 return;
             }
-            
+
+            unsigned long long meshStart = allocations.getCount();
+
             // Retrieve the directory path of the filepath
             this->directory = paths[i].substr(0, paths[i].find_last_of('/'));
+            this->file = paths[i];
+            this->importResidency = i < this->residency.size() ? this->residency[i] : MESH_KEEP;
+
+            // room for the whole scene's geometry in one run of each arena
+            size_t vertexCount = 0, indexCount = 0;
+            for (GLuint j = 0; j < scene->mNumMeshes; j++)
+            {
+                vertexCount += scene->mMeshes[j]->mNumVertices;
+                indexCount += MeshUpload::countIndices(scene->mMeshes[j]);
+            }
+            if (this->importResidency == MESH_KEEP)
+            {
+                this->vertexArena.reserve(vertexCount);
+                this->indexArena.reserve(indexCount);
+            }
 
             // Process ASSIMP's root node recursively
-            this->processNode(scenes[i]->mRootNode, scenes[i]);
-        }                 
+            this->processNode(scene->mRootNode, scene);
+            meshAllocations += allocations.getCount() - meshStart;
+        }
+        unsigned long long keyStart = allocations.getCount();                 
+
+        TextureCache::instance().printStats();
         
         // after loading all prototype elements - do all the neccessary updates
-        updateElementPositions();
-        setElementRotationLimits();
-        setElementNames();
+        // (traced as the key layout up to here; the checks below are console dumps and stay out of the trace)
+        {
+            TraceScope keyLayout(STAGE_KEY_LAYOUT);
+            updateElementPositions();
+            setElementRotationLimits();
+            setElementNames();
+
+            // spawn key prototypes
+            addKeys();
+
+            // set the parent mehses within each key across the full keyboard
+            setMeshParents();
 
-        // spawn key prototypes
-        addKeys();
+            // tag the moving parts with their key (for animating them on the GPU)
+            setKeyParts();
 
-        // set the parent mehses within each key across the full keyboard
-        setMeshParents();
+            // group the key actions by octave (for occlusion culling)
+            setCullGroups();
+        }
 
         // check the order of the loaded meshes
         checkMeshes();
@@ -494,10 +762,24 @@ private:
         addPianoBody();
 
         // add cubes in light source positions
-        this->meshes.push_back(this->elements[16]);
-        this->meshes[this->meshes.size() - 1].setPosition(glm::vec3(2.5, -0.5, 2.2));
-        this->meshes.push_back(this->elements[16]);
-        this->meshes[this->meshes.size() - 1].setPosition(glm::vec3(-2.5, 0.5, -2.2));
+        this->meshNames.reserve(8 + this->lightPositions.size());
+        for (GLuint i = 0; i < this->lightPositions.size(); i++)
+        {
+            Handle handle = this->addMesh(this->elements[16].instantiate());
+            this->meshNames["light" + to_string(i)] = handle;
+            Mesh* marker = this->meshes.get(handle);
+            marker->setPosition(this->lightPositions[i]);
+            marker->setLit(false);
+        }
+
+        unsigned long long keyAllocations = allocations.getCount() - keyStart;
+        cout << "Model::import: " << allocations.getCount() - start << " heap allocations (ASSIMP " << assimpAllocations << ", prototypes and materials "
+            << meshAllocations << ", keyboard and registry " << keyAllocations << "); geometry arenas: " << this->vertexArena.getBlockCount() + this->indexArena.getBlockCount()
+            << " blocks, " << this->vertexArena.getBytes() + this->indexArena.getBytes() << " bytes\n";
+        cout << "Model::import: CPU geometry " << this->keptBytes << " bytes kept, " << this->releasedBytes << " bytes released after the upload\n";
+
+        this->arenaSlackBytes = this->vertexArena.getBytes() + this->indexArena.getBytes() - this->keptBytes;
+        MemoryAccounting::instance().add(ARENA_ASSET, MEMORY_CPU_GEOMETRY, this->arenaSlackBytes);
          
     }
 
@@ -505,15 +787,13 @@ private:
     // Proccess the ASSIMP nodes within the .obj file recursively
     void processNode(aiNode* node, const aiScene* scene)
     {
-        cout << "Model::processNode()\n";
-
         // Process each mesh located in the current node
         for (GLuint i = 0; i < node->mNumMeshes; i++)
         {
             aiMesh* mesh = scene->mMeshes[node->mMeshes[i]];
 
             // save the proccessed meshes into the prototype <elements> vector
-            this->elements.push_back(this->processMesh(mesh, scene));
+            this->elements.push_back(this->processMesh(mesh, scene, node->mMeshes[i]));
         }
 
         // proccess the children nodes (if there are any)
@@ -524,157 +804,117 @@ private:
     }
 
     // retrieve information about the vertices, indices and textures of the loaded mesh
-    Mesh processMesh(aiMesh* mesh, const aiScene* scene)
+    // (one pass over ASSIMP's arrays writes the geometry into the mapped GPU buffers and, for MESH_KEEP, the CPU copy in the arenas;
+    // meshIndex: the mesh's index in the scene, for paging the geometry back in)
+    Mesh processMesh(aiMesh* mesh, const aiScene* scene, GLuint meshIndex)
     {
-        cout << "Model::processMesh()\n";
+        MeshShape* shape = this->shapeArena.allocate(1);
+        shape->vertexCount = mesh->mNumVertices;
+        shape->indexCount = GLuint(MeshUpload::countIndices(mesh));
+        shape->residency = this->importResidency;
+        shape->source = this->file;
+        shape->sourceMesh = meshIndex;
 
-        vector<Vertex> vertices;
-        vector<GLuint> indices;
-        vector<Texture> textures;
+        Vertex* vertices = NULL;
+        GLuint* indices = NULL;
+        size_t bytes = shape->vertexCount * sizeof(Vertex) + shape->indexCount * sizeof(GLuint);
+        if (shape->residency == MESH_KEEP)
+        {
+            vertices = this->vertexArena.allocate(shape->vertexCount);
+            indices = this->indexArena.allocate(shape->indexCount);
+            this->keptBytes += bytes;
+            this->assetGeometryBytes[this->file] += bytes;
+            MemoryAccounting::instance().add(this->file, MEMORY_CPU_GEOMETRY, bytes);
+        }
+        else
+        {
+            this->releasedBytes += bytes;
+        }
+        shape->vertices = vertices;
+        shape->indices = indices;
 
         cout << "Mesh vertices number: " << mesh->mNumVertices << endl;
         cout << "Mesh has normals?: " << mesh->HasNormals() << endl;
 
-        // process the vertices in a mesh
-        for (GLuint i = 0; i < mesh->mNumVertices; i++)
         {
-            Vertex vertex;
-            glm::vec3 vector; // placeholder vector for ASSIMP::vec3 -> glm::vec3 type conversion
+            TraceScope upload(STAGE_GL_UPLOAD, this->file);
+            shape->geometry = MeshUpload::upload(mesh, vertices, indices, shape->boundsMin, shape->boundsMax);
+        }
+        MemoryAccounting::instance().add(this->file, MEMORY_GL_BUFFERS,
+            size_t(shape->vertexCount) * GeometryPool::instance().getVertexStride() + shape->indexCount * sizeof(GLuint));
 
-            // positions
-            vector.x = mesh->mVertices[i].x;
-            vector.y = mesh->mVertices[i].y;
-            vector.z = mesh->mVertices[i].z;
-            vertex.Position = vector;
+        // Process materials (textures)
+        if (mesh->mMaterialIndex >= 0)
+        {
+            shape->textures = this->loadMaterial(scene->mMaterials[mesh->mMaterialIndex], mesh->mMaterialIndex);
+        }
 
-            // normals
-            if (mesh->HasNormals()) {
-                vector.x = mesh->mNormals[i].x;
-                vector.y = mesh->mNormals[i].y;
-                vector.z = mesh->mNormals[i].z;
-                vertex.Normal = vector;
-            }
+        // Return a mesh constructor using the retrieved data
+        return Mesh(shape);
+    }
 
-            // texture coordinates
-            if (mesh->mTextureCoords[0]) // check if mesh has any texCoords
-            {
-                glm::vec2 vec;
-                vec.x = mesh->mTextureCoords[0][i].x;
-                vec.y = mesh->mTextureCoords[0][i].y;
-                vertex.TexCoords = vec;
-            }
-            else
-            {
-                vertex.TexCoords = glm::vec2(0.0f, 0.0f);
-            }
 
-            // save the proccessed vertex
-            vertices.push_back(vertex);
+
+    // returns the textures of a material, shared through the TextureCache
+    // (a material is identified by its file and index, so other Model instances loading the same file reuse it)
+    vector<Texture> loadMaterial(aiMaterial* material, GLuint materialIndex)
+    {
+        vector<Texture> textures;
+        string materialKey = TextureCache::pathKey(TextureCache::normalizePath("", this->file)) + "#" + to_string(materialIndex);
+
+        // only the first mesh using the material takes a reference for this model
+        bool referenced = false;
+        for (GLuint i = 0; i < this->materialKeys.size() && !referenced; i++)
+        {
+            referenced = this->materialKeys[i] == materialKey;
         }
 
-        // process the indices of each face (triangle)
-        for (GLuint i = 0; i < mesh->mNumFaces; i++)
+        if (TextureCache::instance().acquireMaterial(materialKey, textures))
         {
-            aiFace face = mesh->mFaces[i];
-            for (GLuint j = 0; j < face.mNumIndices; j++)
+            if (referenced)
+            {
+                TextureCache::instance().releaseMaterial(materialKey);
+            }
+            else
             {
-                indices.push_back(face.mIndices[j]);
+                this->materialKeys.push_back(materialKey);
             }
+            return textures;
         }
 
-        // Process materials (textures)
-        if (mesh->mMaterialIndex >= 0)
-        {
-            aiMaterial* material = scene->mMaterials[mesh->mMaterialIndex];
-            // Diffuse maps
-            vector<Texture> diffuseMaps = this->loadMaterialTextures(material, aiTextureType_DIFFUSE, "texture_diffuse");
-            textures.insert(textures.end(), diffuseMaps.begin(), diffuseMaps.end());
-
-            // Specular maps
-            vector<Texture> specularMaps = this->loadMaterialTextures(material, aiTextureType_SPECULAR, "texture_specular");
-            textures.insert(textures.end(), specularMaps.begin(), specularMaps.end());
+        // Diffuse maps
+        vector<Texture> diffuseMaps = this->loadMaterialTextures(material, aiTextureType_DIFFUSE, "texture_diffuse");
+        textures.insert(textures.end(), diffuseMaps.begin(), diffuseMaps.end());
 
-            /* maybe later?
-            // Normal maps?
-            vector<Texture> normalMaps = this->loadMaterialTextures(material, aiTextureType_HEIGHT, "texture_normal");
-            textures.insert(textures.end(), specularMaps.begin(), specularMaps.end());
-            */
-        }
+        // Specular maps
+        vector<Texture> specularMaps = this->loadMaterialTextures(material, aiTextureType_SPECULAR, "texture_specular");
+        textures.insert(textures.end(), specularMaps.begin(), specularMaps.end());
 
-        // Return a mesh constructor using the retrieved data
-        return Mesh(vertices, indices, textures);
-    }
+        /* maybe later?
+        // Normal maps?
+        vector<Texture> normalMaps = this->loadMaterialTextures(material, aiTextureType_HEIGHT, "texture_normal");
+        textures.insert(textures.end(), specularMaps.begin(), specularMaps.end());
+        */
 
+        TextureCache::instance().storeMaterial(materialKey, textures);
+        this->materialKeys.push_back(materialKey);
 
+        return textures;
+    }
 
-    // loads the textures that have not yet been loaded into a <textures> vector
+    // acquires each texture of a particular type (diffuse, specular, normal) from the shared TextureCache
     vector<Texture> loadMaterialTextures(aiMaterial* mat, aiTextureType type, string texType)
     {
         vector<Texture> textures;
 
-        // for each texture of a particular type (diffuse, specular, normal):
         for (GLuint i = 0; i < mat->GetTextureCount(type); i++)
         {
             aiString path;
             mat->GetTexture(type, i, &path); // gets the texture path
 
-            // Check if texture was loaded before and if so, continue to next iteration: skip loading a new texture
-            GLboolean loaded = false;
-
-            for (GLuint j = 0; j < textures_loaded.size(); j++)
-            {
-                //cout << textures_loaded[j].path.C_Str() << " == " << path.C_Str() << endl;
-                if (textures_loaded[j].path == path)
-                {
-                    textures.push_back(textures_loaded[j]);
-                    loaded = true; // A texture with the same filepath has already been loaded, continue to next one. (optimization)
-
-                    break;
-                }
-            }
-
-            if (!loaded)
-            {   // If texture hasn't been loaded yet, load it
-                Texture texture;
-                texture.id = TextureFromFile(path.C_Str(), this->directory);
-                texture.type = texType;
-                texture.path = path;
-
-                textures.push_back(texture);
-                this->textures_loaded.push_back(texture); 
-            }
+            textures.push_back(TextureCache::instance().acquireTexture(this->directory, path, texType));
         }
 
         return textures;
     }
 };
-
-GLint TextureFromFile(const char* path, string directory)
-{
-    //Generate texture ID and load texture data
-    string filename = string(path);
-    filename = directory + '/' + filename;
-    GLuint textureID;
-    glGenTextures(1, &textureID);
-
-    int width, height;
-
-    unsigned char* image = SOIL_load_image(filename.c_str(), &width, &height, 0, SOIL_LOAD_RGB);
-
-    // Assign texture to texturing unit (by texID)
-    glBindTexture(GL_TEXTURE_2D, textureID);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, image);
-    glGenerateMipmap(GL_TEXTURE_2D);
-
-    // Parameters
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-   
-    //reset
-    glBindTexture(GL_TEXTURE_2D, 0);
-    SOIL_free_image_data(image);
-
-    return textureID;
-}
\ No newline at end of file
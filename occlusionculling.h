@@ -0,0 +1,241 @@
+#pragma once
+
+#include <iostream>
+#include <vector>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/type_ptr.hpp>
+
+#include "shaderprogram.h"
+#include "glstate.h"
+#include "uniformbuffers.h"
+#include "memoryaccounting.h"
+
+using namespace std;
+
+
+const int MAX_CULL_GROUPS = 15;     // groups 0..14 (the group takes 4 bits of the render queue keys)
+const GLfloat OCCLUSION_CAMERA_MARGIN = 0.5f;  // a box this close to the camera may be cut by the near plane
+
+// world-space box enclosing everything a cull group can cover (in any animation pose)
+struct OcclusionBox
+{
+    glm::vec3 min;
+    glm::vec3 max;
+};
+
+struct OcclusionStats
+{
+    int groups;
+    int culled;     // groups whose last finished query found no visible samples
+};
+
+
+// Occlusion culling of draw groups with hardware queries and conditional rendering.
+// After the occluders (everything outside the groups) are drawn, each group's box is drawn into a
+// GL_ANY_SAMPLES_PASSED query with color and depth writes off, and the group is drawn inside
+// glBeginConditionalRender on that query. The test is against the same frame's depth buffer, so it is
+// conservative for moving occluders (the lid) as long as the boxes cover the groups' whole range of motion.
+// The CPU never reads the results (except for the statistics, when they are ready).
+class OcclusionCuller
+{
+
+private:
+
+    ShaderProgram* boxShader;
+    GLuint boxVAO, boxVBO, boxEBO;
+
+    vector<OcclusionBox> boxes;
+    vector<GLuint> queries;
+    vector<bool> issued;    // query has a result pending or ready
+    bool enabled;
+
+    OcclusionStats stats;
+
+
+    // the unit cube drawn (scaled to each box) into the queries
+    void createBox()
+    {
+        this->boxShader = new ShaderProgram("box_vertex_shader.glsl", NULL, "box_fragment_shader.glsl");
+        this->boxShader->bindUniformBlock("FrameData", UBO_BINDING_FRAME);
+
+        GLfloat corners[8 * 3];
+        for (int i = 0; i < 8; i++)
+        {
+            corners[i * 3 + 0] = GLfloat(i & 1);
+            corners[i * 3 + 1] = GLfloat((i >> 1) & 1);
+            corners[i * 3 + 2] = GLfloat((i >> 2) & 1);
+        }
+        GLuint faces[36] = {
+            0, 2, 1, 1, 2, 3,   4, 5, 6, 5, 7, 6,   // z = 0, z = 1
+            0, 1, 4, 1, 5, 4,   2, 6, 3, 3, 6, 7,   // y = 0, y = 1
+            0, 4, 2, 2, 4, 6,   1, 3, 5, 3, 7, 5    // x = 0, x = 1
+        };
+
+        glGenVertexArrays(1, &this->boxVAO);
+        GLStateCache::instance().bindVertexArray(this->boxVAO);
+
+        glGenBuffers(1, &this->boxVBO);
+        glBindBuffer(GL_ARRAY_BUFFER, this->boxVBO);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(corners), corners, GL_STATIC_DRAW);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(GLfloat), (GLvoid*)0);
+        glEnableVertexAttribArray(0);
+
+        glGenBuffers(1, &this->boxEBO);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, this->boxEBO);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(faces), faces, GL_STATIC_DRAW);
+
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        MemoryAccounting::instance().set("occlusion test box", MEMORY_GL_BUFFERS, sizeof(corners) + sizeof(faces));
+    }
+
+    static bool contains(const OcclusionBox& box, const glm::vec3& point, GLfloat margin)
+    {
+        return glm::all(glm::greaterThanEqual(point, box.min - margin)) && glm::all(glm::lessThanEqual(point, box.max + margin));
+    }
+
+
+public:
+
+    OcclusionCuller()
+    {
+        this->boxShader = NULL;
+        this->boxVAO = this->boxVBO = this->boxEBO = 0;
+        this->enabled = true;
+        this->stats = OcclusionStats();
+    }
+
+    ~OcclusionCuller()
+    {
+        if (!this->queries.empty())
+        {
+            glDeleteQueries(GLsizei(this->queries.size()), this->queries.data());
+        }
+        if (this->boxShader != NULL)
+        {
+            delete this->boxShader;
+            GLStateCache::instance().forgetVertexArray(this->boxVAO);
+            glDeleteVertexArrays(1, &this->boxVAO);
+            glDeleteBuffers(1, &this->boxVBO);
+            glDeleteBuffers(1, &this->boxEBO);
+            MemoryAccounting::instance().set("occlusion test box", MEMORY_GL_BUFFERS, 0);
+        }
+    }
+
+    OcclusionCuller(const OcclusionCuller&) = delete;
+    OcclusionCuller& operator=(const OcclusionCuller&) = delete;
+
+    // the groups' boxes (group i is tested with boxes[i])
+    void setBoxes(const vector<OcclusionBox>& boxes)
+    {
+        if (!this->queries.empty())
+        {
+            glDeleteQueries(GLsizei(this->queries.size()), this->queries.data());
+        }
+        this->boxes = boxes;
+        this->boxes.resize(min(int(boxes.size()), MAX_CULL_GROUPS));
+        this->queries.resize(this->boxes.size());
+        this->issued.assign(this->boxes.size(), false);
+        if (!this->queries.empty())
+        {
+            glGenQueries(GLsizei(this->queries.size()), this->queries.data());
+        }
+        this->stats.groups = int(this->boxes.size());
+    }
+
+    void setEnabled(bool enabled)
+    {
+        this->enabled = enabled;
+    }
+
+    bool isEnabled()
+    {
+        return this->enabled;
+    }
+
+    // pick up the results of the previous frame's queries that are ready (statistics only, never waits)
+    void beginFrame()
+    {
+        int culled = 0;
+        for (GLuint i = 0; i < this->queries.size(); i++)
+        {
+            if (!this->issued[i])
+            {
+                continue;
+            }
+            GLuint available = GL_FALSE;
+            glGetQueryObjectuiv(this->queries[i], GL_QUERY_RESULT_AVAILABLE, &available);
+            if (!available)
+            {
+                return;     // keep the last complete count
+            }
+            GLuint visible = GL_TRUE;
+            glGetQueryObjectuiv(this->queries[i], GL_QUERY_RESULT, &visible);
+            culled += visible ? 0 : 1;
+        }
+        this->stats.culled = culled;
+    }
+
+    // draw the group's box into its query (after the occluders; color writes as in the current pass)
+    void query(int group, bool colorWrites)
+    {
+        if (!this->enabled || group < 0 || group >= int(this->boxes.size()))
+        {
+            return;
+        }
+        if (this->boxShader == NULL)
+        {
+            this->createBox();
+        }
+
+        glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+        glDepthMask(GL_FALSE);
+
+        GLStateCache& state = GLStateCache::instance();
+        this->boxShader->use();
+        state.uniform4fv(this->boxShader->u("boxMin"), glm::value_ptr(glm::vec4(this->boxes[group].min, 1.0f)));
+        state.uniform4fv(this->boxShader->u("boxMax"), glm::value_ptr(glm::vec4(this->boxes[group].max, 1.0f)));
+        state.bindVertexArray(this->boxVAO);
+
+        glBeginQuery(GL_ANY_SAMPLES_PASSED, this->queries[group]);
+        glDrawElements(GL_TRIANGLES, 36, GL_UNSIGNED_INT, 0);
+        glEndQuery(GL_ANY_SAMPLES_PASSED);
+        this->issued[group] = true;
+
+        GLboolean color = colorWrites ? GL_TRUE : GL_FALSE;
+        glColorMask(color, color, color, color);
+        glDepthMask(GL_TRUE);
+    }
+
+    // start drawing a group: true if it is drawn conditionally (end() must follow)
+    // (a camera inside or right next to the box would have its faces clipped away by the near plane, so it is drawn as is)
+    bool begin(int group, const glm::vec3& cameraPosition)
+    {
+        if (!this->enabled || group < 0 || group >= int(this->boxes.size()) || !this->issued[group])
+        {
+            return false;
+        }
+        if (contains(this->boxes[group], cameraPosition, OCCLUSION_CAMERA_MARGIN))
+        {
+            return false;
+        }
+        glBeginConditionalRender(this->queries[group], GL_QUERY_WAIT);
+        return true;
+    }
+
+    void end()
+    {
+        glEndConditionalRender();
+    }
+
+    const OcclusionStats& getStats()
+    {
+        return this->stats;
+    }
+
+    void printStats()
+    {
+        cout << "OcclusionCuller: " << (this->enabled ? "on" : "off") << ", " << this->stats.culled << " of " << this->stats.groups << " groups culled\n";
+    }
+};
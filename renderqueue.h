@@ -0,0 +1,641 @@
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/type_ptr.hpp>
+
+#include "shaderprogram.h"
+#include "texturearray.h"
+#include "glstate.h"
+#include "streambuffer.h"
+#include "geometrypool.h"
+#include "occlusionculling.h"
+#include "memoryaccounting.h"
+
+using namespace std;
+
+
+// buffer texture with the per-draw records (sampled by the INSTANCED shader variants)
+const GLuint TEXTURE_UNIT_DRAW_DATA = 5;
+const int DRAW_DATA_TEXELS = 5;     // RGBA32F per draw: model matrix columns, (diffuse layer, specular layer, key, key part)
+
+
+// everything needed to issue one draw call, recorded by Mesh::Submit
+struct DrawPacket
+{
+    uint64_t key;
+    uint64_t depthKey;          // order of the depth prepass
+    ShaderProgram* shader;
+    ShaderProgram* depthShader; // DEPTH_ONLY variant (depth prepass, overdraw view)
+    GLuint VAO;
+    GeometryRange geometry;
+    TextureBinding diffuse;
+    TextureBinding specular;
+    glm::mat4 M;
+    GLint keyIndex, keyPart;    // for meshes animated on the GPU (-1 otherwise)
+    GLint cullGroup;            // occlusion culling group (-1: always drawn, an occluder)
+    GLuint instanceCount;       // copies drawn by the one call (PIANO_INSTANCES programs place each copy themselves)
+};
+
+// work done by the last execute() (the state changes it caused are counted by the GLStateCache)
+struct RenderQueueStats
+{
+    int draws;
+    int instances;  // copies drawn by the instanced draws (= draws without them)
+    int calls;      // GL draw calls issued for them (both passes)
+    GLuint fragmentsShaded;     // samples that passed the depth test in the shading pass (last finished queries)
+    int recordsUploaded;        // draw records that changed since the last frame
+    GLsizeiptr bytesUploaded;   // draw records and indirect commands sent to the GPU by the frame
+};
+
+// layout of a GL_DRAW_INDIRECT_BUFFER command for glMultiDrawElementsIndirect
+struct DrawElementsIndirectCommand
+{
+    GLuint count;
+    GLuint instanceCount;
+    GLuint firstIndex;
+    GLint baseVertex;
+    GLuint baseInstance;
+};
+
+
+// Collects the frame's draw packets, sorts them by a 64-bit key and issues them in that order,
+// so consecutive draws share their program, texture arrays and VAO wherever possible.
+// The model matrices and texture layers live in a persistent buffer of draw records, one per packet in submission
+// order (which stays the same from frame to frame); only the records that differ from the last frame's are uploaded,
+// so a still scene - and keys posed on the GPU, whose matrices never change - sends none. INSTANCED programs
+// fetch their record by draw index. With ARB_multi_draw_indirect each run of draws sharing program,
+// texture arrays and VAO becomes a single glMultiDrawElementsIndirect call whose commands carry the draw
+// index as baseInstance; otherwise every draw is a glDrawElementsBaseVertex with the index in instanceBase.
+// The indirect commands are streamed again only when they differ from the last frame's (the sort order changed).
+// (the VAO is left bound after execute(); code that binds GL_ELEMENT_ARRAY_BUFFER must bind VAO 0 first)
+//
+// With the depth prepass on, every packet is first drawn depth-only in coarse front-to-back order, then shaded
+// with GL_EQUAL, so each pixel runs the expensive fragment shader once. The overdraw view draws the shading pass
+// with the flat DEPTH_ONLY programs and additive blending: brighter pixels were shaded more times.
+//
+// Packets in a cull group are drawn after all the others and only if their group's box passes an occlusion
+// query against the depth laid down so far (see occlusionculling.h); with the depth prepass the queries are
+// issued in the prepass and the shading pass reuses them.
+//
+// key layout (most significant first):
+//   [63..60] cull group + 1   [59..52] program   [51..40] texture arrays (diffuse, specular)   [39..24] VAO   [23..0] view depth (front to back)
+// depth key:
+//   [63..60] cull group + 1   [59..56] coarse view depth   [55..48] depth-only program   [47..32] VAO   [23..0] view depth
+class RenderQueue
+{
+
+private:
+
+    vector<DrawPacket> packets;
+    vector<uint32_t> order;     // packet indices, sorted by key
+    vector<uint32_t> depthOrder;    // packet indices, sorted by depth key
+    vector<uint32_t> scratch;   // radix sort ping-pong buffer
+
+    glm::mat4 V;
+    GLfloat farPlane;
+
+    GLuint recordBuffer, recordTexture;     // draw records (DRAW_DATA_TEXELS texels per packet, by submission order)
+    GLsizeiptr recordCapacity;              // bytes
+    vector<glm::vec4> records;              // what the record buffer holds
+    StreamBuffer commands;      // indirect draw commands (used as GL_DRAW_INDIRECT_BUFFER)
+    vector<DrawElementsIndirectCommand> lastCommands;  // what the current command segment holds
+
+    bool depthPrepass;
+    bool overdrawView;
+    GLuint samplesQueries[2];   // the shading pass is counted in two parts when occlusion queries are issued in the middle of it
+    int pendingQueries;
+    OcclusionCuller culler;
+    glm::vec3 cameraPosition;
+
+    RenderQueueStats stats;
+
+
+    // LSD radix sort of the packet indices (by key or depth key), 8 bits per pass; passes where every key has the same digit are skipped
+    void sortPackets(vector<uint32_t>& order, uint64_t DrawPacket::* key)
+    {
+        GLuint count = GLuint(this->packets.size());
+        order.resize(count);
+        this->scratch.resize(count);
+        for (GLuint i = 0; i < count; i++)
+        {
+            order[i] = i;
+        }
+
+        for (int shift = 0; shift < 64; shift += 8)
+        {
+            GLuint histogram[256] = { 0 };
+            for (GLuint i = 0; i < count; i++)
+            {
+                histogram[(this->packets[i].*key >> shift) & 0xFF]++;
+            }
+            if (count == 0 || histogram[(this->packets[0].*key >> shift) & 0xFF] == count)
+            {
+                continue;
+            }
+
+            GLuint offset = 0;
+            for (int digit = 0; digit < 256; digit++)
+            {
+                GLuint digitCount = histogram[digit];
+                histogram[digit] = offset;
+                offset += digitCount;
+            }
+
+            for (GLuint i = 0; i < count; i++)
+            {
+                uint32_t packet = order[i];
+                this->scratch[histogram[(this->packets[packet].*key >> shift) & 0xFF]++] = packet;
+            }
+            order.swap(this->scratch);
+        }
+    }
+
+    // true if consecutive sorted packets can go into one multi-draw
+    static bool sameBatch(const DrawPacket& a, const DrawPacket& b, bool depthOnly)
+    {
+        if (depthOnly)
+        {
+            return a.depthShader == b.depthShader && a.VAO == b.VAO;
+        }
+        return a.shader == b.shader && a.VAO == b.VAO
+            && a.diffuse.array == b.diffuse.array && a.specular.array == b.specular.array;
+    }
+
+    // issue the packets sequence[first..last); depthOnly: with their DEPTH_ONLY programs and no textures
+    // (commandBase: where the indirect commands of this sequence start)
+    void drawPass(const vector<uint32_t>& sequence, GLuint first, GLuint last, bool depthOnly, bool multiDraw, GLuint commandBase)
+    {
+        GLStateCache& state = GLStateCache::instance();
+        ShaderProgram* shader = NULL;
+        GLint locationM = -1, locationInstanceBase = -1, locationDiffuseLayer = -1, locationSpecularLayer = -1;
+
+        GLuint count = last;
+        GLuint i = first;
+        while (i < count)
+        {
+            const DrawPacket& packet = this->packets[sequence[i]];
+            ShaderProgram* packetShader = depthOnly ? packet.depthShader : packet.shader;
+
+            if (packetShader != shader)
+            {
+                shader = packetShader;
+                shader->use();
+                locationM = shader->u("M");
+                locationInstanceBase = shader->u("instanceBase");
+                locationDiffuseLayer = shader->u("diffuseLayer");
+                locationSpecularLayer = shader->u("specularLayer");
+            }
+
+            if (!depthOnly)
+            {
+                state.bindTexture(TEXTURE_UNIT_DIFFUSE, GL_TEXTURE_2D_ARRAY, packet.diffuse.array);
+                state.bindTexture(TEXTURE_UNIT_SPECULAR, GL_TEXTURE_2D_ARRAY, packet.specular.array);
+            }
+            state.bindVertexArray(packet.VAO);
+
+            // the whole run of draws sharing this state in one call
+            if (multiDraw && locationInstanceBase >= 0)
+            {
+                GLuint end = i + 1;
+                while (end < count && sameBatch(packet, this->packets[sequence[end]], depthOnly))
+                {
+                    end++;
+                }
+                state.uniform1i(locationInstanceBase, 0);
+                glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (GLvoid*)((commandBase + i) * sizeof(DrawElementsIndirectCommand)), GLsizei(end - i), 0);
+                this->stats.calls++;
+                i = end;
+                continue;
+            }
+
+            if (locationInstanceBase >= 0)
+            {
+                state.uniform1i(locationInstanceBase, GLint(sequence[i]));
+            }
+            else
+            {
+                state.uniformMatrix4fv(locationM, glm::value_ptr(packet.M));
+                state.uniform1i(locationDiffuseLayer, packet.diffuse.layer);
+                state.uniform1i(locationSpecularLayer, packet.specular.layer);
+            }
+            glDrawElementsInstancedBaseVertex(GL_TRIANGLES, packet.geometry.indexCount, GL_UNSIGNED_INT,
+                (GLvoid*)(packet.geometry.firstIndex * sizeof(GLuint)), GLsizei(packet.instanceCount), packet.geometry.baseVertex);
+            this->stats.calls++;
+            i++;
+        }
+    }
+
+    // issue a whole sorted sequence: the occluders, then each cull group inside conditional rendering
+    // (queryGroups: draw the groups' boxes into their queries first; colorWrites: the color mask of this pass;
+    // countSamples: the shading pass's samples query is active and has to be split around the occlusion queries)
+    void drawSequence(const vector<uint32_t>& sequence, bool depthOnly, bool multiDraw, GLuint commandBase, bool queryGroups, bool colorWrites, bool countSamples)
+    {
+        GLuint count = GLuint(sequence.size());
+        GLuint occluders = 0;
+        while (occluders < count && this->packets[sequence[occluders]].cullGroup < 0)
+        {
+            occluders++;
+        }
+        this->drawPass(sequence, 0, occluders, depthOnly, multiDraw, commandBase);
+
+        if (queryGroups && occluders < count && this->culler.isEnabled())
+        {
+            if (countSamples)
+            {
+                glEndQuery(GL_SAMPLES_PASSED);
+            }
+            for (GLuint i = occluders; i < count; i++)
+            {
+                if (i == occluders || this->packets[sequence[i]].cullGroup != this->packets[sequence[i - 1]].cullGroup)
+                {
+                    this->culler.query(this->packets[sequence[i]].cullGroup, colorWrites);
+                }
+            }
+            if (countSamples)
+            {
+                glBeginQuery(GL_SAMPLES_PASSED, this->samplesQueries[1]);
+                this->pendingQueries = 2;
+            }
+        }
+
+        GLuint first = occluders;
+        while (first < count)
+        {
+            GLint group = this->packets[sequence[first]].cullGroup;
+            GLuint last = first + 1;
+            while (last < count && this->packets[sequence[last]].cullGroup == group)
+            {
+                last++;
+            }
+            bool conditional = this->culler.begin(group, this->cameraPosition);
+            this->drawPass(sequence, first, last, depthOnly, multiDraw, commandBase);
+            if (conditional)
+            {
+                this->culler.end();
+            }
+            first = last;
+        }
+    }
+
+    // one indirect command per packet of <sequence>, pointing at its draw record through baseInstance
+    void writeCommands(DrawElementsIndirectCommand* command, const vector<uint32_t>& sequence)
+    {
+        for (GLuint i = 0; i < sequence.size(); i++)
+        {
+            const GeometryRange& geometry = this->packets[sequence[i]].geometry;
+            command[i].count = GLuint(geometry.indexCount);
+            command[i].instanceCount = this->packets[sequence[i]].instanceCount;
+            command[i].firstIndex = geometry.firstIndex;
+            command[i].baseVertex = geometry.baseVertex;
+            command[i].baseInstance = sequence[i];
+        }
+    }
+
+    // the packets' draw records in the record buffer: only the runs of records that changed are uploaded
+    // (a larger frame reallocates the buffer and uploads all of them)
+    void updateRecords()
+    {
+        GLuint count = GLuint(this->packets.size());
+        vector<glm::vec4> frame(size_t(count) * DRAW_DATA_TEXELS);
+        for (GLuint i = 0; i < count; i++)
+        {
+            const DrawPacket& packet = this->packets[i];
+            for (int column = 0; column < 4; column++)
+            {
+                frame[i * DRAW_DATA_TEXELS + column] = packet.M[column];
+            }
+            frame[i * DRAW_DATA_TEXELS + 4] = glm::vec4(GLfloat(packet.diffuse.layer), GLfloat(packet.specular.layer),
+                GLfloat(packet.keyIndex), GLfloat(packet.keyPart));
+        }
+
+        const GLsizeiptr recordBytes = DRAW_DATA_TEXELS * sizeof(glm::vec4);
+        if (this->recordBuffer == 0)
+        {
+            glGenBuffers(1, &this->recordBuffer);
+            glGenTextures(1, &this->recordTexture);
+        }
+        glBindBuffer(GL_TEXTURE_BUFFER, this->recordBuffer);
+
+        if (GLsizeiptr(count) * recordBytes > this->recordCapacity)
+        {
+            this->recordCapacity = max(GLsizeiptr(count) * recordBytes, this->recordCapacity * 2);
+            glBufferData(GL_TEXTURE_BUFFER, this->recordCapacity, NULL, GL_DYNAMIC_DRAW);
+            GLStateCache::instance().editTexture(GL_TEXTURE_BUFFER, this->recordTexture);
+            glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, this->recordBuffer);
+            MemoryAccounting::instance().set("render queue: draw records", MEMORY_GL_BUFFERS, size_t(this->recordCapacity));
+            this->records.clear();
+        }
+
+        // record i is unchanged if the buffer holds it already with the same contents
+        GLuint held = GLuint(this->records.size() / DRAW_DATA_TEXELS);
+        auto unchanged = [&](GLuint i)
+        {
+            return i < held && memcmp(&frame[i * DRAW_DATA_TEXELS], &this->records[i * DRAW_DATA_TEXELS], size_t(recordBytes)) == 0;
+        };
+
+        GLuint i = 0;
+        while (i < count)
+        {
+            if (unchanged(i))
+            {
+                i++;
+                continue;
+            }
+            GLuint end = i + 1;
+            while (end < count && !unchanged(end))
+            {
+                end++;
+            }
+            glBufferSubData(GL_TEXTURE_BUFFER, i * recordBytes, (end - i) * recordBytes, &frame[i * DRAW_DATA_TEXELS]);
+            this->stats.recordsUploaded += end - i;
+            this->stats.bytesUploaded += (end - i) * recordBytes;
+            i = end;
+        }
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+        this->records.swap(frame);
+    }
+
+    // the indirect commands of the shading pass, followed by those of the depth prepass
+    // (the segment streamed last is drawn from again while they stay the same)
+    void updateCommands()
+    {
+        GLuint count = GLuint(this->packets.size());
+        vector<DrawElementsIndirectCommand> frame((this->depthPrepass ? 2 : 1) * size_t(count));
+        this->writeCommands(frame.data(), this->order);
+        if (this->depthPrepass)
+        {
+            this->writeCommands(frame.data() + count, this->depthOrder);
+        }
+
+        if (this->commands.buffer() == 0 || frame.size() != this->lastCommands.size()
+            || memcmp(frame.data(), this->lastCommands.data(), frame.size() * sizeof(DrawElementsIndirectCommand)) != 0)
+        {
+            GLsizeiptr size = GLsizeiptr(frame.size() * sizeof(DrawElementsIndirectCommand));
+            memcpy(this->commands.begin(size), frame.data(), size_t(size));
+            this->commands.end();
+            this->stats.bytesUploaded += size;
+            this->lastCommands.swap(frame);
+        }
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, this->commands.buffer());
+    }
+
+
+public:
+
+    RenderQueue() : commands("render queue: draw commands", GL_R32UI)
+    {
+        this->recordBuffer = 0;
+        this->recordTexture = 0;
+        this->recordCapacity = 0;
+        this->V = glm::mat4(1.0f);
+        this->farPlane = 100.0f;
+        this->depthPrepass = false;
+        this->overdrawView = false;
+        this->samplesQueries[0] = this->samplesQueries[1] = 0;
+        this->pendingQueries = 0;
+        this->cameraPosition = glm::vec3(0.0f);
+        this->stats = RenderQueueStats();
+    }
+
+    ~RenderQueue()
+    {
+        if (this->samplesQueries[0] != 0)
+        {
+            glDeleteQueries(2, this->samplesQueries);
+        }
+        if (this->recordBuffer != 0)
+        {
+            GLStateCache::instance().forgetTexture(this->recordTexture);
+            glDeleteTextures(1, &this->recordTexture);
+            glDeleteBuffers(1, &this->recordBuffer);
+            MemoryAccounting::instance().set("render queue: draw records", MEMORY_GL_BUFFERS, 0);
+        }
+    }
+
+    RenderQueue(const RenderQueue&) = delete;
+    RenderQueue& operator=(const RenderQueue&) = delete;
+
+    void setDepthPrepass(bool enabled)
+    {
+        this->depthPrepass = enabled;
+    }
+
+    void setOverdrawView(bool enabled)
+    {
+        this->overdrawView = enabled;
+    }
+
+    bool getDepthPrepass()
+    {
+        return this->depthPrepass;
+    }
+
+    bool getOverdrawView()
+    {
+        return this->overdrawView;
+    }
+
+    // world-space boxes of the cull groups (see DrawPacket::cullGroup)
+    void setCullGroups(const vector<OcclusionBox>& boxes)
+    {
+        this->culler.setBoxes(boxes);
+    }
+
+    void setOcclusionCulling(bool enabled)
+    {
+        this->culler.setEnabled(enabled);
+    }
+
+    bool getOcclusionCulling()
+    {
+        return this->culler.isEnabled();
+    }
+
+    // start recording a frame seen through the view matrix V (used for the depth part of the key)
+    void begin(const glm::mat4& V, GLfloat farPlane)
+    {
+        this->packets.clear();
+        this->V = V;
+        this->farPlane = farPlane;
+        this->cameraPosition = glm::vec3(glm::inverse(V)[3]);
+    }
+
+    static uint64_t makeKey(GLint cullGroup, GLuint program, const TextureBinding& diffuse, const TextureBinding& specular, GLuint VAO, GLfloat depth)
+    {
+        uint64_t depthBits = uint64_t(glm::clamp(depth, 0.0f, 1.0f) * 0xFFFFFF);
+        return (uint64_t((cullGroup + 1) & 0xF) << 60)
+            | (uint64_t(program & 0xFF) << 52)
+            | (uint64_t(diffuse.array & 0x3F) << 46) | (uint64_t(specular.array & 0x3F) << 40)
+            | (uint64_t(VAO & 0xFFFF) << 24)
+            | depthBits;
+    }
+
+    // front to back in 16 coarse slices (of sqrt(depth), so the near range is finer), state-sorted within a slice
+    static uint64_t makeDepthKey(GLint cullGroup, GLuint program, GLuint VAO, GLfloat depth)
+    {
+        depth = glm::clamp(depth, 0.0f, 1.0f);
+        uint64_t slice = uint64_t(min(sqrt(depth) * 16.0f, 15.0f));
+        return (uint64_t((cullGroup + 1) & 0xF) << 60)
+            | (slice << 56)
+            | (uint64_t(program & 0xFF) << 48)
+            | (uint64_t(VAO & 0xFFFF) << 32)
+            | uint64_t(depth * 0xFFFFFF);
+    }
+
+    // record a draw; the sort key is built from the packet's state and the view depth of its origin
+    // (keyIndex/keyPart: which key state and part table entry a SKINNED_KEY program poses the mesh with)
+    // (depthShader: the DEPTH_ONLY program drawing the same positions; cullGroup: see setCullGroups)
+    // (instanceCount: copies of the draw, all reading the same draw record; instanced draws are never culled, the boxes are for one copy)
+    void submit(ShaderProgram* shader, ShaderProgram* depthShader, GLuint VAO, const GeometryRange& geometry, const TextureBinding& diffuse, const TextureBinding& specular, const glm::mat4& M,
+        GLint keyIndex = -1, GLint keyPart = -1, GLint cullGroup = -1, GLuint instanceCount = 1)
+    {
+        glm::vec4 viewPosition = this->V * M * glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+
+        DrawPacket packet;
+        packet.shader = shader;
+        packet.depthShader = depthShader;
+        packet.VAO = VAO;
+        packet.geometry = geometry;
+        packet.diffuse = diffuse;
+        packet.specular = specular;
+        packet.M = M;
+        packet.keyIndex = keyIndex;
+        packet.keyPart = keyPart;
+        packet.cullGroup = cullGroup < MAX_CULL_GROUPS && instanceCount == 1 ? cullGroup : -1;
+        packet.instanceCount = instanceCount;
+        packet.key = makeKey(packet.cullGroup, shader->id(), diffuse, specular, VAO, -viewPosition.z / this->farPlane);
+        packet.depthKey = makeDepthKey(packet.cullGroup, depthShader->id(), VAO, -viewPosition.z / this->farPlane);
+        this->packets.push_back(packet);
+    }
+
+    // sort and issue the recorded draws; program/texture/VAO/uniform changes go through the GLStateCache,
+    // so in sorted order most of them are elided
+    void execute()
+    {
+        GLuint fragmentsShaded = this->stats.fragmentsShaded;
+        this->stats = RenderQueueStats();
+        this->stats.fragmentsShaded = fragmentsShaded;
+        this->culler.beginFrame();
+
+        GLuint count = GLuint(this->packets.size());
+        this->sortPackets(this->order, &DrawPacket::key);
+        if (this->depthPrepass)
+        {
+            this->sortPackets(this->depthOrder, &DrawPacket::depthKey);
+        }
+
+        GeometryPool::instance().reserveDraws(count);
+        bool multiDraw = GLEW_ARB_multi_draw_indirect && GLEW_ARB_base_instance;
+
+        this->updateRecords();
+        if (multiDraw)
+        {
+            this->updateCommands();
+        }
+
+        GLStateCache::instance().bindTexture(TEXTURE_UNIT_DRAW_DATA, GL_TEXTURE_BUFFER, this->recordTexture);
+
+        // depth prepass: lay down the nearest depth, then shade only the fragments that match it
+        if (this->depthPrepass)
+        {
+            glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+            this->drawSequence(this->depthOrder, true, multiDraw, count, true, false, false);
+            glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+            glDepthFunc(GL_EQUAL);
+            glDepthMask(GL_FALSE);
+        }
+
+        if (this->overdrawView)
+        {
+            glEnable(GL_BLEND);
+            glBlendFunc(GL_ONE, GL_ONE);
+        }
+
+        // count the shaded samples (the result is read a few frames later, when it is ready)
+        if (this->samplesQueries[0] == 0)
+        {
+            glGenQueries(2, this->samplesQueries);
+        }
+        if (this->pendingQueries > 0)
+        {
+            GLuint available = GL_FALSE;
+            glGetQueryObjectuiv(this->samplesQueries[this->pendingQueries - 1], GL_QUERY_RESULT_AVAILABLE, &available);
+            if (available)
+            {
+                GLuint samples = 0;
+                this->stats.fragmentsShaded = 0;
+                for (int i = 0; i < this->pendingQueries; i++)
+                {
+                    glGetQueryObjectuiv(this->samplesQueries[i], GL_QUERY_RESULT, &samples);
+                    this->stats.fragmentsShaded += samples;
+                }
+                this->pendingQueries = 0;
+            }
+        }
+        bool countSamples = this->pendingQueries == 0;
+        if (countSamples)
+        {
+            glBeginQuery(GL_SAMPLES_PASSED, this->samplesQueries[0]);
+            this->pendingQueries = 1;
+        }
+
+        // (after the prepass the groups' queries are already issued)
+        this->drawSequence(this->order, this->overdrawView, multiDraw, 0, !this->depthPrepass, true, countSamples);
+        this->stats.draws = count;
+        for (GLuint i = 0; i < count; i++)
+        {
+            this->stats.instances += this->packets[i].instanceCount;
+        }
+
+        if (countSamples)
+        {
+            glEndQuery(GL_SAMPLES_PASSED);
+        }
+
+        // back to the default state
+        if (this->overdrawView)
+        {
+            glDisable(GL_BLEND);
+        }
+        if (this->depthPrepass)
+        {
+            glDepthFunc(GL_LESS);
+            glDepthMask(GL_TRUE);
+        }
+        if (multiDraw)
+        {
+            glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+        }
+
+        // the command stream's segments are reused once the GPU has passed this point
+        this->commands.fence();
+    }
+
+    const RenderQueueStats& getStats()
+    {
+        return this->stats;
+    }
+
+    // size of the last frame's draw records
+    GLsizeiptr getDrawDataBytes()
+    {
+        return GLsizeiptr(this->records.size() * sizeof(glm::vec4));
+    }
+
+    void printStats()
+    {
+        const StreamBufferStats& stream = this->commands.getStats();
+        cout << "RenderQueue: " << this->stats.draws << " draws (" << this->stats.instances << " instances) in " << this->stats.calls << " calls"
+            << (this->depthPrepass ? " (with depth prepass)" : "") << ", " << this->stats.fragmentsShaded << " fragments shaded; uploaded this frame: "
+            << this->stats.recordsUploaded << " draw records, " << this->stats.bytesUploaded << " bytes with the indirect commands; command stream "
+            << stream.segments << " segments (" << (this->commands.isPersistent() ? "persistent" : "orphaned")
+            << "), " << stream.segmentsAdded << " added, " << stream.stalls << " stalls\n";
+        this->culler.printStats();
+    }
+};
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <functional>
+
+#include <GL/glew.h>
+
+#include "shaderprogram.h"
+
+using namespace std;
+
+
+// features a shader variant is compiled with (bitmask); each bit turns on a #define in both shader stages
+enum ShaderFeature
+{
+    SHADER_LIT = 1 << 0,            // LIT: clustered lighting (unlit variants output the diffuse color only)
+    SHADER_SPECULAR_MAP = 1 << 1,   // SPECULAR_MAP: sample texture_specular and add the specular term
+    SHADER_INSTANCED = 1 << 2,      // INSTANCED: model matrix and texture layers from the render queue's draw data instead of uniforms
+    SHADER_SKINNED_KEY = 1 << 3,    // SKINNED_KEY: key part posed on the GPU from its key's press amount (needs INSTANCED)
+    SHADER_DEPTH_ONLY = 1 << 4,     // DEPTH_ONLY: no shading, a constant color (depth prepass, overdraw view)
+    SHADER_PIANO_INSTANCES = 1 << 5,    // PIANO_INSTANCES: one copy per concert hall piano, placed and keyed by gl_InstanceID (needs INSTANCED)
+    SHADER_FEATURE_COUNT = 6
+};
+
+
+// The variants of one vertex/fragment shader pair, compiled on first use and cached by their feature bitmask.
+// setup() is called once for every new program (sampler units, uniform block bindings...).
+class ShaderPermutations
+{
+
+private:
+
+    string vertexFile;
+    string fragmentFile;
+    function<void(ShaderProgram*)> setup;
+
+    unordered_map<GLuint, ShaderProgram*> programs;
+
+
+public:
+
+    ShaderPermutations(const string& vertexFile, const string& fragmentFile, function<void(ShaderProgram*)> setup)
+    {
+        this->vertexFile = vertexFile;
+        this->fragmentFile = fragmentFile;
+        this->setup = setup;
+    }
+
+    ~ShaderPermutations()
+    {
+        for (auto it = this->programs.begin(); it != this->programs.end(); it++)
+        {
+            delete it->second;
+        }
+    }
+
+    ShaderPermutations(const ShaderPermutations&) = delete;
+    ShaderPermutations& operator=(const ShaderPermutations&) = delete;
+
+    // the #define lines of a feature bitmask
+    static string defines(GLuint features)
+    {
+        const char* names[SHADER_FEATURE_COUNT] = { "LIT", "SPECULAR_MAP", "INSTANCED", "SKINNED_KEY", "DEPTH_ONLY", "PIANO_INSTANCES" };
+        string result;
+        for (int i = 0; i < SHADER_FEATURE_COUNT; i++)
+        {
+            if (features & (1 << i))
+            {
+                result += string("#define ") + names[i] + "\n";
+            }
+        }
+        return result;
+    }
+
+    // the program for a feature bitmask (compiled now if it is the first request)
+    ShaderProgram* get(GLuint features)
+    {
+        auto found = this->programs.find(features);
+        if (found != this->programs.end())
+        {
+            return found->second;
+        }
+
+        string variantDefines = defines(features);
+        cout << "ShaderPermutations: compiling variant 0x" << hex << features << dec << " of " << this->vertexFile << " / " << this->fragmentFile << "\n";
+        ShaderProgram* program = new ShaderProgram(this->vertexFile.c_str(), NULL, this->fragmentFile.c_str(), variantDefines.c_str());
+        if (this->setup)
+        {
+            this->setup(program);
+        }
+        this->programs[features] = program;
+        return program;
+    }
+
+    int getVariantCount()
+    {
+        return int(this->programs.size());
+    }
+
+    void printStats()
+    {
+        cout << "ShaderPermutations: " << this->programs.size() << " variants compiled:";
+        for (auto it = this->programs.begin(); it != this->programs.end(); it++)
+        {
+            cout << " 0x" << hex << it->first << dec;
+        }
+        cout << endl;
+    }
+};
@@ -18,7 +18,17 @@ Place, Fifth Floor, Boston, MA  02110 - 1301  USA
 */
 
 #include "shaderprogram.h"
+#include "glstate.h"
+#include "memoryaccounting.h"
+#include "startuptrace.h"
 #include <iostream>
+#include <string>
+#include <cstring>
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
 
 
 ShaderProgram *spLambert;
@@ -59,18 +69,31 @@ char* ShaderProgram::readFile(const char* fileName) {
 
 }
 
-//Metoda wczytuje i kompiluje shader, a następnie zwraca jego uchwyt
-GLuint ShaderProgram::loadShader(GLenum shaderType,const char* fileName) {
+//Metoda wczytuje źródło shadera i wstawia do niego definicje wariantu (za linią #version, która musi pozostać pierwsza)
+std::string ShaderProgram::loadSource(const char* fileName,const char* defines) {
+	char* fileSource=readFile(fileName);
+	std::string source=fileSource!=NULL ? fileSource : "";
+	//Usuń źródło shadera z pamięci (nie będzie już potrzebne)
+	delete []fileSource;
+
+	if (defines!=NULL && defines[0]!=0) {
+		size_t versionLine=source.find("#version");
+		size_t insertAt=versionLine==std::string::npos ? 0 : source.find('\n',versionLine);
+		insertAt=insertAt==std::string::npos ? source.size() : insertAt+1;
+		source.insert(insertAt,defines);
+	}
+	return source;
+}
+
+//Metoda kompiluje shader, a następnie zwraca jego uchwyt
+GLuint ShaderProgram::loadShader(GLenum shaderType,const std::string& source) {
 	//Wygeneruj uchwyt na shader
 	GLuint shader=glCreateShader(shaderType);//shaderType to GL_VERTEX_SHADER, GL_GEOMETRY_SHADER lub GL_FRAGMENT_SHADER
-	//Wczytaj plik ze źródłem shadera do tablicy znaków
-	const GLchar* shaderSource=readFile(fileName);
+	const GLchar* shaderSource=source.c_str();
 	//Powiąż źródło z uchwytem shadera
 	glShaderSource(shader,1,&shaderSource,NULL);
 	//Skompiluj źródło
 	glCompileShader(shader);
-	//Usuń źródło shadera z pamięci (nie będzie już potrzebne)
-	delete []shaderSource;
 
 	//Pobierz log błędów kompilacji i wyświetl
 	int infologLength = 0;
@@ -90,25 +113,151 @@ GLuint ShaderProgram::loadShader(GLenum shaderType,const char* fileName) {
 	return shader;
 }
 
-ShaderProgram::ShaderProgram(const char* vertexShaderFile,const char* geometryShaderFile,const char* fragmentShaderFile) {
-	//Wczytaj vertex shader
+//Nagłówek pliku z binarną postacią programu
+struct ProgramBinaryHeader {
+	char magic[4];			//"GLPB"
+	unsigned long long key;	//skrót źródeł, definicji i sterownika (chroni przed kolizją nazw plików)
+	GLenum format;			//format binarny zwrócony przez sterownik
+	GLint length;			//długość danych, które następują po nagłówku
+};
+
+//Czy sterownik potrafi zwrócić i wczytać binarną postać programu
+static bool programBinarySupported() {
+	if (!GLEW_ARB_get_program_binary) return false;
+	GLint formats=0;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS,&formats);
+	return formats>0;
+}
+
+//Skrót FNV-1a 64 źródeł, definicji wariantu i identyfikacji sterownika (nowy sterownik unieważnia pamięć podręczną)
+unsigned long long ShaderProgram::binaryKey(const std::string& sources) {
+	std::string key=sources;
+	const GLubyte* driver[3]={ glGetString(GL_VENDOR), glGetString(GL_RENDERER), glGetString(GL_VERSION) };
+	for (int i=0;i<3;i++) {
+		key+='\n';
+		if (driver[i]!=NULL) key+=(const char*)driver[i];
+	}
+
+	unsigned long long hash=14695981039346656037ULL;
+	for (size_t i=0;i<key.size();i++) {
+		hash^=(unsigned char)key[i];
+		hash*=1099511628211ULL;
+	}
+	return hash;
+}
+
+//Ścieżka pliku z binarną postacią programu o danym skrócie (tworzy katalog pamięci podręcznej)
+static std::string binaryFileName(unsigned long long key) {
+	#ifdef _WIN32
+	_mkdir(SHADER_CACHE_DIRECTORY);
+	#else
+	mkdir(SHADER_CACHE_DIRECTORY,0755);
+	#endif
+	char name[64];
+	snprintf(name,sizeof(name),"%s/%016llx.bin",SHADER_CACHE_DIRECTORY,key);
+	return name;
+}
+
+//Próbuje wczytać program z pamięci podręcznej; false, jeśli pliku nie ma lub sterownik go odrzucił
+bool ShaderProgram::loadBinary(unsigned long long key) {
+	#pragma warning(suppress : 4996) //Wyłączenie błędu w Visual Studio wynikające z nietrzymania się standardów przez Microsoft.
+	FILE* file=fopen(binaryFileName(key).c_str(),"rb");
+	if (file==NULL) return false;
+
+	ProgramBinaryHeader header;
+	bool valid=fread(&header,sizeof(header),1,file)==1 && memcmp(header.magic,"GLPB",4)==0 && header.key==key && header.length>0;
+	char* binary=NULL;
+	if (valid) {
+		binary=new char[header.length];
+		valid=fread(binary,1,header.length,file)==size_t(header.length);
+	}
+	fclose(file);
+
+	if (valid) {
+		glProgramBinary(shaderProgram,header.format,binary,header.length);
+		GLint linked=GL_FALSE;
+		glGetProgramiv(shaderProgram,GL_LINK_STATUS,&linked);
+		valid=linked==GL_TRUE;
+	}
+	delete []binary;
+	return valid;
+}
+
+//Zapisuje zlinkowany program do pamięci podręcznej
+void ShaderProgram::saveBinary(unsigned long long key) {
+	ProgramBinaryHeader header;
+	memcpy(header.magic,"GLPB",4);
+	header.key=key;
+	header.length=0;
+	glGetProgramiv(shaderProgram,GL_PROGRAM_BINARY_LENGTH,&header.length);
+	if (header.length<=0) return;
+
+	char* binary=new char[header.length];
+	glGetProgramBinary(shaderProgram,header.length,&header.length,&header.format,binary);
+
+	#pragma warning(suppress : 4996) //Wyłączenie błędu w Visual Studio wynikające z nietrzymania się standardów przez Microsoft.
+	FILE* file=fopen(binaryFileName(key).c_str(),"wb");
+	if (file!=NULL) {
+		fwrite(&header,sizeof(header),1,file);
+		fwrite(binary,1,header.length,file);
+		fclose(file);
+	}
+	delete []binary;
+}
+
+//Zgłasza rozmiar programu do MemoryAccounting: postać binarną od sterownika, jeśli ją udostępnia, w przeciwnym razie długość źródeł (przybliżenie)
+void ShaderProgram::account(size_t sourceBytes) {
+	GLint length=0;
+	if (programBinarySupported()) glGetProgramiv(shaderProgram,GL_PROGRAM_BINARY_LENGTH,&length);
+	accountedBytes=length>0 ? size_t(length) : sourceBytes;
+	MemoryAccounting::instance().add(accountingName,MEMORY_SHADERS,accountedBytes);
+}
+
+ShaderProgram::ShaderProgram(const char* vertexShaderFile,const char* geometryShaderFile,const char* fragmentShaderFile,const char* defines) {
+	vertexShader=0;
+	geometryShader=0;
+	fragmentShader=0;
+	accountedBytes=0;
+	accountingName=std::string(vertexShaderFile)+" + "+fragmentShaderFile; //Warianty tej samej pary plików są liczone razem
+	TraceScope trace(STAGE_SHADER_COMPILE,accountingName); //Czas kompilacji (lub wczytania z pamięci podręcznej) w śladzie uruchomienia
+
+	//Wczytaj źródła (także gdy program pochodzi z pamięci podręcznej - wyznaczają jej klucz)
+	std::string vertexSource=loadSource(vertexShaderFile,defines);
+	std::string geometrySource=geometryShaderFile!=NULL ? loadSource(geometryShaderFile,defines) : "";
+	std::string fragmentSource=loadSource(fragmentShaderFile,defines);
+
+	//Wygeneruj uchwyt programu cieniującego
+	shaderProgram=glCreateProgram();
+
+	//Spróbuj wczytać gotowy program z pamięci podręcznej
+	bool useBinaryCache=programBinarySupported();
+	unsigned long long key=0;
+	if (useBinaryCache) {
+		key=binaryKey(vertexSource+'\0'+geometrySource+'\0'+fragmentSource);
+		if (loadBinary(key)) {
+			printf("Shader program loaded from the binary cache \n");
+			account(vertexSource.size()+geometrySource.size()+fragmentSource.size());
+			return;
+		}
+		//Odrzucony program nie nadaje się do ponownego linkowania - zacznij od nowego uchwytu
+		glDeleteProgram(shaderProgram);
+		shaderProgram=glCreateProgram();
+		glProgramParameteri(shaderProgram,GL_PROGRAM_BINARY_RETRIEVABLE_HINT,GL_TRUE);
+	}
+
+	//Skompiluj vertex shader
 	printf("Loading vertex shader...\n");
-	vertexShader=loadShader(GL_VERTEX_SHADER,vertexShaderFile);
+	vertexShader=loadShader(GL_VERTEX_SHADER,vertexSource);
 
-	//Wczytaj geometry shader
+	//Skompiluj geometry shader
 	if (geometryShaderFile!=NULL) {
 		printf("Loading geometry shader...\n");
-		geometryShader=loadShader(GL_GEOMETRY_SHADER,geometryShaderFile);
-	} else {
-		geometryShader=0;
+		geometryShader=loadShader(GL_GEOMETRY_SHADER,geometrySource);
 	}
 
-	//Wczytaj fragment shader
+	//Skompiluj fragment shader
 	printf("Loading fragment shader...\n");
-	fragmentShader=loadShader(GL_FRAGMENT_SHADER,fragmentShaderFile);
-
-	//Wygeneruj uchwyt programu cieniującego
-	shaderProgram=glCreateProgram();
+	fragmentShader=loadShader(GL_FRAGMENT_SHADER,fragmentSource);
 
 	//Podłącz do niego shadery i zlinkuj program
 	glAttachShader(shaderProgram,vertexShader);
@@ -131,28 +280,41 @@ ShaderProgram::ShaderProgram(const char* vertexShaderFile,const char* geometrySh
 		delete []infoLog;
 	}
 
+	//Zapisz poprawnie zlinkowany program do pamięci podręcznej
+	GLint linked=GL_FALSE;
+	glGetProgramiv(shaderProgram,GL_LINK_STATUS,&linked);
+	if (useBinaryCache && linked==GL_TRUE) saveBinary(key);
+	account(vertexSource.size()+geometrySource.size()+fragmentSource.size());
+
 	printf("Shader program created \n");
 }
 
 ShaderProgram::~ShaderProgram() {
-	//Odłącz shadery od programu
-	glDetachShader(shaderProgram, vertexShader);
+	//Odłącz shadery od programu (program wczytany z pamięci podręcznej nie ma shaderów)
+	if (vertexShader!=0) glDetachShader(shaderProgram, vertexShader);
 	if (geometryShader!=0) glDetachShader(shaderProgram, geometryShader);
-	glDetachShader(shaderProgram, fragmentShader);
+	if (fragmentShader!=0) glDetachShader(shaderProgram, fragmentShader);
 
 	//Wykasuj shadery
-	glDeleteShader(vertexShader);
+	if (vertexShader!=0) glDeleteShader(vertexShader);
 	if (geometryShader!=0) glDeleteShader(geometryShader);
-	glDeleteShader(fragmentShader);
+	if (fragmentShader!=0) glDeleteShader(fragmentShader);
 
-	//Wykasuj program
+	//Wykasuj program (i zapomnij jego stan w GLStateCache)
+	GLStateCache::instance().forgetProgram(shaderProgram);
 	glDeleteProgram(shaderProgram);
+	MemoryAccounting::instance().remove(accountingName,MEMORY_SHADERS,accountedBytes);
 }
 
 
 //Włącz używanie programu cieniującego reprezentowanego przez aktualny obiekt
 void ShaderProgram::use() {
-	glUseProgram(shaderProgram);
+	GLStateCache::instance().useProgram(shaderProgram);
+}
+
+//Zwróć uchwyt programu cieniującego
+GLuint ShaderProgram::id() {
+	return shaderProgram;
 }
 
 //Pobierz numer slotu odpowiadającego zmiennej jednorodnej o nazwie variableName
@@ -164,3 +326,9 @@ GLuint ShaderProgram::u(const char* variableName) {
 GLuint ShaderProgram::a(const char* variableName) {
 	return glGetAttribLocation(shaderProgram,variableName);
 }
+
+//Połącz blok zmiennych jednorodnych o nazwie blockName z punktem wiązania binding (pomija bloki nieużywane przez program)
+void ShaderProgram::bindUniformBlock(const char* blockName, GLuint binding) {
+	GLuint blockIndex = glGetUniformBlockIndex(shaderProgram, blockName);
+	if (blockIndex != GL_INVALID_INDEX) glUniformBlockBinding(shaderProgram, blockIndex, binding);
+}
@@ -23,8 +23,12 @@ Place, Fifth Floor, Boston, MA  02110 - 1301  USA
 
 
 #include <GL/glew.h>
+#include <string>
 #include "stdio.h"
 
+//Katalog z binarną postacią zlinkowanych programów (glGetProgramBinary), patrz ShaderProgram::loadBinary
+#define SHADER_CACHE_DIRECTORY "shadercache"
+
 
 
 class ShaderProgram {
@@ -34,13 +38,22 @@ private:
 	GLuint geometryShader; //Uchwyt reprezentujący geometry shader
 	GLuint fragmentShader; //Uchwyt reprezentujący fragment shader
 	char* readFile(const char* fileName); //metoda wczytująca plik tekstowy do tablicy znaków
-	GLuint loadShader(GLenum shaderType,const char* fileName); //Metoda wczytuje i kompiluje shader, a następnie zwraca jego uchwyt
+	std::string loadSource(const char* fileName,const char* defines); //Metoda wczytuje źródło shadera i wstawia do niego definicje wariantu
+	GLuint loadShader(GLenum shaderType,const std::string& source); //Metoda kompiluje shader, a następnie zwraca jego uchwyt
+	static unsigned long long binaryKey(const std::string& sources); //Klucz pamięci podręcznej: skrót źródeł (z definicjami) i identyfikacji sterownika
+	bool loadBinary(unsigned long long key); //Wczytuje program z pamięci podręcznej (false: brak pliku lub odrzucony przez sterownik)
+	void saveBinary(unsigned long long key); //Zapisuje zlinkowany program do pamięci podręcznej
+	std::string accountingName; //Nazwa programu w MemoryAccounting (pliki vertex i fragment shadera)
+	size_t accountedBytes; //Rozmiar zgłoszony do MemoryAccounting
+	void account(size_t sourceBytes); //Zgłasza rozmiar zlinkowanego programu do MemoryAccounting
 public:
-	ShaderProgram(const char* vertexShaderFile,const char* geometryShaderFile,const char* fragmentShaderFile);
+	ShaderProgram(const char* vertexShaderFile,const char* geometryShaderFile,const char* fragmentShaderFile,const char* defines=NULL); //defines: dyrektywy wstawiane za linią #version (warianty shaderów)
 	~ShaderProgram();
 	void use(); //Włącza wykorzystywanie programu cieniującego
+	GLuint id(); //Zwraca uchwyt programu cieniującego (np. do sortowania wywołań rysowania)
 	GLuint u(const char* variableName); //Pobiera numer slotu związanego z daną zmienną jednorodną
 	GLuint a(const char* variableName); //Pobiera numer slotu związanego z danym atrybutem
+	void bindUniformBlock(const char* blockName, GLuint binding); //Łączy blok zmiennych jednorodnych z punktem wiązania bufora (UBO)
 };
 
 /*
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <utility>
+
+using namespace std;
+
+
+// reference to an item of a SlotMap; stays valid while the item exists, no matter how the storage moves
+struct Handle
+{
+    uint32_t index;         // slot
+    uint32_t generation;    // the slot's generation when the item was inserted (0: never valid)
+
+    bool operator==(const Handle& other) const
+    {
+        return this->index == other.index && this->generation == other.generation;
+    }
+
+    bool operator!=(const Handle& other) const
+    {
+        return !(*this == other);
+    }
+};
+
+const Handle INVALID_HANDLE = { ~0u, 0 };
+
+
+// Items kept densely in a vector (iterated like one) and referred to by handles. A handle names a slot,
+// the slot knows where its item currently is; removing an item moves the last one into its place and bumps
+// the slot's generation, so handles to the removed item stop resolving instead of pointing at its successor.
+template <typename T>
+class SlotMap
+{
+
+private:
+
+    struct Slot
+    {
+        uint32_t dense;         // the item's position in <items> (free slot: the next free slot)
+        uint32_t generation;
+    };
+
+    vector<T> items;
+    vector<uint32_t> itemSlots;     // by item: its slot
+    vector<Slot> slots;
+    uint32_t freeSlot;              // first slot of the free list (~0: none)
+
+
+public:
+
+    SlotMap()
+    {
+        this->freeSlot = ~0u;
+    }
+
+    void reserve(size_t count)
+    {
+        this->items.reserve(count);
+        this->itemSlots.reserve(count);
+        this->slots.reserve(count);
+    }
+
+    Handle insert(T&& item)
+    {
+        uint32_t slot = this->freeSlot;
+        if (slot != ~0u)
+        {
+            this->freeSlot = this->slots[slot].dense;
+        }
+        else
+        {
+            slot = uint32_t(this->slots.size());
+            Slot fresh = { 0, 1 };
+            this->slots.push_back(fresh);
+        }
+        this->slots[slot].dense = uint32_t(this->items.size());
+        this->items.push_back(move(item));
+        this->itemSlots.push_back(slot);
+
+        Handle handle = { slot, this->slots[slot].generation };
+        return handle;
+    }
+
+    bool remove(Handle handle)
+    {
+        if (!this->contains(handle))
+        {
+            return false;
+        }
+        uint32_t dense = this->slots[handle.index].dense;
+        uint32_t last = uint32_t(this->items.size()) - 1;
+        if (dense != last)
+        {
+            this->items[dense] = move(this->items[last]);
+            this->itemSlots[dense] = this->itemSlots[last];
+            this->slots[this->itemSlots[dense]].dense = dense;
+        }
+        this->items.pop_back();
+        this->itemSlots.pop_back();
+
+        this->slots[handle.index].generation++;
+        this->slots[handle.index].dense = this->freeSlot;
+        this->freeSlot = handle.index;
+        return true;
+    }
+
+    bool contains(Handle handle) const
+    {
+        return handle.index < this->slots.size() && this->slots[handle.index].generation == handle.generation;
+    }
+
+    // the item, or NULL for a stale or invalid handle
+    T* get(Handle handle)
+    {
+        return this->contains(handle) ? &this->items[this->slots[handle.index].dense] : NULL;
+    }
+
+    // the handle of the item at a dense position
+    Handle handleAt(size_t dense) const
+    {
+        uint32_t slot = this->itemSlots[dense];
+        Handle handle = { slot, this->slots[slot].generation };
+        return handle;
+    }
+
+    // dense position of an item (for per-item arrays kept alongside), ~0 for a stale handle
+    uint32_t denseIndex(Handle handle) const
+    {
+        return this->contains(handle) ? this->slots[handle.index].dense : ~0u;
+    }
+
+    T& operator[](size_t dense)
+    {
+        return this->items[dense];
+    }
+
+    T& back()
+    {
+        return this->items.back();
+    }
+
+    size_t size() const
+    {
+        return this->items.size();
+    }
+
+    typename vector<T>::iterator begin()
+    {
+        return this->items.begin();
+    }
+
+    typename vector<T>::iterator end()
+    {
+        return this->items.end();
+    }
+};
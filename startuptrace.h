@@ -0,0 +1,348 @@
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <cstring>
+
+#include <assimp/IOSystem.hpp>
+#include <assimp/IOStream.hpp>
+#include <assimp/DefaultIOSystem.h>
+
+using namespace std;
+
+
+// stages of loading (the summary lists them in the order they first occur)
+const char* const STAGE_FILE_READ = "file read";
+const char* const STAGE_ASSIMP_PARSE = "assimp parse";
+const char* const STAGE_VERTEX_CONVERSION = "vertex conversion";
+const char* const STAGE_TEXTURE_DECODE = "texture decode";
+const char* const STAGE_GL_UPLOAD = "GL upload";
+const char* const STAGE_SHADER_COMPILE = "shader compile";
+const char* const STAGE_KEY_LAYOUT = "key layout";
+const char* const STAGE_PICKING = "picking BVH";
+
+const char* const STARTUP_TRACE_FILE = "startup_trace.json";
+
+
+// Timeline of the program's start, from the first instance() call (on the main thread) until finish(): every TraceScope closed in between
+// becomes a Chrome trace event (chrome://tracing, ui.perfetto.dev) on its thread, and adds its self time (its duration
+// minus the scopes nested in it) to its stage, so the stage totals don't count anything twice.
+// Scopes may be opened on any thread; after finish() they cost two clock reads and nothing is recorded.
+class StartupTrace
+{
+
+private:
+
+    struct Event
+    {
+        string name;
+        const char* stage;
+        double start, duration;     // microseconds from the origin
+        int thread;
+    };
+
+    chrono::steady_clock::time_point origin;
+    atomic<bool> recording;
+
+    mutex eventsMutex;
+    vector<Event> events;
+    vector<pair<const char*, double>> stageTimes;       // stage -> self time (microseconds), in order of appearance
+    unordered_map<thread::id, int> threads;             // -> trace thread id
+    vector<string> threadNames;
+
+
+    StartupTrace()
+    {
+        this->origin = chrono::steady_clock::now();
+        this->recording = true;
+        this->threads[this_thread::get_id()] = 0;
+        this->threadNames.push_back("main");
+    }
+
+    StartupTrace(const StartupTrace&) = delete;
+    StartupTrace& operator=(const StartupTrace&) = delete;
+
+    // trace thread id of the calling thread (eventsMutex held)
+    int threadIndex()
+    {
+        unordered_map<thread::id, int>::iterator found = this->threads.find(this_thread::get_id());
+        if (found != this->threads.end())
+        {
+            return found->second;
+        }
+        int index = int(this->threadNames.size());
+        this->threads[this_thread::get_id()] = index;
+        this->threadNames.push_back("thread " + to_string(index));
+        return index;
+    }
+
+    static string escape(const string& text)
+    {
+        string escaped;
+        escaped.reserve(text.size());
+        for (size_t i = 0; i < text.size(); i++)
+        {
+            char c = text[i];
+            if (c == '"' || c == '\\')
+            {
+                escaped += '\\';
+                escaped += c;
+            }
+            else if ((unsigned char)c < 0x20)
+            {
+                escaped += ' ';
+            }
+            else
+            {
+                escaped += c;
+            }
+        }
+        return escaped;
+    }
+
+    void write(const string& path)
+    {
+        ofstream file(path.c_str());
+        if (!file)
+        {
+            cout << "StartupTrace: can't write " << path << endl;
+            return;
+        }
+        file << fixed << setprecision(1) << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+        for (size_t i = 0; i < this->threadNames.size(); i++)
+        {
+            file << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << i << ",\"args\":{\"name\":\"" << escape(this->threadNames[i]) << "\"}},\n";
+        }
+        for (size_t i = 0; i < this->events.size(); i++)
+        {
+            const Event& event = this->events[i];
+            file << "{\"name\":\"" << escape(event.name.empty() ? event.stage : event.name) << "\",\"cat\":\"" << event.stage
+                << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << event.thread << ",\"ts\":" << event.start << ",\"dur\":" << event.duration << "}"
+                << (i + 1 < this->events.size() ? ",\n" : "\n");
+        }
+        file << "]}\n";
+    }
+
+
+public:
+
+    static StartupTrace& instance()
+    {
+        static StartupTrace trace;
+        return trace;
+    }
+
+    bool isRecording()
+    {
+        return this->recording;
+    }
+
+    // microseconds since the trace started
+    double now()
+    {
+        return chrono::duration<double, micro>(chrono::steady_clock::now() - this->origin).count();
+    }
+
+    // name the calling thread in the trace
+    void nameThread(const string& name)
+    {
+        lock_guard<mutex> lock(this->eventsMutex);
+        this->threadNames[this->threadIndex()] = name;
+    }
+
+    void record(const char* stage, const string& name, double start, double duration, double selfDuration)
+    {
+        lock_guard<mutex> lock(this->eventsMutex);
+        if (!this->recording)
+        {
+            return;
+        }
+        Event event = { name, stage, start, duration, this->threadIndex() };
+        this->events.push_back(event);
+
+        size_t i = 0;
+        while (i < this->stageTimes.size() && strcmp(this->stageTimes[i].first, stage) != 0)
+        {
+            i++;
+        }
+        if (i == this->stageTimes.size())
+        {
+            this->stageTimes.push_back(make_pair(stage, 0.0));
+        }
+        this->stageTimes[i].second += selfDuration;
+    }
+
+    // stop recording, write the trace to <path> and print the one-line summary
+    void finish(const string& path = STARTUP_TRACE_FILE)
+    {
+        lock_guard<mutex> lock(this->eventsMutex);
+        if (!this->recording)
+        {
+            return;
+        }
+        this->recording = false;
+        double total = this->now();
+        this->write(path);
+
+        cout << fixed << setprecision(1) << "Startup: " << total / 1000.0 << " ms to the first frame with every texture (";
+        for (size_t i = 0; i < this->stageTimes.size(); i++)
+        {
+            cout << (i > 0 ? ", " : "") << this->stageTimes[i].first << " " << this->stageTimes[i].second / 1000.0;
+        }
+        cout << " ms, summed over " << this->threadNames.size() << " threads) -> " << path << defaultfloat << endl;
+    }
+};
+
+
+// Times the enclosing block as an event of a stage (name: what the event shows, e.g. the file; empty: the stage's name)
+class TraceScope
+{
+
+private:
+
+    const char* stage;
+    string name;
+    double start;
+    double nested;          // time of the scopes closed inside this one
+    TraceScope* parent;     // the scope this one is nested in (on the same thread)
+
+    static TraceScope*& current()
+    {
+        static thread_local TraceScope* scope = NULL;
+        return scope;
+    }
+
+
+public:
+
+    TraceScope(const char* stage, const string& name = "")
+    {
+        this->stage = stage;
+        this->name = name;
+        this->nested = 0.0;
+        this->parent = current();
+        current() = this;
+        this->start = StartupTrace::instance().now();
+    }
+
+    ~TraceScope()
+    {
+        double duration = StartupTrace::instance().now() - this->start;
+        if (this->parent != NULL)
+        {
+            this->parent->nested += duration;
+        }
+        current() = this->parent;
+        if (StartupTrace::instance().isRecording())
+        {
+            StartupTrace::instance().record(this->stage, this->name, this->start, duration, duration - this->nested);
+        }
+    }
+
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+};
+
+
+// ASSIMP's file access with the reads timed as STAGE_FILE_READ, so an import splits into reading and parsing
+// (give an Importer one with SetIOHandler(new TracedIOSystem()); the Importer deletes it)
+class TracedIOSystem : public Assimp::IOSystem
+{
+
+private:
+
+    class TracedStream : public Assimp::IOStream
+    {
+
+    private:
+
+        Assimp::IOStream* stream;
+        string file;
+
+
+    public:
+
+        TracedStream(Assimp::IOStream* stream, const string& file)
+        {
+            this->stream = stream;
+            this->file = file;
+        }
+
+        Assimp::IOStream* getStream()
+        {
+            return this->stream;
+        }
+
+        size_t Read(void* buffer, size_t size, size_t count) override
+        {
+            TraceScope scope(STAGE_FILE_READ, this->file);
+            return this->stream->Read(buffer, size, count);
+        }
+
+        size_t Write(const void* buffer, size_t size, size_t count) override
+        {
+            return this->stream->Write(buffer, size, count);
+        }
+
+        aiReturn Seek(size_t offset, aiOrigin origin) override
+        {
+            return this->stream->Seek(offset, origin);
+        }
+
+        size_t Tell() const override
+        {
+            return this->stream->Tell();
+        }
+
+        size_t FileSize() const override
+        {
+            return this->stream->FileSize();
+        }
+
+        void Flush() override
+        {
+            this->stream->Flush();
+        }
+    };
+
+    Assimp::DefaultIOSystem files;
+
+
+public:
+
+    bool Exists(const char* file) const override
+    {
+        return this->files.Exists(file);
+    }
+
+    char getOsSeparator() const override
+    {
+        return this->files.getOsSeparator();
+    }
+
+    Assimp::IOStream* Open(const char* file, const char* mode = "rb") override
+    {
+        Assimp::IOStream* stream;
+        {
+            TraceScope scope(STAGE_FILE_READ, file);
+            stream = this->files.Open(file, mode);
+        }
+        return stream != NULL ? new TracedStream(stream, file) : NULL;
+    }
+
+    void Close(Assimp::IOStream* stream) override
+    {
+        TracedStream* traced = static_cast<TracedStream*>(stream);
+        this->files.Close(traced->getStream());
+        delete traced;
+    }
+};
@@ -0,0 +1,254 @@
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <cstring>
+#include <string>
+
+#include <GL/glew.h>
+
+#include "glstate.h"
+#include "memoryaccounting.h"
+
+using namespace std;
+
+
+const int STREAM_SEGMENTS = 3;          // frames the CPU may write ahead of the GPU
+const int STREAM_MAX_SEGMENTS = 8;      // extra segments added while the GPU lags behind, before the CPU has to wait
+
+struct StreamBufferStats
+{
+    GLsizeiptr bytes;       // written by the last frame
+    int segments;
+    int segmentsAdded;      // times a busy segment was skipped by adding a new one
+    int stalls;             // times the CPU had to wait for the GPU
+};
+
+
+// Per-frame dynamic data streamed to the GPU through a ring of buffer segments, each exposed as a buffer texture.
+// With ARB_buffer_storage every segment is persistently and coherently mapped, so the frame's data is written
+// straight into GPU-visible memory; otherwise begin() hands out a staging block that end() uploads into an
+// orphaned buffer. A segment is reused only after the fence placed behind its last draws has signaled; if it has not,
+// a new segment is added to the ring instead of waiting.
+//
+// usage per frame: data = begin(size); write data; end(); bind texture(); draw; fence();
+class StreamBuffer
+{
+
+private:
+
+    struct Segment
+    {
+        GLuint buffer;
+        GLuint texture;
+        GLsizeiptr capacity;
+        void* mapped;       // persistent mapping (NULL with the orphaning fallback)
+        GLsync fence;       // signaled when the GPU is done with the segment's last frame
+    };
+
+    string name;            // reported to the MemoryAccounting
+    GLenum format;
+    GLsizeiptr initialCapacity;
+    bool persistent;
+
+    vector<Segment> segments;
+    int current;
+    GLsizeiptr used;
+    vector<unsigned char> staging;      // orphaning fallback: written by the CPU, uploaded by end()
+
+    StreamBufferStats stats;
+
+
+    void createSegment(Segment& segment, GLsizeiptr capacity)
+    {
+        segment.capacity = capacity;
+        segment.mapped = NULL;
+        segment.fence = 0;
+
+        glGenBuffers(1, &segment.buffer);
+        glBindBuffer(GL_TEXTURE_BUFFER, segment.buffer);
+        if (this->persistent)
+        {
+            GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+            glBufferStorage(GL_TEXTURE_BUFFER, capacity, NULL, flags);
+            segment.mapped = glMapBufferRange(GL_TEXTURE_BUFFER, 0, capacity, flags);
+        }
+        else
+        {
+            glBufferData(GL_TEXTURE_BUFFER, capacity, NULL, GL_STREAM_DRAW);
+        }
+
+        glGenTextures(1, &segment.texture);
+        GLStateCache::instance().editTexture(GL_TEXTURE_BUFFER, segment.texture);
+        glTexBuffer(GL_TEXTURE_BUFFER, this->format, segment.buffer);
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+        MemoryAccounting::instance().add(this->name, MEMORY_GL_BUFFERS, size_t(capacity));
+    }
+
+    void destroySegment(Segment& segment)
+    {
+        if (segment.fence != 0)
+        {
+            glDeleteSync(segment.fence);
+        }
+        if (segment.mapped != NULL)
+        {
+            glBindBuffer(GL_TEXTURE_BUFFER, segment.buffer);
+            glUnmapBuffer(GL_TEXTURE_BUFFER);
+            glBindBuffer(GL_TEXTURE_BUFFER, 0);
+        }
+        GLStateCache::instance().forgetTexture(segment.texture);
+        glDeleteTextures(1, &segment.texture);
+        glDeleteBuffers(1, &segment.buffer);
+        MemoryAccounting::instance().remove(this->name, MEMORY_GL_BUFFERS, size_t(segment.capacity));
+    }
+
+    // true if the GPU has finished reading the segment (never blocks)
+    static bool isIdle(Segment& segment)
+    {
+        if (segment.fence == 0)
+        {
+            return true;
+        }
+        GLenum result = glClientWaitSync(segment.fence, 0, 0);
+        if (result == GL_ALREADY_SIGNALED || result == GL_CONDITION_SATISFIED)
+        {
+            glDeleteSync(segment.fence);
+            segment.fence = 0;
+            return true;
+        }
+        return false;
+    }
+
+
+public:
+
+    // name: what the segments are reported as to the MemoryAccounting; format: texel format of the buffer textures (GL_RGBA32F, GL_R32UI...)
+    StreamBuffer(const string& name, GLenum format, GLsizeiptr initialCapacity = 64 * 1024)
+    {
+        this->name = name;
+        this->format = format;
+        this->initialCapacity = initialCapacity;
+        this->persistent = false;
+        this->current = 0;
+        this->used = 0;
+        memset(&this->stats, 0, sizeof(this->stats));
+    }
+
+    ~StreamBuffer()
+    {
+        for (GLuint i = 0; i < this->segments.size(); i++)
+        {
+            this->destroySegment(this->segments[i]);
+        }
+    }
+
+    StreamBuffer(const StreamBuffer&) = delete;
+    StreamBuffer& operator=(const StreamBuffer&) = delete;
+
+    // writable block of <size> bytes for this frame, valid until end()
+    void* begin(GLsizeiptr size)
+    {
+        // the segments are created on first use (a GL context must be current)
+        if (this->segments.empty())
+        {
+            this->persistent = GLEW_ARB_buffer_storage != 0;
+            this->segments.resize(STREAM_SEGMENTS);
+            for (GLuint i = 0; i < this->segments.size(); i++)
+            {
+                this->createSegment(this->segments[i], max(size, this->initialCapacity));
+            }
+            this->current = int(this->segments.size()) - 1;
+        }
+
+        // advance to the next segment the GPU is done with
+        int next = (this->current + 1) % int(this->segments.size());
+        if (!isIdle(this->segments[next]))
+        {
+            if (int(this->segments.size()) < STREAM_MAX_SEGMENTS)
+            {
+                Segment segment;
+                this->createSegment(segment, this->segments[next].capacity);
+                this->segments.insert(this->segments.begin() + next, segment);
+                this->stats.segmentsAdded++;
+            }
+            else
+            {
+                glClientWaitSync(this->segments[next].fence, GL_SYNC_FLUSH_COMMANDS_BIT, GLuint64(1000000000));
+                glDeleteSync(this->segments[next].fence);
+                this->segments[next].fence = 0;
+                this->stats.stalls++;
+            }
+        }
+        this->current = next;
+
+        // grow (the segment is idle, so it can be replaced)
+        Segment& segment = this->segments[this->current];
+        if (segment.capacity < size)
+        {
+            GLsizeiptr capacity = max(size, segment.capacity * 2);
+            this->destroySegment(segment);
+            this->createSegment(segment, capacity);
+        }
+
+        this->used = size;
+        this->stats.bytes = size;
+        this->stats.segments = int(this->segments.size());
+        if (this->persistent)
+        {
+            return segment.mapped;
+        }
+        this->staging.resize(size_t(max(size, GLsizeiptr(1))));
+        return this->staging.data();
+    }
+
+    // the frame's data is written (uploads it with the orphaning fallback)
+    void end()
+    {
+        if (this->persistent || this->used == 0)
+        {
+            return;
+        }
+        Segment& segment = this->segments[this->current];
+        glBindBuffer(GL_TEXTURE_BUFFER, segment.buffer);
+        glBufferData(GL_TEXTURE_BUFFER, segment.capacity, NULL, GL_STREAM_DRAW);
+        glBufferSubData(GL_TEXTURE_BUFFER, 0, this->used, this->staging.data());
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+    }
+
+    // after the last draw reading this frame's data
+    void fence()
+    {
+        if (!this->persistent || this->segments.empty())
+        {
+            return;
+        }
+        Segment& segment = this->segments[this->current];
+        if (segment.fence != 0)
+        {
+            glDeleteSync(segment.fence);
+        }
+        segment.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+
+    // buffer texture / buffer holding the current frame's data
+    GLuint texture()
+    {
+        return this->segments.empty() ? 0 : this->segments[this->current].texture;
+    }
+
+    GLuint buffer()
+    {
+        return this->segments.empty() ? 0 : this->segments[this->current].buffer;
+    }
+
+    bool isPersistent()
+    {
+        return this->persistent;
+    }
+
+    const StreamBufferStats& getStats()
+    {
+        return this->stats;
+    }
+};
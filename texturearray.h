@@ -0,0 +1,385 @@
+#pragma once
+
+#include <string>
+#include <iostream>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+#include <algorithm>
+
+#include <GL/glew.h>
+#include "glstate.h"
+#include "memoryaccounting.h"
+
+using namespace std;
+
+
+// fixed texture units: every mesh samples its maps from the same units, only the layer changes per draw
+const GLuint TEXTURE_UNIT_DIFFUSE = 0;
+const GLuint TEXTURE_UNIT_SPECULAR = 1;
+
+// layers of the placeholder array (shown until an image is decoded, or when a mesh has no such map)
+const GLint PLACEHOLDER_GREY = 0;
+const GLint PLACEHOLDER_BLACK = 1;
+
+
+// where a texture currently lives: a GL_TEXTURE_2D_ARRAY and a layer inside it
+struct TextureBinding
+{
+    GLuint array;
+    GLint layer;
+};
+
+
+// Packs every texture of the same size into the layers of a shared GL_TEXTURE_2D_ARRAY ("page"),
+// so meshes with different materials differ only by a layer index instead of a texture bind.
+// Textures are addressed through stable handles; a page may be reallocated when it grows,
+// so the (array, layer) pair is resolved at draw time.
+class TextureArrayPool
+{
+
+private:
+
+    struct Page
+    {
+        GLuint texture;
+        int width, height;
+        int levels;
+        int capacity;
+        vector<GLint> freeLayers;
+        int nextLayer;      // layers below this have been handed out at least once
+    };
+
+    struct Slot
+    {
+        bool alive;
+        bool resident;
+        GLint placeholder;
+        int page;
+        GLint layer;
+        int alias;          // handle whose layer this one shows (-1: its own)
+        string name;        // reported to the MemoryAccounting
+    };
+
+    GLuint placeholderArray;
+    vector<Page> pages;
+    unordered_map<uint64_t, vector<int>> pagesBySize;  // (width, height) -> pages of that size
+    vector<Slot> slots;                                 // indexed by handle (handles are never reused)
+    GLint maxLayers;
+
+
+    TextureArrayPool()
+    {
+        glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &this->maxLayers);
+
+        const unsigned char placeholders[2][3] = { { 160, 160, 160 }, { 0, 0, 0 } };
+        glGenTextures(1, &this->placeholderArray);
+        GLStateCache::instance().editTexture(GL_TEXTURE_2D_ARRAY, this->placeholderArray);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA8, 1, 1, 2, 0, GL_RGB, GL_UNSIGNED_BYTE, placeholders);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, 0);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        MemoryAccounting::instance().set("texture placeholders", MEMORY_TEXTURES, 2 * 4);
+    }
+
+    TextureArrayPool(const TextureArrayPool&) = delete;
+    TextureArrayPool& operator=(const TextureArrayPool&) = delete;
+
+
+    // bytes of one layer of a page with its mip chain
+    static size_t layerBytes(const Page& page)
+    {
+        size_t bytes = 0;
+        for (int level = 0; level < page.levels; level++)
+        {
+            bytes += size_t(max(page.width >> level, 1)) * size_t(max(page.height >> level, 1)) * 4;
+        }
+        return bytes;
+    }
+
+    // report the layers no texture holds to the MemoryAccounting (the others are reported under their texture's name)
+    void account()
+    {
+        size_t unused = 0;
+        for (GLuint i = 0; i < this->pages.size(); i++)
+        {
+            const Page& page = this->pages[i];
+            unused += size_t(page.capacity - page.nextLayer + int(page.freeLayers.size())) * layerBytes(page);
+        }
+        MemoryAccounting::instance().set("texture arrays (free layers)", MEMORY_TEXTURES, unused);
+    }
+
+    // allocates (uninitialized) storage for <layers> layers with a full mip chain
+    GLuint allocateArray(int width, int height, int levels, int layers)
+    {
+        GLuint texture;
+        glGenTextures(1, &texture);
+        GLStateCache::instance().editTexture(GL_TEXTURE_2D_ARRAY, texture);
+        for (int level = 0; level < levels; level++)
+        {
+            glTexImage3D(GL_TEXTURE_2D_ARRAY, level, GL_RGBA8, max(width >> level, 1), max(height >> level, 1), layers, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+        }
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BASE_LEVEL, 0);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, levels - 1);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        return texture;
+    }
+
+    // reallocates a full page with room for <capacity> layers, copying the layers already in use
+    void growPage(Page& page, int capacity)
+    {
+        GLuint texture = this->allocateArray(page.width, page.height, page.levels, capacity);
+
+        if (page.nextLayer > 0)
+        {
+            if (GLEW_ARB_copy_image)
+            {
+                for (int level = 0; level < page.levels; level++)
+                {
+                    glCopyImageSubData(page.texture, GL_TEXTURE_2D_ARRAY, level, 0, 0, 0, texture, GL_TEXTURE_2D_ARRAY, level, 0, 0, 0,
+                        max(page.width >> level, 1), max(page.height >> level, 1), page.nextLayer);
+                }
+            }
+            else
+            {
+                // GL 3.3 path: read each layer/level through a framebuffer into the new array
+                GLint previousReadFramebuffer;
+                glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &previousReadFramebuffer);
+
+                GLuint framebuffer;
+                glGenFramebuffers(1, &framebuffer);
+                glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+                GLStateCache::instance().editTexture(GL_TEXTURE_2D_ARRAY, texture);
+                for (int layer = 0; layer < page.nextLayer; layer++)
+                {
+                    for (int level = 0; level < page.levels; level++)
+                    {
+                        glFramebufferTextureLayer(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, page.texture, level, layer);
+                        glCopyTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, layer, 0, 0, max(page.width >> level, 1), max(page.height >> level, 1));
+                    }
+                }
+                glBindFramebuffer(GL_READ_FRAMEBUFFER, previousReadFramebuffer);
+                glDeleteFramebuffers(1, &framebuffer);
+            }
+        }
+
+        GLStateCache::instance().forgetTexture(page.texture);
+        glDeleteTextures(1, &page.texture);
+        page.texture = texture;
+        page.capacity = capacity;
+    }
+
+    // finds a free layer for an image of the given size, growing or adding pages as needed
+    void allocateLayer(int width, int height, int& pageIndex, GLint& layer)
+    {
+        uint64_t sizeKey = (uint64_t(width) << 32) | uint64_t(height);
+        vector<int>& candidates = this->pagesBySize[sizeKey];
+
+        for (GLuint i = 0; i < candidates.size(); i++)
+        {
+            Page& page = this->pages[candidates[i]];
+            if (!page.freeLayers.empty())
+            {
+                pageIndex = candidates[i];
+                layer = page.freeLayers.back();
+                page.freeLayers.pop_back();
+                return;
+            }
+            if (page.nextLayer < page.capacity || page.capacity < this->maxLayers)
+            {
+                if (page.nextLayer == page.capacity)
+                {
+                    this->growPage(page, min(page.capacity * 2, int(this->maxLayers)));
+                }
+                pageIndex = candidates[i];
+                layer = page.nextLayer++;
+                return;
+            }
+        }
+
+        Page page;
+        page.width = width;
+        page.height = height;
+        page.levels = mipLevels(width, height);
+        page.capacity = 1;
+        page.nextLayer = 1;
+        page.texture = this->allocateArray(width, height, page.levels, page.capacity);
+
+        pageIndex = int(this->pages.size());
+        layer = 0;
+        this->pages.push_back(page);
+        candidates.push_back(pageIndex);
+    }
+
+
+public:
+
+    static TextureArrayPool& instance()
+    {
+        static TextureArrayPool pool;
+        return pool;
+    }
+
+    static int mipLevels(int width, int height)
+    {
+        int levels = 1;
+        while (width > 1 || height > 1)
+        {
+            width = max(width / 2, 1);
+            height = max(height / 2, 1);
+            levels++;
+        }
+        return levels;
+    }
+
+    // 2x2 box filter of an RGB image (odd edges are clamped)
+    static void downsample(const unsigned char* source, int width, int height, vector<unsigned char>& result)
+    {
+        int resultWidth = max(width / 2, 1), resultHeight = max(height / 2, 1);
+        result.resize(size_t(resultWidth) * resultHeight * 3);
+
+        for (int y = 0; y < resultHeight; y++)
+        {
+            int y0 = min(2 * y, height - 1), y1 = min(2 * y + 1, height - 1);
+            for (int x = 0; x < resultWidth; x++)
+            {
+                int x0 = min(2 * x, width - 1), x1 = min(2 * x + 1, width - 1);
+                for (int c = 0; c < 3; c++)
+                {
+                    int sum = source[(size_t(y0) * width + x0) * 3 + c] + source[(size_t(y0) * width + x1) * 3 + c]
+                        + source[(size_t(y1) * width + x0) * 3 + c] + source[(size_t(y1) * width + x1) * 3 + c];
+                    result[(size_t(y) * resultWidth + x) * 3 + c] = (unsigned char)((sum + 2) / 4);
+                }
+            }
+        }
+    }
+
+    // levels 1.. of an RGB image's mip chain (what upload() expects; any thread)
+    static void buildMipChain(const unsigned char* pixels, int width, int height, vector<vector<unsigned char>>& mips)
+    {
+        mips.resize(mipLevels(width, height) - 1);
+        for (size_t level = 0; level < mips.size(); level++)
+        {
+            downsample(pixels, width, height, mips[level]);
+            pixels = &mips[level][0];
+            width = max(width / 2, 1);
+            height = max(height / 2, 1);
+        }
+    }
+
+    // new texture handle, shown as the given placeholder layer until upload()
+    // (name: what the texture is reported as to the MemoryAccounting, usually its file)
+    GLuint createTexture(GLint placeholder, const string& name = "")
+    {
+        Slot slot;
+        slot.alive = true;
+        slot.resident = false;
+        slot.placeholder = placeholder;
+        slot.page = -1;
+        slot.layer = 0;
+        slot.alias = -1;
+        slot.name = name.empty() ? "texture " + to_string(this->slots.size()) : name;
+        this->slots.push_back(slot);
+        return GLuint(this->slots.size() - 1);
+    }
+
+    // stores an RGB image with its mip chain (from buildMipChain) in a layer of the page matching its size
+    // (generating mipmaps on the GPU would rebuild every layer of the page)
+    void upload(GLuint handle, int width, int height, const unsigned char* pixels, const vector<vector<unsigned char>>& mips)
+    {
+        if (handle >= this->slots.size() || !this->slots[handle].alive)
+        {
+            return;
+        }
+
+        Slot& slot = this->slots[handle];
+        this->allocateLayer(width, height, slot.page, slot.layer);
+        Page& page = this->pages[slot.page];
+
+        GLStateCache::instance().editTexture(GL_TEXTURE_2D_ARRAY, page.texture);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+        int levels = min(page.levels, int(mips.size()) + 1);
+        for (int level = 0; level < levels; level++)
+        {
+            glTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, slot.layer, max(width >> level, 1), max(height >> level, 1), 1,
+                GL_RGB, GL_UNSIGNED_BYTE, level == 0 ? pixels : &mips[level - 1][0]);
+        }
+
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+        slot.resident = true;
+        MemoryAccounting::instance().add(slot.name, MEMORY_TEXTURES, layerBytes(page));
+        this->account();
+    }
+
+    // frees the handle's layer for reuse by another image of the same size
+    void destroyTexture(GLuint handle)
+    {
+        if (handle >= this->slots.size() || !this->slots[handle].alive)
+        {
+            return;
+        }
+
+        Slot& slot = this->slots[handle];
+        if (slot.resident)
+        {
+            this->pages[slot.page].freeLayers.push_back(slot.layer);
+            MemoryAccounting::instance().remove(slot.name, MEMORY_TEXTURES, layerBytes(this->pages[slot.page]));
+            this->account();
+        }
+        slot.alive = false;
+        slot.resident = false;
+    }
+
+    // shows <target>'s image through <handle> (which must not have one of its own) while <target> lives
+    void aliasTexture(GLuint handle, GLuint target)
+    {
+        if (handle < this->slots.size() && target < this->slots.size() && !this->slots[handle].resident)
+        {
+            this->slots[handle].alias = int(target);
+        }
+    }
+
+    TextureBinding resolve(GLuint handle)
+    {
+        TextureBinding binding;
+        if (handle < this->slots.size() && this->slots[handle].alias >= 0)
+        {
+            binding = this->resolve(GLuint(this->slots[handle].alias));
+        }
+        else if (handle < this->slots.size() && this->slots[handle].resident)
+        {
+            binding.array = this->pages[this->slots[handle].page].texture;
+            binding.layer = this->slots[handle].layer;
+        }
+        else
+        {
+            binding = this->placeholder(handle < this->slots.size() ? this->slots[handle].placeholder : PLACEHOLDER_GREY);
+        }
+        return binding;
+    }
+
+    TextureBinding placeholder(GLint layer)
+    {
+        TextureBinding binding;
+        binding.array = this->placeholderArray;
+        binding.layer = layer;
+        return binding;
+    }
+
+    void printStats()
+    {
+        cout << "TextureArrayPool: " << this->pages.size() << " array pages\n";
+        for (GLuint i = 0; i < this->pages.size(); i++)
+        {
+            cout << "\t" << this->pages[i].width << "x" << this->pages[i].height << ": " << this->pages[i].nextLayer - this->pages[i].freeLayers.size()
+                 << " / " << this->pages[i].capacity << " layers\n";
+        }
+    }
+};
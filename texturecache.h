@@ -0,0 +1,302 @@
+#pragma once
+
+#include <string>
+#include <iostream>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+#include <cctype>
+
+#include <GL/glew.h>
+#include <assimp/scene.h>
+
+#include "mesh.h"
+#include "texturestreamer.h"
+
+using namespace std;
+
+
+// Process-wide registry of GL textures and material texture sets, shared by every Model.
+// Textures are found in O(1) by normalized path. A path miss is requested right away (nothing is read on the
+// GL thread); the decode worker hashes the file contents, and when they are the contents of a texture already
+// uploaded, it skips decoding them and the new handle is pointed at that texture's layer, so the same image reached
+// through different relative paths takes one layer and is decoded once (it is still read once per path).
+// Both textures and materials are reference counted; the texture's array layer is freed with its last reference.
+class TextureCache
+{
+
+private:
+
+    struct CachedTexture
+    {
+        string filename;        // normalized path the texture was loaded from
+        uint64_t contentHash;
+        size_t contentSize;     // 0: not decoded yet
+        GLuint shown;           // texture whose layer this one shows (itself unless its contents were a duplicate)
+        int refCount;
+    };
+
+    struct CachedMaterial
+    {
+        vector<Texture> textures;
+        int refCount;
+    };
+
+    unordered_map<GLuint, CachedTexture> textures;      // texture handle -> entry
+    unordered_map<string, GLuint> pathIndex;            // normalized path key -> texture handle
+    unordered_map<uint64_t, GLuint> contentIndex;       // content hash -> texture handle
+    unordered_map<string, CachedMaterial> materials;    // material key -> texture set
+
+    // statistics (for checking how much the dedupe saves)
+    int pathHits, contentHits, misses;
+
+
+    TextureCache()
+    {
+        this->pathHits = 0;
+        this->contentHits = 0;
+        this->misses = 0;
+        TextureStreamer::instance().setDuplicateResolver([this](GLuint handle, uint64_t contentHash, size_t contentSize, bool decoded)
+        {
+            return this->resolveContent(handle, contentHash, contentSize, decoded);
+        });
+    }
+
+    TextureCache(const TextureCache&) = delete;
+    TextureCache& operator=(const TextureCache&) = delete;
+
+
+    // called by the streamer when <handle>'s file has been read: true if another texture already shows the same
+    // contents, in which case <handle> shows that texture's layer and keeps a reference to it;
+    // otherwise a decoded <handle> becomes the texture its contents are known by
+    bool resolveContent(GLuint handle, uint64_t contentHash, size_t contentSize, bool decoded)
+    {
+        unordered_map<GLuint, CachedTexture>::iterator entry = this->textures.find(handle);
+        if (entry == this->textures.end())
+        {
+            return false;
+        }
+
+        unordered_map<uint64_t, GLuint>::iterator byContent = this->contentIndex.find(contentHash);
+        if (byContent != this->contentIndex.end() && byContent->second != handle && this->textures[byContent->second].contentSize == contentSize)
+        {
+            entry->second.shown = byContent->second;
+            this->addRef(byContent->second);
+            TextureArrayPool::instance().aliasTexture(handle, byContent->second);
+            this->contentHits++;
+            return true;
+        }
+
+        if (!decoded)
+        {
+            return false;
+        }
+        if (byContent != this->contentIndex.end())
+        {
+            // same hash, other size: the older texture is no longer found by its contents
+            const CachedTexture& replaced = this->textures[byContent->second];
+            TextureStreamer::instance().forgetContent(replaced.contentHash, replaced.contentSize);
+        }
+        entry->second.contentHash = contentHash;
+        entry->second.contentSize = contentSize;
+        this->contentIndex[contentHash] = handle;
+        TextureStreamer::instance().addKnownContent(contentHash, contentSize);
+        return false;
+    }
+
+    void addRef(GLuint handle)
+    {
+        this->textures[handle].refCount++;
+    }
+
+    void release(GLuint handle)
+    {
+        unordered_map<GLuint, CachedTexture>::iterator entry = this->textures.find(handle);
+        if (entry == this->textures.end() || --entry->second.refCount > 0)
+        {
+            return;
+        }
+
+        unordered_map<uint64_t, GLuint>::iterator content = this->contentIndex.find(entry->second.contentHash);
+        if (content != this->contentIndex.end() && content->second == handle)
+        {
+            this->contentIndex.erase(content);
+            TextureStreamer::instance().forgetContent(entry->second.contentHash, entry->second.contentSize);
+        }
+
+        // every path that led to this texture
+        for (unordered_map<string, GLuint>::iterator it = this->pathIndex.begin(); it != this->pathIndex.end(); )
+        {
+            it = it->second == handle ? this->pathIndex.erase(it) : ++it;
+        }
+
+        GLuint shown = entry->second.shown;
+        TextureStreamer::instance().cancel(handle);
+        TextureArrayPool::instance().destroyTexture(handle);
+        this->textures.erase(entry);
+
+        // a duplicate holds a reference to the texture it shows
+        if (shown != handle)
+        {
+            this->release(shown);
+        }
+    }
+
+
+public:
+
+    static TextureCache& instance()
+    {
+        static TextureCache cache;
+        return cache;
+    }
+
+    // join a material-relative texture path onto its directory, unify the separators (the MTLs use '\')
+    // and collapse "." / ".." segments: "models/-z_front/..\textures\wood.jpg" -> "models/textures/wood.jpg"
+    static string normalizePath(const string& directory, const string& path)
+    {
+        string joined = directory.empty() ? path : directory + '/' + path;
+        for (size_t i = 0; i < joined.size(); i++)
+        {
+            if (joined[i] == '\\')
+            {
+                joined[i] = '/';
+            }
+        }
+
+        vector<string> segments;
+        size_t start = 0;
+        while (start <= joined.size())
+        {
+            size_t end = joined.find('/', start);
+            if (end == string::npos)
+            {
+                end = joined.size();
+            }
+            string segment = joined.substr(start, end - start);
+
+            if (segment == "..")
+            {
+                if (!segments.empty() && segments.back() != "..")
+                {
+                    segments.pop_back();
+                }
+                else
+                {
+                    segments.push_back(segment);
+                }
+            }
+            else if (!segment.empty() && segment != ".")
+            {
+                segments.push_back(segment);
+            }
+            start = end + 1;
+        }
+
+        string normalized = joined.size() > 0 && joined[0] == '/' ? "/" : "";
+        for (size_t i = 0; i < segments.size(); i++)
+        {
+            normalized += (i > 0 ? "/" : "") + segments[i];
+        }
+        return normalized;
+    }
+
+    // paths are compared case-insensitively (the assets are authored on Windows)
+    static string pathKey(const string& normalizedPath)
+    {
+        string key = normalizedPath;
+        for (size_t i = 0; i < key.size(); i++)
+        {
+            key[i] = char(tolower((unsigned char)key[i]));
+        }
+        return key;
+    }
+
+    // returns the texture for <path> (relative to <directory>), loading it if its path isn't known
+    // the caller owns one reference and must hand it back with releaseTexture()
+    Texture acquireTexture(const string& directory, const aiString& path, const string& texType)
+    {
+        Texture texture;
+        texture.type = texType;
+        texture.path = path;
+
+        string filename = normalizePath(directory, path.C_Str());
+        string key = pathKey(filename);
+
+        // 1) same (normalized) path
+        unordered_map<string, GLuint>::iterator byPath = this->pathIndex.find(key);
+        if (byPath != this->pathIndex.end())
+        {
+            texture.handle = byPath->second;
+            this->addRef(texture.handle);
+            this->pathHits++;
+            return texture;
+        }
+
+        // 2) new path: placeholder now, read and decoded in the background; duplicate contents are found when it is decoded
+        // (neutral grey for color maps, black for specular maps - no highlights until loaded)
+        texture.handle = TextureStreamer::instance().request(filename, texType == "texture_specular" ? PLACEHOLDER_BLACK : PLACEHOLDER_GREY);
+
+        CachedTexture entry;
+        entry.filename = filename;
+        entry.contentHash = 0;
+        entry.contentSize = 0;
+        entry.shown = texture.handle;
+        entry.refCount = 1;
+        this->textures[texture.handle] = entry;
+        this->pathIndex[key] = texture.handle;
+        this->misses++;
+
+        return texture;
+    }
+
+    void releaseTexture(const Texture& texture)
+    {
+        this->release(texture.handle);
+    }
+
+    // looks up a material's texture set by key; on a hit the caller owns one reference to the material
+    bool acquireMaterial(const string& materialKey, vector<Texture>& textures)
+    {
+        unordered_map<string, CachedMaterial>::iterator material = this->materials.find(materialKey);
+        if (material == this->materials.end())
+        {
+            return false;
+        }
+
+        material->second.refCount++;
+        textures = material->second.textures;
+        return true;
+    }
+
+    // registers a freshly loaded texture set; the material takes over the caller's texture references
+    // and the caller owns one reference to the material
+    void storeMaterial(const string& materialKey, const vector<Texture>& textures)
+    {
+        CachedMaterial material;
+        material.textures = textures;
+        material.refCount = 1;
+        this->materials[materialKey] = material;
+    }
+
+    void releaseMaterial(const string& materialKey)
+    {
+        unordered_map<string, CachedMaterial>::iterator material = this->materials.find(materialKey);
+        if (material == this->materials.end() || --material->second.refCount > 0)
+        {
+            return;
+        }
+
+        for (GLuint i = 0; i < material->second.textures.size(); i++)
+        {
+            this->release(material->second.textures[i].handle);
+        }
+        this->materials.erase(material);
+    }
+
+    void printStats()
+    {
+        cout << "TextureCache: " << this->textures.size() << " textures, " << this->materials.size() << " materials; "
+             << this->pathHits << " path hits, " << this->contentHits << " content hits, " << this->misses << " loads\n";
+    }
+};
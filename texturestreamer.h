@@ -0,0 +1,400 @@
+#pragma once
+
+#include <string>
+#include <iostream>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <unordered_set>
+#include <unordered_map>
+#include <set>
+#include <utility>
+#include <functional>
+#include <cstdio>
+#include <cstdint>
+
+#include <GL/glew.h>
+#include "SOIL2/SOIL2.h"
+#include "texturearray.h"
+#include "startuptrace.h"
+
+using namespace std;
+
+
+// default upload budget: how many bytes of decoded pixels (all mip levels) may be sent to the GPU per frame
+// (at least one texture is always uploaded, so a single 2k image still makes progress)
+const size_t TEXTURE_UPLOAD_BUDGET = 4 * 1024 * 1024;
+
+
+// Reads, hashes and decodes image files on a pool of worker threads and uploads them on the GL thread.
+// Requested textures are drawn with their 1x1 placeholder layer right away;
+// pump() later stores the real image in a TextureArrayPool layer.
+// Files whose contents are already known (see addKnownContent) are only read and hashed, not decoded.
+class TextureStreamer
+{
+
+private:
+
+    struct DecodeJob
+    {
+        GLuint request;         // id of the request (never reused, unlike a handle may be)
+        GLuint handle;          // TextureArrayPool handle
+        string filename;
+        bool decodeKnown;       // decode even if the contents are known (the texture they were known by is gone)
+    };
+
+    struct DecodedImage
+    {
+        GLuint request;
+        GLuint handle;
+        string filename;
+        int width, height;
+        unsigned char* pixels;  // owned by SOIL, NULL if decoding failed
+        vector<vector<unsigned char>> mips;     // levels 1.. of the mip chain
+        uint64_t contentHash;   // of the file's bytes, for finding the same image under another name
+        size_t contentSize;     // 0: the file couldn't be read
+        bool known;             // the contents were known, so they weren't decoded (pixels is NULL)
+    };
+
+    vector<thread> workers;
+
+    deque<DecodeJob> pendingJobs;       // waiting for a worker
+    deque<DecodedImage> decodedImages;  // waiting for the GL thread
+    unordered_set<GLuint> decoding;     // requests taken by a worker, not yet decoded
+    unordered_set<GLuint> cancelled;    // requests whose texture was destroyed while a worker was decoding it
+    unordered_map<GLuint, GLuint> requests;     // texture handle -> its request still in the pipeline (GL thread only)
+    GLuint nextRequest;
+    set<pair<uint64_t, size_t>> knownContents;  // (hash, size) of the contents already in a layer
+    function<bool(GLuint, uint64_t, size_t, bool)> duplicateResolver;
+
+    mutex queueMutex;
+    condition_variable jobAvailable;
+    bool stopping;
+
+
+    TextureStreamer()
+    {
+        this->stopping = false;
+        this->nextRequest = 0;
+
+        // leave one core for the GL thread
+        unsigned int workerCount = thread::hardware_concurrency();
+        workerCount = workerCount > 1 ? min(workerCount - 1, 4u) : 1;
+
+        for (unsigned int i = 0; i < workerCount; i++)
+        {
+            this->workers.push_back(thread(&TextureStreamer::workerLoop, this, int(i)));
+        }
+    }
+
+    ~TextureStreamer()
+    {
+        {
+            lock_guard<mutex> lock(this->queueMutex);
+            this->stopping = true;
+            this->pendingJobs.clear();
+        }
+        this->jobAvailable.notify_all();
+
+        for (GLuint i = 0; i < this->workers.size(); i++)
+        {
+            this->workers[i].join();
+        }
+
+        // the GL context is gone by now - only the CPU copies need freeing
+        for (GLuint i = 0; i < this->decodedImages.size(); i++)
+        {
+            SOIL_free_image_data(this->decodedImages[i].pixels);
+        }
+    }
+
+    TextureStreamer(const TextureStreamer&) = delete;
+    TextureStreamer& operator=(const TextureStreamer&) = delete;
+
+
+    // 64-bit FNV-1a
+    static uint64_t hashBytes(const vector<unsigned char>& bytes)
+    {
+        uint64_t hash = 14695981039346656037ull;
+        for (size_t i = 0; i < bytes.size(); i++)
+        {
+            hash ^= bytes[i];
+            hash *= 1099511628211ull;
+        }
+        return hash;
+    }
+
+    static bool readFile(const string& filename, vector<unsigned char>& bytes)
+    {
+        #pragma warning(suppress : 4996)
+        FILE* file = fopen(filename.c_str(), "rb");
+        if (file == NULL)
+        {
+            return false;
+        }
+
+        fseek(file, 0, SEEK_END);
+        long size = ftell(file);
+        fseek(file, 0, SEEK_SET);
+
+        bytes.resize(size > 0 ? size_t(size) : 0);
+        size_t read = bytes.empty() ? 0 : fread(&bytes[0], 1, bytes.size(), file);
+        fclose(file);
+
+        return read == bytes.size();
+    }
+
+    // worker thread: read, hash and decode queued files until the streamer is destroyed
+    void workerLoop(int index)
+    {
+        StartupTrace::instance().nameThread("texture decoder " + to_string(index));
+        while (true)
+        {
+            DecodeJob job;
+            {
+                unique_lock<mutex> lock(this->queueMutex);
+                this->jobAvailable.wait(lock, [this] { return this->stopping || !this->pendingJobs.empty(); });
+
+                if (this->stopping)
+                {
+                    return;
+                }
+
+                job = move(this->pendingJobs.front());
+                this->pendingJobs.pop_front();
+                this->decoding.insert(job.request);
+            }
+
+            DecodedImage image;
+            image.request = job.request;
+            image.handle = job.handle;
+            image.filename = job.filename;
+            image.width = 0;
+            image.height = 0;
+            image.pixels = NULL;
+
+            vector<unsigned char> bytes;
+            bool read;
+            {
+                TraceScope scope(STAGE_FILE_READ, job.filename);
+                read = readFile(job.filename, bytes);
+            }
+            image.contentHash = hashBytes(bytes);
+            image.contentSize = read ? bytes.size() : 0;
+            image.known = false;
+            if (read && !job.decodeKnown)
+            {
+                lock_guard<mutex> lock(this->queueMutex);
+                image.known = this->knownContents.count(make_pair(image.contentHash, image.contentSize)) > 0;
+            }
+            if (read && !bytes.empty() && !image.known)
+            {
+                TraceScope decode(STAGE_TEXTURE_DECODE, job.filename);
+                image.pixels = SOIL_load_image_from_memory(bytes.data(), int(bytes.size()), &image.width, &image.height, 0, SOIL_LOAD_RGB);
+                if (image.pixels != NULL)
+                {
+                    TextureArrayPool::buildMipChain(image.pixels, image.width, image.height, image.mips);
+                }
+            }
+
+            lock_guard<mutex> lock(this->queueMutex);
+            this->decoding.erase(job.request);
+            this->decodedImages.push_back(move(image));
+        }
+    }
+
+    // GL thread: replace the placeholder image with the decoded one
+    void upload(const DecodedImage& image)
+    {
+        if (image.pixels == NULL)
+        {
+            cout << "TextureStreamer: failed to decode " << image.filename << ", keeping the placeholder\n";
+            return;
+        }
+
+        TraceScope upload(STAGE_GL_UPLOAD, image.filename);
+        TextureArrayPool::instance().upload(image.handle, image.width, image.height, image.pixels, image.mips);
+        SOIL_free_image_data(image.pixels);
+    }
+
+
+public:
+
+    static TextureStreamer& instance()
+    {
+        static TextureStreamer streamer;
+        return streamer;
+    }
+
+    // GL thread: create a texture handle showing the given placeholder layer and queue the file for reading and decoding
+    GLuint request(const string& filename, GLint placeholder)
+    {
+        GLuint handle = TextureArrayPool::instance().createTexture(placeholder, filename);
+
+        {
+            lock_guard<mutex> lock(this->queueMutex);
+            DecodeJob job;
+            job.request = this->nextRequest++;
+            job.handle = handle;
+            this->requests[handle] = job.request;
+            job.filename = filename;
+            job.decodeKnown = false;
+            this->pendingJobs.push_back(move(job));
+        }
+        this->jobAvailable.notify_one();
+
+        return handle;
+    }
+
+    // resolver(handle, contentHash, contentSize, decoded) is called on the GL thread for every read image before it is uploaded;
+    // returning true means the handle now shows another texture's layer and the image is dropped
+    // (decoded is false for known contents the worker skipped: they can only be shown, not uploaded)
+    void setDuplicateResolver(function<bool(GLuint, uint64_t, size_t, bool)> resolver)
+    {
+        this->duplicateResolver = resolver;
+    }
+
+    // contents that are in a layer from now on: workers skip decoding files with the same (hash, size)
+    void addKnownContent(uint64_t contentHash, size_t contentSize)
+    {
+        lock_guard<mutex> lock(this->queueMutex);
+        this->knownContents.insert(make_pair(contentHash, contentSize));
+    }
+
+    // the texture holding the contents was destroyed
+    void forgetContent(uint64_t contentHash, size_t contentSize)
+    {
+        lock_guard<mutex> lock(this->queueMutex);
+        this->knownContents.erase(make_pair(contentHash, contentSize));
+    }
+
+    // GL thread, once per frame: upload finished images until the byte budget is spent
+    // returns the number of textures swapped in
+    int pump(size_t byteBudget = TEXTURE_UPLOAD_BUDGET)
+    {
+        int uploaded = 0;
+        size_t bytesUploaded = 0;
+
+        while (uploaded == 0 || bytesUploaded < byteBudget)
+        {
+            DecodedImage image;
+            {
+                lock_guard<mutex> lock(this->queueMutex);
+                if (this->decodedImages.empty())
+                {
+                    break;
+                }
+                image = move(this->decodedImages.front());
+                this->decodedImages.pop_front();
+            }
+
+            if (this->cancelled.erase(image.request) > 0)
+            {
+                SOIL_free_image_data(image.pixels);
+                continue;
+            }
+
+            // the same file contents are already in a layer: show that one instead of uploading a copy
+            bool duplicate = (image.known || image.pixels != NULL) && image.contentSize > 0 && this->duplicateResolver
+                && this->duplicateResolver(image.handle, image.contentHash, image.contentSize, !image.known);
+            if (image.known && !duplicate)
+            {
+                // the texture the contents were known by was destroyed since: decode them after all
+                {
+                    lock_guard<mutex> lock(this->queueMutex);
+                    DecodeJob job;
+                    job.request = image.request;
+                    job.handle = image.handle;
+                    job.filename = image.filename;
+                    job.decodeKnown = true;
+                    this->pendingJobs.push_back(move(job));
+                }
+                this->jobAvailable.notify_one();
+                continue;
+            }
+
+            unordered_map<GLuint, GLuint>::iterator current = this->requests.find(image.handle);
+            if (current != this->requests.end() && current->second == image.request)
+            {
+                this->requests.erase(current);
+            }
+            if (duplicate)
+            {
+                SOIL_free_image_data(image.pixels);
+                uploaded++;
+                continue;
+            }
+
+            this->upload(image);
+            bytesUploaded += size_t(image.width) * image.height * 3;
+            for (size_t level = 0; level < image.mips.size(); level++)
+            {
+                bytesUploaded += image.mips[level].size();
+            }
+            uploaded++;
+        }
+
+        return uploaded;
+    }
+
+    // GL thread: drop a texture that is about to be destroyed, wherever it is in the pipeline
+    // (found by its request, so an image decoded for a destroyed texture never lands in one that got its handle later)
+    void cancel(GLuint handle)
+    {
+        unordered_map<GLuint, GLuint>::iterator found = this->requests.find(handle);
+        if (found == this->requests.end())
+        {
+            return;
+        }
+        GLuint request = found->second;
+        this->requests.erase(found);
+
+        lock_guard<mutex> lock(this->queueMutex);
+
+        for (GLuint i = 0; i < this->pendingJobs.size(); i++)
+        {
+            if (this->pendingJobs[i].request == request)
+            {
+                this->pendingJobs.erase(this->pendingJobs.begin() + i);
+                return;
+            }
+        }
+
+        for (GLuint i = 0; i < this->decodedImages.size(); i++)
+        {
+            if (this->decodedImages[i].request == request)
+            {
+                SOIL_free_image_data(this->decodedImages[i].pixels);
+                this->decodedImages.erase(this->decodedImages.begin() + i);
+                return;
+            }
+        }
+
+        if (this->decoding.count(request) > 0)
+        {
+            this->cancelled.insert(request);
+        }
+    }
+
+    // true when every requested texture has been swapped in
+    bool isIdle()
+    {
+        lock_guard<mutex> lock(this->queueMutex);
+        return this->pendingJobs.empty() && this->decodedImages.empty() && this->decoding.empty();
+    }
+
+    // GL thread: block until every queued texture is uploaded (for tools/benchmarks that need final images)
+    void finish()
+    {
+        while (!this->isIdle())
+        {
+            if (this->pump(~size_t(0)) == 0)
+            {
+                this_thread::yield();
+            }
+        }
+    }
+};
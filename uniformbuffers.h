@@ -0,0 +1,128 @@
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <cstring>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include "shaderprogram.h"
+#include "memoryaccounting.h"
+
+using namespace std;
+
+
+// uniform buffer binding points shared by every shader program
+const GLuint UBO_BINDING_FRAME = 0;
+const GLuint UBO_BINDING_LIGHTS = 1;
+
+
+// a scene light (world space)
+// radius 0: unbounded, reaches every point without falloff; spotAngle 0: point light
+struct Light
+{
+    glm::vec3 position;
+    glm::vec3 color;
+    GLfloat shininess;      // specular exponent
+    GLfloat radius;         // range of the light (light fades out towards it)
+    glm::vec3 direction;    // spot lights: direction of the cone axis
+    GLfloat spotAngle;      // spot lights: half-angle of the cone in degrees
+};
+
+
+// std140 mirror of the FrameData block
+struct FrameUniforms
+{
+    glm::mat4 P;
+    glm::mat4 V;
+    glm::mat4 PV;
+    glm::vec4 cameraPosition;
+};
+
+// std140 mirror of the LightData block (the lights themselves are in buffer textures, see clusteredlighting.h)
+struct LightUniforms
+{
+    glm::vec4 ambient;
+    glm::ivec4 lightCount;          // x: number of lights
+    glm::ivec4 clusterGrid;         // xyz: clusters along x, y and depth
+    glm::vec4 clusterParameters;    // xy: framebuffer size, z/w: depth slice scale/bias
+};
+
+
+// Per-frame camera data and the light parameters, kept in two uniform buffers that every program reads
+// through fixed binding points: each is uploaded once (per frame / per change) instead of once per program.
+class UniformBuffers
+{
+
+private:
+
+    GLuint frameUBO;
+    GLuint lightUBO;
+    LightUniforms lightData;
+
+
+public:
+
+    UniformBuffers()
+    {
+        glGenBuffers(1, &this->frameUBO);
+        glBindBuffer(GL_UNIFORM_BUFFER, this->frameUBO);
+        glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameUniforms), NULL, GL_DYNAMIC_DRAW);
+        glBindBufferBase(GL_UNIFORM_BUFFER, UBO_BINDING_FRAME, this->frameUBO);
+
+        memset(&this->lightData, 0, sizeof(this->lightData));
+        glGenBuffers(1, &this->lightUBO);
+        glBindBuffer(GL_UNIFORM_BUFFER, this->lightUBO);
+        glBufferData(GL_UNIFORM_BUFFER, sizeof(LightUniforms), &this->lightData, GL_DYNAMIC_DRAW);
+        glBindBufferBase(GL_UNIFORM_BUFFER, UBO_BINDING_LIGHTS, this->lightUBO);
+
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+        MemoryAccounting::instance().set("uniform buffers", MEMORY_GL_BUFFERS, sizeof(FrameUniforms) + sizeof(LightUniforms));
+    }
+
+    ~UniformBuffers()
+    {
+        glDeleteBuffers(1, &this->frameUBO);
+        glDeleteBuffers(1, &this->lightUBO);
+        MemoryAccounting::instance().set("uniform buffers", MEMORY_GL_BUFFERS, 0);
+    }
+
+    UniformBuffers(const UniformBuffers&) = delete;
+    UniformBuffers& operator=(const UniformBuffers&) = delete;
+
+    // connect the program's FrameData / LightData blocks to the shared binding points (once per program)
+    void attach(ShaderProgram* shader)
+    {
+        shader->bindUniformBlock("FrameData", UBO_BINDING_FRAME);
+        shader->bindUniformBlock("LightData", UBO_BINDING_LIGHTS);
+    }
+
+    // once per frame
+    void updateFrame(const glm::mat4& P, const glm::mat4& V, const glm::vec3& cameraPosition)
+    {
+        FrameUniforms frame;
+        frame.P = P;
+        frame.V = V;
+        frame.PV = P * V;
+        frame.cameraPosition = glm::vec4(cameraPosition, 1.0f);
+
+        glBindBuffer(GL_UNIFORM_BUFFER, this->frameUBO);
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameUniforms), &frame);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    }
+
+    // whenever the light parameters change
+    void setLightData(const LightUniforms& lightData)
+    {
+        if (memcmp(&lightData, &this->lightData, sizeof(LightUniforms)) == 0)
+        {
+            return;
+        }
+        this->lightData = lightData;
+
+        glBindBuffer(GL_UNIFORM_BUFFER, this->lightUBO);
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(LightUniforms), &this->lightData);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    }
+};
@@ -1,46 +1,111 @@
 #version 330
 
-//Zmienne jednorodne
-uniform mat4 P;
-uniform mat4 V;
-uniform mat4 M;
+//Warianty (patrz shaderpermutations.h): LIT, SPECULAR_MAP, INSTANCED, SKINNED_KEY, DEPTH_ONLY, PIANO_INSTANCES
+
+//Dane klatki (wspólne dla wszystkich programów, patrz uniformbuffers.h)
+layout (std140) uniform FrameData
+{
+    mat4 P;
+    mat4 V;
+    mat4 PV;
+    vec4 cameraPosition;
+};
 
 //Atrybuty
 layout ( location = 0 ) in vec4 vertex;     //współrzędne wierzcholka w przestrzeni modelu
-layout ( location = 1 ) in vec4 normal;     //wektor normalny w przestrzeni modelu
+layout ( location = 1 ) in vec3 normal;     //wektor normalny w przestrzeni modelu
 layout ( location = 2 ) in vec2 texCoord0;
 
-//Zmienne interpolowane
+#ifdef INSTANCED
+layout ( location = 3 ) in uint drawIndex;  //numer rysowania (z baseInstance, ten sam dla wszystkich instancji - numer fortepianu to gl_InstanceID, patrz geometrypool.h)
 
-out vec4 l;
-out vec4 n;
-out vec4 v;
+//Rekordy rysowań (patrz renderqueue.h): 5 tekseli na rysowanie - kolumny macierzy modelu, warstwy tekstur, klawisz i jego część
+uniform samplerBuffer drawData;
+uniform int instanceBase;   //przesunięcie numeru rysowania (gdy nie ma baseInstance)
 
-out vec4 l2;
-out vec4 n2;
-out vec4 v2;
+flat out ivec2 materialLayers;  //warstwy tablic tekstur: x - diffuse, y - specular
+#else
+//Zmienne jednorodne
+uniform mat4 M;
+#endif
 
-out vec2 iTexCoord0; 
-out vec2 iTexCoord1;
+#ifdef PIANO_INSTANCES
+//Położenia fortepianów sali koncertowej (patrz concerthall.h): 4 teksele (kolumny macierzy) na fortepian, numer fortepianu = gl_InstanceID
+uniform samplerBuffer pianoPlacements;
+uniform int pianoKeyCount;  //liczba klawiszy jednego fortepianu (klawisze fortepianu i zaczynają się od i * pianoKeyCount)
+#endif
 
-void main(void) {
+#ifdef SKINNED_KEY
+//Tablice ruchomych części klawisza (patrz keyanimation.h)
+layout (std140) uniform KeyParts
+{
+    vec4 keyPartLimits[5];      //x: obrót części (w stopniach, wokół osi x) przy wciśniętym klawiszu
+    vec4 keyPartParents[5];     //xyz: przesunięcie od początku części do osi obrotu rodzica, w: obrót rodzica (0 - brak rodzica)
+};
 
+//Stopień wciśnięcia każdego klawisza (0 - puszczony, 1 - wciśnięty)
+uniform samplerBuffer keyStates;
+
+mat4 rotationX(float degrees) {
+    float c = cos(radians(degrees)), s = sin(radians(degrees));
+    return mat4(1, 0, 0, 0,  0, c, s, 0,  0, -s, c, 0,  0, 0, 0, 1);
+}
+
+mat4 translation(vec3 t) {
+    return mat4(1, 0, 0, 0,  0, 1, 0, 0,  0, 0, 1, 0,  t, 1);
+}
+#endif
+
+//Pozycja liczona tak samo we wszystkich wariantach (test GL_EQUAL po przebiegu głębokości)
+invariant gl_Position;
+
+//Zmienne interpolowane
+out vec4 worldPosition;     // pozycja wierzchołka w przestrzeni świata
+#ifdef LIT
+out vec4 n;                 // wektor normalny w przestrzeni świata
+#endif
+
+out vec2 iTexCoord0;
+
+void main(void) {
 
-    vec4 lp = vec4(2.5, -0.5, 2.2, 1);                       // pozcyja światła, przestrzeń świata
-    l = normalize(V * lp - V*M*vertex);                     // wektor do światła w przestrzeni oka
-    v = normalize(vec4(0, 0, 0, 1) - V * M * vertex);       // wektor do obserwatora w przestrzeni oka
-    n = normalize(M * normal);                              // wektor normalny w przestrzeni oka
+#ifdef INSTANCED
+    int draw = (instanceBase + int(drawIndex)) * 5;
+    mat4 M = mat4(texelFetch(drawData, draw), texelFetch(drawData, draw + 1),
+                  texelFetch(drawData, draw + 2), texelFetch(drawData, draw + 3));
+    vec4 drawExtra = texelFetch(drawData, draw + 4);  //warstwy tekstur, klawisz, część klawisza
+    materialLayers = ivec2(drawExtra.xy);
 
-    
-    vec4 lp2 = vec4(-2.5, 0.5, -2.2, 1);    
-    l2 = normalize(V * lp2 - V*M*vertex);                    
-    v2 = normalize(vec4(0, 0, 0, 1) - V * M * vertex);       
-    n2 = normalize(M * normal);                              
+#ifdef SKINNED_KEY
+    //M to położenie spoczynkowe części - obróć ją wokół własnego początku, a potem razem z rodzicem wokół jego osi
+    int part = int(drawExtra.w);
+    int key = int(drawExtra.z);
+#ifdef PIANO_INSTANCES
+    key += gl_InstanceID * pianoKeyCount;
+#endif
+    float press = texelFetch(keyStates, key).r;
+    vec3 origin = M[3].xyz;
+    M = M * rotationX(press * keyPartLimits[part].x);
+    if (keyPartParents[part].w != 0) {
+        vec3 pivot = origin + keyPartParents[part].xyz;
+        M = translation(pivot) * rotationX(press * keyPartParents[part].w) * translation(-pivot) * M;
+    }
+#endif
 
+#ifdef PIANO_INSTANCES
+    //fortepian ustawiony na swoim miejscu w sali
+    int piano = gl_InstanceID * 4;
+    M = mat4(texelFetch(pianoPlacements, piano), texelFetch(pianoPlacements, piano + 1),
+             texelFetch(pianoPlacements, piano + 2), texelFetch(pianoPlacements, piano + 3)) * M;
+#endif
+#endif
 
+    worldPosition = M * vertex;
+#ifdef LIT
+    n = normalize(M * vec4(normal, 0));
+#endif
 
     iTexCoord0 = texCoord0;
-    iTexCoord1 = (n.xy + 1) / 2;
 
-    gl_Position=P*V*M*vertex;
+    gl_Position = PV * worldPosition;
 }